@@ -0,0 +1,247 @@
+// AdvertisementData.h : Bluetooth LE advertising data parser
+//
+// Copyright (C) 2023, Steven Nyman. License: MIT.
+//
+// Walks the AD structures of an advertisement (length, type, data) once and extracts every field the server reports.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// AD types, Bluetooth Assigned Numbers section 2.3
+const uint8_t AD_TYPE_FLAGS = 0x01;
+const uint8_t AD_TYPE_INCOMPLETE_SERVICE_UUIDS_16 = 0x02;
+const uint8_t AD_TYPE_COMPLETE_SERVICE_UUIDS_16 = 0x03;
+const uint8_t AD_TYPE_INCOMPLETE_SERVICE_UUIDS_32 = 0x04;
+const uint8_t AD_TYPE_COMPLETE_SERVICE_UUIDS_32 = 0x05;
+const uint8_t AD_TYPE_INCOMPLETE_SERVICE_UUIDS_128 = 0x06;
+const uint8_t AD_TYPE_COMPLETE_SERVICE_UUIDS_128 = 0x07;
+const uint8_t AD_TYPE_SHORTENED_LOCAL_NAME = 0x08;
+const uint8_t AD_TYPE_COMPLETE_LOCAL_NAME = 0x09;
+const uint8_t AD_TYPE_TX_POWER_LEVEL = 0x0a;
+const uint8_t AD_TYPE_SERVICE_DATA_16 = 0x16;
+const uint8_t AD_TYPE_APPEARANCE = 0x19;
+const uint8_t AD_TYPE_SERVICE_DATA_32 = 0x20;
+const uint8_t AD_TYPE_SERVICE_DATA_128 = 0x21;
+const uint8_t AD_TYPE_MANUFACTURER_DATA = 0xff;
+
+// Same layout as a Windows GUID
+struct AdvertisementUuid {
+	uint32_t data1;
+	uint16_t data2;
+	uint16_t data3;
+	uint8_t data4[8];
+};
+
+// The data pointers below point into the payload passed to parseAdvertisementData, which must outlive the result
+struct AdvertisementSection {
+	uint8_t type;
+	const uint8_t* data;
+	size_t length;
+};
+
+struct AdvertisementManufacturerData {
+	uint16_t companyIdentifier;
+	const uint8_t* data;
+	size_t length;
+};
+
+struct AdvertisementServiceData {
+	AdvertisementUuid uuid;
+	uint8_t uuidLength; // 2, 4 or 16 bytes as advertised
+	uint32_t shortUuid; // valid when uuidLength is 2 or 4
+	const uint8_t* data;
+	size_t length;
+};
+
+struct ParsedAdvertisement {
+	bool hasFlags;
+	uint8_t flags;
+	bool hasAppearance;
+	uint16_t appearance;
+	bool hasTxPower;
+	int8_t txPower;
+	// UTF-8, not null terminated. A complete name takes precedence over a shortened one.
+	const uint8_t* localName;
+	size_t localNameLength;
+	bool localNameComplete;
+	std::vector<AdvertisementUuid> serviceUuids;
+	std::vector<AdvertisementManufacturerData> manufacturerData;
+	std::vector<AdvertisementServiceData> serviceData;
+	std::vector<AdvertisementSection> sections;
+
+	// Keeps the vectors' capacity so that a reused instance doesn't allocate
+	void clear() {
+		hasFlags = false;
+		flags = 0;
+		hasAppearance = false;
+		appearance = 0;
+		hasTxPower = false;
+		txPower = 0;
+		localName = nullptr;
+		localNameLength = 0;
+		localNameComplete = false;
+		serviceUuids.clear();
+		manufacturerData.clear();
+		serviceData.clear();
+		sections.clear();
+	}
+
+	ParsedAdvertisement() {
+		clear();
+	}
+};
+
+inline AdvertisementUuid shortAdvertisementUuid(uint32_t shortUuid) {
+	// Bluetooth base UUID 00000000-0000-1000-8000-00805f9b34fb
+	return AdvertisementUuid{ shortUuid, 0x0000, 0x1000, { 0x80, 0x00, 0x00, 0x80, 0x5f, 0x9b, 0x34, 0xfb } };
+}
+
+inline uint16_t readLittleEndian16(const uint8_t* data) {
+	return (uint16_t)(data[0] | (data[1] << 8));
+}
+
+inline uint32_t readLittleEndian32(const uint8_t* data) {
+	return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+// 128-bit UUIDs are advertised least significant byte first
+inline AdvertisementUuid readLittleEndianUuid(const uint8_t* data) {
+	AdvertisementUuid uuid;
+	uuid.data1 = readLittleEndian32(data + 12);
+	uuid.data2 = readLittleEndian16(data + 10);
+	uuid.data3 = readLittleEndian16(data + 8);
+	for (int i = 0; i < 8; i++) {
+		uuid.data4[i] = data[7 - i];
+	}
+	return uuid;
+}
+
+inline void parseAdvertisementServiceUuids(const uint8_t* data, size_t length, size_t uuidLength, ParsedAdvertisement& out) {
+	// a trailing partial UUID is ignored
+	for (size_t offset = 0; offset + uuidLength <= length; offset += uuidLength) {
+		switch (uuidLength) {
+			case 2:
+				out.serviceUuids.push_back(shortAdvertisementUuid(readLittleEndian16(data + offset)));
+				break;
+			case 4:
+				out.serviceUuids.push_back(shortAdvertisementUuid(readLittleEndian32(data + offset)));
+				break;
+			default:
+				out.serviceUuids.push_back(readLittleEndianUuid(data + offset));
+				break;
+		}
+	}
+}
+
+inline void parseAdvertisementServiceData(const uint8_t* data, size_t length, uint8_t uuidLength, ParsedAdvertisement& out) {
+	if (length < uuidLength) {
+		return;
+	}
+	AdvertisementServiceData serviceData;
+	serviceData.uuidLength = uuidLength;
+	switch (uuidLength) {
+		case 2:
+			serviceData.shortUuid = readLittleEndian16(data);
+			serviceData.uuid = shortAdvertisementUuid(serviceData.shortUuid);
+			break;
+		case 4:
+			serviceData.shortUuid = readLittleEndian32(data);
+			serviceData.uuid = shortAdvertisementUuid(serviceData.shortUuid);
+			break;
+		default:
+			serviceData.shortUuid = 0;
+			serviceData.uuid = readLittleEndianUuid(data);
+			break;
+	}
+	serviceData.data = data + uuidLength;
+	serviceData.length = length - uuidLength;
+	out.serviceData.push_back(serviceData);
+}
+
+// Extracts the fields of a single AD structure. Structures too short for their type are skipped.
+inline void parseAdvertisementSection(uint8_t type, const uint8_t* data, size_t length, ParsedAdvertisement& out) {
+	out.sections.push_back(AdvertisementSection{ type, data, length });
+
+	switch (type) {
+		case AD_TYPE_FLAGS:
+			if (length >= 1) {
+				out.hasFlags = true;
+				out.flags = data[0];
+			}
+			break;
+		case AD_TYPE_INCOMPLETE_SERVICE_UUIDS_16:
+		case AD_TYPE_COMPLETE_SERVICE_UUIDS_16:
+			parseAdvertisementServiceUuids(data, length, 2, out);
+			break;
+		case AD_TYPE_INCOMPLETE_SERVICE_UUIDS_32:
+		case AD_TYPE_COMPLETE_SERVICE_UUIDS_32:
+			parseAdvertisementServiceUuids(data, length, 4, out);
+			break;
+		case AD_TYPE_INCOMPLETE_SERVICE_UUIDS_128:
+		case AD_TYPE_COMPLETE_SERVICE_UUIDS_128:
+			parseAdvertisementServiceUuids(data, length, 16, out);
+			break;
+		case AD_TYPE_SHORTENED_LOCAL_NAME:
+		case AD_TYPE_COMPLETE_LOCAL_NAME:
+		{
+			bool complete = type == AD_TYPE_COMPLETE_LOCAL_NAME;
+			if (out.localName == nullptr || (complete && !out.localNameComplete)) {
+				out.localName = data;
+				out.localNameLength = length;
+				out.localNameComplete = complete;
+			}
+			break;
+		}
+		case AD_TYPE_TX_POWER_LEVEL:
+			if (length >= 1) {
+				out.hasTxPower = true;
+				out.txPower = (int8_t)data[0];
+			}
+			break;
+		case AD_TYPE_APPEARANCE:
+			if (length >= 2) {
+				out.hasAppearance = true;
+				out.appearance = readLittleEndian16(data);
+			}
+			break;
+		case AD_TYPE_SERVICE_DATA_16:
+			parseAdvertisementServiceData(data, length, 2, out);
+			break;
+		case AD_TYPE_SERVICE_DATA_32:
+			parseAdvertisementServiceData(data, length, 4, out);
+			break;
+		case AD_TYPE_SERVICE_DATA_128:
+			parseAdvertisementServiceData(data, length, 16, out);
+			break;
+		case AD_TYPE_MANUFACTURER_DATA:
+			if (length >= 2) {
+				out.manufacturerData.push_back(AdvertisementManufacturerData{ readLittleEndian16(data), data + 2, length - 2 });
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+// Parses a raw advertising payload into out, which is cleared first. A zero length byte ends the payload early,
+// as allowed by the Core Specification. Returns false if the last AD structure runs past the end of the payload;
+// everything before it is still parsed.
+inline bool parseAdvertisementData(const uint8_t* payload, size_t length, ParsedAdvertisement& out) {
+	out.clear();
+	size_t offset = 0;
+	while (offset < length) {
+		size_t structureLength = payload[offset];
+		if (structureLength == 0) {
+			break;
+		}
+		if (structureLength > length - offset - 1) {
+			return false;
+		}
+		parseAdvertisementSection(payload[offset + 1], payload + offset + 2, structureLength - 1, out);
+		offset += structureLength + 1;
+	}
+	return true;
+}
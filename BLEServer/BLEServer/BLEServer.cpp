@@ -4,7 +4,11 @@
 // Original Copyright (C) 2017, Uri Shaked. License: MIT.
 
 #include "stdafx.h"
-#include <iostream>
+#include "gatt-uuids.h"
+#include "AdvertisementData.h"
+#include "BoundedQueue.h"
+#include "Tracing.h"
+#include "FairScheduler.h"
 #include <Windows.Foundation.h>
 #include <Windows.Devices.Bluetooth.h>
 #include <Windows.Devices.Enumeration.h>
@@ -13,17 +17,29 @@
 #include <Windows.Data.JSON.h>
 #include <wrl/wrappers/corewrappers.h>
 #include <wrl/event.h>
+#include <wrl/client.h>
+#include <robuffer.h>
 #include <collection.h>
 #include <ppltasks.h>
 #include <string>
-#include <sstream> 
-#include <iomanip>
+#include <unordered_map>
+#include <map>
+#include <deque>
+#include <functional>
+#include <list>
+#include <set>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <climits>
 #include <experimental/resumable>
 #include <pplawait.h>
 #include <codecvt>
 #include <stdio.h>  
-#include <fcntl.h>  
-#include <io.h>
+#include <sddl.h>
 
 using namespace Platform;
 using namespace Windows::Devices;
@@ -37,167 +53,2177 @@ auto characteristicsMap = ref new Collections::Map<String^, Bluetooth::GenericAt
 auto characteristicsListenerMap = ref new Collections::Map<String^, Windows::Foundation::EventRegistrationToken>();
 auto characteristicsSubscriptionMap = ref new Collections::Map<String^, JsonValue^>();
 
-auto pairingRequestWaiting = ref new Collections::Map<double, String^>();
-auto pairingRequestUsername = ref new Collections::Map<double, String^>();
-auto pairingRequestPasswordPIN = ref new Collections::Map<double, String^>();
+// keyed by requestKey(client, command id)
+auto pairingRequestWaiting = ref new Collections::Map<String^, String^>();
+auto pairingRequestUsername = ref new Collections::Map<String^, String^>();
+auto pairingRequestPasswordPIN = ref new Collections::Map<String^, String^>();
+
+// Guards the maps above: the client threads, the linger sweep, the services refresh and closeClient all use them at
+// the same time. Never held across an await or a call into a device.
+CRITICAL_SECTION DeviceMapsCriticalSection;
+
+template <typename K, typename V>
+bool findInDeviceMap(Collections::Map<K, V>^ map, K key, V& value) {
+	EnterCriticalSection(&DeviceMapsCriticalSection);
+	bool found = map->HasKey(key);
+	if (found) {
+		value = map->Lookup(key);
+	}
+	LeaveCriticalSection(&DeviceMapsCriticalSection);
+	return found;
+}
+
+template <typename K, typename V>
+void insertIntoDeviceMap(Collections::Map<K, V>^ map, K key, V value) {
+	EnterCriticalSection(&DeviceMapsCriticalSection);
+	map->Insert(key, value);
+	LeaveCriticalSection(&DeviceMapsCriticalSection);
+}
+
+// Returns nullptr when the device isn't connected
+Bluetooth::BluetoothLEDevice^ findDevice(String^ deviceId) {
+	Bluetooth::BluetoothLEDevice^ device = nullptr;
+	findInDeviceMap(devices, deviceId, device);
+	return device;
+}
+
+// The cached characteristics of the device, keyed by characteristicKey
+std::vector<std::pair<String^, Bluetooth::GenericAttributeProfile::GattCharacteristic^>> cachedDeviceCharacteristics(String^ deviceId) {
+	std::wstring keyPrefix = deviceId->Data();
+	keyPrefix += L"//";
+	std::vector<std::pair<String^, Bluetooth::GenericAttributeProfile::GattCharacteristic^>> result;
+	EnterCriticalSection(&DeviceMapsCriticalSection);
+	for (auto pair : characteristicsMap) {
+		if (wcsncmp(pair->Key->Data(), keyPrefix.c_str(), keyPrefix.length()) == 0) {
+			result.push_back(std::make_pair(pair->Key, pair->Value));
+		}
+	}
+	LeaveCriticalSection(&DeviceMapsCriticalSection);
+	return result;
+}
 
 auto bluetoothAddressGattIdMap = ref new Collections::Map<unsigned long long, String^>();
 std::unordered_map<unsigned long long, concurrency::task_completion_event<String^>> bleInProgressLookups;
 
-auto API_VERSION = 1; // increment this when there are breaking changes to the message format
+auto API_VERSION = 1; // increment this when there are breaking changes to the message format
+
+// Lookup tables for formatting and parsing hex strings without going through iostreams / CRT parsing
+const wchar_t HEX_DIGITS[] = L"0123456789abcdef";
+
+struct HexDecodeTable {
+	signed char values[128];
+
+	constexpr HexDecodeTable() : values() {
+		for (int i = 0; i < 128; i++) {
+			values[i] = -1;
+		}
+		for (int i = 0; i < 10; i++) {
+			values['0' + i] = (signed char)i;
+		}
+		for (int i = 0; i < 6; i++) {
+			values['a' + i] = (signed char)(10 + i);
+			values['A' + i] = (signed char)(10 + i);
+		}
+	}
+};
+
+constexpr HexDecodeTable HEX_DECODE;
+
+inline int hexValue(wchar_t c) {
+	return c < 128 ? HEX_DECODE.values[c] : -1;
+}
+
+// aa:bb:cc:dd:ee:ff
+const unsigned int BLUETOOTH_ADDRESS_LENGTH = 17;
+
+// Formats into a caller-provided buffer; wrap the result in a StringReference to pass it to WinRT without allocating
+void formatBluetoothAddress(unsigned long long bluetoothAddress, wchar_t (&out)[BLUETOOTH_ADDRESS_LENGTH + 1]) {
+	for (int i = 0; i < 6; i++) {
+		unsigned int octet = (bluetoothAddress >> ((5 - i) * 8)) & 0xff;
+		out[i * 3] = HEX_DIGITS[octet >> 4];
+		out[i * 3 + 1] = HEX_DIGITS[octet & 0xf];
+		out[i * 3 + 2] = L':';
+	}
+	out[BLUETOOTH_ADDRESS_LENGTH] = L'\0';
+}
+
+// Accepts 12 hex digits, optionally separated by colons
+unsigned long long parseBluetoothAddress(String^ address) {
+	unsigned long long result = 0;
+	unsigned int digits = 0;
+	const wchar_t* str = address->Data();
+	for (unsigned int i = 0; i < address->Length(); i++) {
+		if (str[i] == L':') {
+			continue;
+		}
+		int value = hexValue(str[i]);
+		if (value < 0 || ++digits > 12) {
+			digits = 0;
+			break;
+		}
+		result = (result << 4) | value;
+	}
+	if (digits != 12) {
+		std::wstring msg = L"Invalid Bluetooth address: ";
+		msg += address->Data();
+		throw ref new InvalidArgumentException(ref new String(msg.c_str()));
+	}
+	return result;
+}
+
+// {xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}, matching the format of Guid::ToString()
+const unsigned int UUID_STRING_LENGTH = 38;
+
+void formatUuid(const GUID& uuid, wchar_t (&out)[UUID_STRING_LENGTH + 1]) {
+	unsigned char bytes[16] = {
+		(unsigned char)(uuid.Data1 >> 24), (unsigned char)(uuid.Data1 >> 16), (unsigned char)(uuid.Data1 >> 8), (unsigned char)uuid.Data1,
+		(unsigned char)(uuid.Data2 >> 8), (unsigned char)uuid.Data2,
+		(unsigned char)(uuid.Data3 >> 8), (unsigned char)uuid.Data3,
+	};
+	memcpy(bytes + 8, uuid.Data4, 8);
+
+	wchar_t* pos = out;
+	*pos++ = L'{';
+	for (int i = 0; i < 16; i++) {
+		if (i == 4 || i == 6 || i == 8 || i == 10) {
+			*pos++ = L'-';
+		}
+		*pos++ = HEX_DIGITS[bytes[i] >> 4];
+		*pos++ = HEX_DIGITS[bytes[i] & 0xf];
+	}
+	*pos++ = L'}';
+	*pos = L'\0';
+}
+
+GUID shortUuidToGuid(unsigned int shortUuid) {
+	// Bluetooth base UUID 00000000-0000-1000-8000-00805f9b34fb
+	return GUID{ shortUuid, 0x0000, 0x1000, { 0x80, 0x00, 0x00, 0x80, 0x5f, 0x9b, 0x34, 0xfb } };
+}
+
+// Returns the 16-bit value of a UUID derived from the Bluetooth base UUID, or -1 otherwise
+int guidToShortUuid(const GUID& uuid) {
+	GUID base = shortUuidToGuid(0);
+	if (uuid.Data1 > 0xffff || uuid.Data2 != base.Data2 || uuid.Data3 != base.Data3 || memcmp(uuid.Data4, base.Data4, 8) != 0) {
+		return -1;
+	}
+	return (int)uuid.Data1;
+}
+
+// Accepts a 4 digit short UUID or a full UUID with or without braces
+bool tryParseUuid(const wchar_t* str, unsigned int len, GUID& out) {
+	if (len == 4) {
+		unsigned int shortUuid = 0;
+		for (unsigned int i = 0; i < 4; i++) {
+			int value = hexValue(str[i]);
+			if (value < 0) {
+				return false;
+			}
+			shortUuid = (shortUuid << 4) | value;
+		}
+		out = shortUuidToGuid(shortUuid);
+		return true;
+	}
+	if (len == UUID_STRING_LENGTH && str[0] == L'{' && str[UUID_STRING_LENGTH - 1] == L'}') {
+		str++;
+		len -= 2;
+	}
+	if (len != UUID_STRING_LENGTH - 2) {
+		return false;
+	}
+
+	unsigned char bytes[16];
+	unsigned int byteIndex = 0;
+	for (unsigned int i = 0; i < len; i++) {
+		if (i == 8 || i == 13 || i == 18 || i == 23) {
+			if (str[i] != L'-') {
+				return false;
+			}
+			continue;
+		}
+		int high = hexValue(str[i]);
+		int low = hexValue(str[++i]);
+		if (high < 0 || low < 0) {
+			return false;
+		}
+		bytes[byteIndex++] = (unsigned char)((high << 4) | low);
+	}
+
+	out.Data1 = ((unsigned long)bytes[0] << 24) | ((unsigned long)bytes[1] << 16) | ((unsigned long)bytes[2] << 8) | bytes[3];
+	out.Data2 = (unsigned short)((bytes[4] << 8) | bytes[5]);
+	out.Data3 = (unsigned short)((bytes[6] << 8) | bytes[7]);
+	memcpy(out.Data4, bytes + 8, 8);
+	return true;
+}
+
+Guid parseUuid(String^ uuid) {
+	GUID rawguid;
+	if (tryParseUuid(uuid->Data(), uuid->Length(), rawguid)) {
+		return Guid(rawguid);
+	}
+	else {
+		std::wstring msg = L"Invalid UUID: ";
+		msg += uuid->Data();
+		throw ref new InvalidArgumentException(ref new String(msg.c_str()));
+	}
+}
+
+struct GuidHash {
+	size_t operator()(const GUID& uuid) const {
+		unsigned long long words[2];
+		static_assert(sizeof(words) == sizeof(GUID), "GUID must be 16 bytes");
+		memcpy(words, &uuid, sizeof(words));
+		return std::hash<unsigned long long>()(words[0] ^ (words[1] * 0x9e3779b97f4a7c15ULL));
+	}
+};
+
+// Interned UUID strings. Standard GATT UUIDs are always kept, other UUIDs are kept until the table is full
+// so that a flood of random 128-bit UUIDs from nearby advertisers can't grow it without bound.
+const size_t MAX_INTERNED_CUSTOM_UUIDS = 4096;
+std::unordered_map<GUID, String^, GuidHash> internedUuids;
+size_t internedCustomUuidCount = 0;
+
+CRITICAL_SECTION UuidCriticalSection;
+
+String^ uuidToString(Guid uuid) {
+	GUID rawguid = uuid;
+
+	EnterCriticalSection(&UuidCriticalSection);
+	auto existing = internedUuids.find(rawguid);
+	if (existing != internedUuids.end()) {
+		String^ result = existing->second;
+		LeaveCriticalSection(&UuidCriticalSection);
+		return result;
+	}
+	LeaveCriticalSection(&UuidCriticalSection);
+
+	wchar_t text[UUID_STRING_LENGTH + 1];
+	formatUuid(rawguid, text);
+	String^ result = ref new String(text, UUID_STRING_LENGTH);
+
+	int shortUuid = guidToShortUuid(rawguid);
+	bool standard = shortUuid >= 0 && std::binary_search(std::begin(STANDARD_GATT_SHORT_UUIDS), std::end(STANDARD_GATT_SHORT_UUIDS), (unsigned short)shortUuid);
+
+	EnterCriticalSection(&UuidCriticalSection);
+	if (standard || internedCustomUuidCount < MAX_INTERNED_CUSTOM_UUIDS) {
+		if (internedUuids.emplace(rawguid, result).second && !standard) {
+			internedCustomUuidCount++;
+		}
+	}
+	LeaveCriticalSection(&UuidCriticalSection);
+
+	return result;
+}
+
+// Windows::Foundation::DateTime counts 100ns intervals since 1601-01-01 UTC
+const long long UNIX_EPOCH_UNIVERSAL_TIME = 116444736000000000LL;
+
+// Milliseconds since the Unix epoch, keeping the sub-millisecond part
+double universalTimeToUnixMs(long long universalTime) {
+	return (double)(universalTime - UNIX_EPOCH_UNIVERSAL_TIME) / 10000.0;
+}
+
+long long currentUniversalTime() {
+	FILETIME now;
+	GetSystemTimePreciseAsFileTime(&now);
+	return ((long long)now.dwHighDateTime << 32) | now.dwLowDateTime;
+}
+
+// Payloads are read and written through the buffer's own memory rather than DataReader::ReadByte and
+// DataWriter::WriteByte, which cost a virtual call per byte. The pointer is valid while the buffer is referenced.
+uint8_t* bufferBytes(Windows::Storage::Streams::IBuffer^ buffer) {
+	Microsoft::WRL::ComPtr<Windows::Storage::Streams::IBufferByteAccess> byteAccess;
+	HRESULT hr = reinterpret_cast<IInspectable*>(buffer)->QueryInterface(IID_PPV_ARGS(&byteAccess));
+	if (FAILED(hr)) {
+		throw Exception::CreateException(hr);
+	}
+	byte* bytes = nullptr;
+	hr = byteAccess->Buffer(&bytes);
+	if (FAILED(hr)) {
+		throw Exception::CreateException(hr);
+	}
+	return bytes;
+}
+
+JsonArray^ bytesToJson(const uint8_t* data, size_t length) {
+	auto result = ref new JsonArray();
+	for (size_t i = 0; i < length; i++) {
+		result->Append(JsonValue::CreateNumberValue(data[i]));
+	}
+	return result;
+}
+
+JsonArray^ bufferToJson(Windows::Storage::Streams::IBuffer^ buffer) {
+	unsigned int length = buffer->Length;
+	return bytesToJson(length > 0 ? bufferBytes(buffer) : nullptr, length);
+}
+
+// The byte values of a command's JSON array, written straight into the memory of a new buffer
+Windows::Storage::Streams::IBuffer^ jsonToBuffer(JsonArray^ values) {
+	unsigned int length = values->Size;
+	auto buffer = ref new Windows::Storage::Streams::Buffer(length);
+	buffer->Length = length;
+	if (length > 0) {
+		uint8_t* bytes = bufferBytes(buffer);
+		for (unsigned int i = 0; i < length; i++) {
+			bytes[i] = (uint8_t)values->GetNumberAt(i);
+		}
+	}
+	return buffer;
+}
+
+CRITICAL_SECTION BLELookupCriticalSection;
+
+// A frame shared by the outbound queues of its targets. written, if set, runs on each target's writer thread once the
+// frame is in that client's pipe.
+struct OutboundFrame {
+	std::string bytes;
+	std::function<void()> written;
+};
+
+// A native messaging connection: stdin/stdout when running standalone, or one pipe instance per client in daemon mode
+struct Client {
+	unsigned int id;
+	HANDLE input;
+	HANDLE output;
+	HANDLE writeEvent;
+	bool ownsHandles;
+	// Frames wait in outbound for the client's writer thread, see writeOutbound, so that a client that stops reading
+	// its pipe only stalls itself. Guarded by outputCriticalSection.
+	CRITICAL_SECTION outputCriticalSection;
+	std::deque<std::shared_ptr<const OutboundFrame>> outbound;
+	size_t outboundBytes = 0; // queued and being written
+	bool outputClosed = false; // the client is gone or fell too far behind, nothing more is queued
+	HANDLE outboundReady;
+
+	Client(unsigned int id, HANDLE input, HANDLE output, bool ownsHandles) : id(id), input(input), output(output), ownsHandles(ownsHandles) {
+		writeEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+		outboundReady = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+		InitializeCriticalSectionAndSpinCount(&outputCriticalSection, 0x00000400);
+	}
+
+	// Pipe handles are closed only once no writer can still be using them
+	~Client() {
+		if (ownsHandles) {
+			CloseHandle(input);
+			if (output != input) {
+				CloseHandle(output);
+			}
+		}
+		CloseHandle(writeEvent);
+		CloseHandle(outboundReady);
+		DeleteCriticalSection(&outputCriticalSection);
+	}
+};
+
+// Guards the client registry and the per-client routing state below
+CRITICAL_SECTION ClientsCriticalSection;
+std::unordered_map<unsigned int, std::shared_ptr<Client>> clients;
+unsigned int nextClientId = 1;
+ULONGLONG lastClientDisconnect = 0;
+
+// A subscriber is a client plus a name the client picked for one of its own consumers, such as a page. Clients that
+// don't name their subscribers share the empty name.
+typedef std::pair<unsigned int, std::wstring> Subscriber;
+
+// Everyone subscribed to a characteristic, with how many times each subscribed. Notifications are enabled on the device
+// once for all of them and disabled when the last one leaves.
+struct CharacteristicSubscribers {
+	std::map<Subscriber, unsigned int> counts;
+
+	std::vector<unsigned int> clients() const {
+		std::vector<unsigned int> result;
+		for (auto& pair : counts) {
+			if (result.empty() || result.back() != pair.first.first) {
+				result.push_back(pair.first.first);
+			}
+		}
+		return result;
+	}
+
+	bool hasClient(unsigned int clientId) const {
+		auto found = counts.lower_bound(Subscriber(clientId, std::wstring()));
+		return found != counts.end() && found->first.first == clientId;
+	}
+
+	// Returns true if the client had subscribed
+	bool removeClient(unsigned int clientId) {
+		auto first = counts.lower_bound(Subscriber(clientId, std::wstring()));
+		auto last = first;
+		while (last != counts.end() && last->first.first == clientId) {
+			last++;
+		}
+		counts.erase(first, last);
+		return first != last;
+	}
+};
+
+// Clients holding each connected device and subscribers to each characteristic
+std::unordered_map<std::wstring, std::set<unsigned int>> deviceClients;
+std::unordered_map<std::wstring, CharacteristicSubscribers> characteristicSubscribers;
+
+// Tail of the CCCD writes queued for each characteristic, see CccdLock
+std::unordered_map<std::wstring, concurrency::task<void>> cccdWrites;
+
+// Held while a characteristic's CCCD is being written. Concurrent subscribes and unsubscribes of the same characteristic
+// queue up behind each other, so that the first subscriber enables notifications once and the others find them enabled.
+class CccdLock {
+public:
+	explicit CccdLock(String^ key) : key(key->Data()) {
+		EnterCriticalSection(&ClientsCriticalSection);
+		auto found = cccdWrites.find(this->key);
+		previous = found != cccdWrites.end() ? found->second : concurrency::task_from_result();
+		own = concurrency::create_task(released);
+		cccdWrites[this->key] = own;
+		LeaveCriticalSection(&ClientsCriticalSection);
+	}
+
+	CccdLock(const CccdLock&) = delete;
+	CccdLock& operator=(const CccdLock&) = delete;
+
+	~CccdLock() {
+		EnterCriticalSection(&ClientsCriticalSection);
+		auto found = cccdWrites.find(key);
+		if (found != cccdWrites.end() && found->second == own) {
+			cccdWrites.erase(found);
+		}
+		LeaveCriticalSection(&ClientsCriticalSection);
+		released.set();
+	}
+
+	// Completes once every earlier holder released the lock
+	concurrency::task<void> acquired() {
+		return previous;
+	}
+
+private:
+	std::wstring key;
+	concurrency::task_completion_event<void> released;
+	concurrency::task<void> previous;
+	concurrency::task<void> own;
+};
+
+// Per-subscription notification counters, reported by the subscriptionStats command. Times are in the 100ns units of
+// Windows::Foundation::DateTime; averages are exponentially weighted over roughly the last 16 notifications.
+struct NotificationStats {
+	double subscriptionId;
+	unsigned long long sequence = 0;
+	unsigned long long bytes = 0;
+	long long firstTimestamp = 0;
+	long long lastTimestamp = 0;
+	double intervalAverage = 0;
+	double lastInterval = 0;
+	double jitter = 0; // mean deviation between consecutive inter-arrival times, as in RFC 3550
+	// from reception until the notification was written to a client's pipe, sampled once per client
+	unsigned long long queueDelaySamples = 0;
+	double queueDelayAverage = 0;
+	double queueDelayMax = 0;
+};
+
+CRITICAL_SECTION NotificationStatsCriticalSection;
+std::unordered_map<std::wstring, std::shared_ptr<NotificationStats>> notificationStats;
+
+void removeNotificationStats(String^ key) {
+	EnterCriticalSection(&NotificationStatsCriticalSection);
+	notificationStats.erase(key->Data());
+	LeaveCriticalSection(&NotificationStatsCriticalSection);
+}
+
+// Coarse advertisement filters checked before scan results are routed. The extension still applies the exact Web Bluetooth
+// matching (data prefixes and masks), so a filter must never reject an advertisement the extension would accept.
+struct ScanFilter {
+	bool hasAddress = false;
+	unsigned long long address = 0;
+	bool hasName = false;
+	std::wstring name;
+	std::wstring namePrefix;
+	std::vector<GUID> services; // all must be advertised
+	std::vector<unsigned short> companyIdentifiers; // any must be advertised
+	std::vector<GUID> serviceData; // any must be advertised
+};
+
+// A session receives the advertisements matching any of its filters, or all advertisements when it has none
+struct ScanSession {
+	unsigned int id;
+	unsigned int clientId;
+	bool active;
+	bool rawSections; // include every AD structure in scan results
+	std::vector<ScanFilter> filters;
+};
+
+// Guards the scan sessions, the advertised name cache and the watcher
+CRITICAL_SECTION ScanCriticalSection;
+std::unordered_map<unsigned int, ScanSession> scanSessions;
+unsigned int nextScanSessionId = 1;
+
+// Names are often only sent in scan responses, so name filters are also matched against the last name seen for the address
+const size_t MAX_ADVERTISED_NAMES = 1024;
+std::unordered_map<unsigned long long, std::wstring> advertisedNames;
+
+// Advertisements are copied out of the watcher callback into these records and encoded on ingest worker threads,
+// so that the callback never blocks the thread Windows delivers advertisements on
+const size_t MAX_ADVERTISEMENT_PAYLOAD = 1650; // largest extended advertising data
+
+struct AdvertisementRecord {
+	unsigned long long address;
+	long long timestamp;
+	short rssi;
+	bool hasTransmitPower;
+	short transmitPower;
+	unsigned char advertisementType;
+	unsigned short payloadLength;
+	uint8_t payload[MAX_ADVERTISEMENT_PAYLOAD];
+};
+
+// Advertisements are sharded across workers by address so that results for one device stay in order
+const unsigned int INGEST_WORKER_COUNT = 2;
+const size_t INGEST_QUEUE_CAPACITY = 512; // per worker, must be a power of two
+const size_t MAX_DEDUPLICATED_ADDRESSES = 4096;
+
+struct RecentAdvertisement {
+	unsigned long long payloadHash;
+	long long timestamp;
+};
+
+struct IngestWorker {
+	BoundedQueue<AdvertisementRecord> queue;
+	HANDLE wakeEvent;
+	std::atomic<bool> idle;
+	// only touched by the worker thread
+	std::unordered_map<unsigned long long, RecentAdvertisement> recentAdvertisements;
+
+	IngestWorker() : queue(INGEST_QUEUE_CAPACITY), wakeEvent(CreateEvent(nullptr, FALSE, FALSE, nullptr)), idle(false) {
+	}
+};
+
+// Started with the first scan, the workers only exist once ingestWorkersStarted is set
+std::unique_ptr<IngestWorker> ingestWorkers[INGEST_WORKER_COUNT];
+std::atomic<bool> ingestWorkersStarted(false);
+
+enum class IngestDropPolicy {
+	DropNewest,
+	DropOldest,
+};
+
+// set with the configure command
+std::atomic<IngestDropPolicy> ingestDropPolicy(IngestDropPolicy::DropNewest);
+std::atomic<unsigned int> ingestDedupMs(0); // identical advertisements from a device within this interval are dropped, 0 disables
+
+// reported by the stats command
+std::atomic<unsigned long long> ingestReceived(0);
+std::atomic<unsigned long long> ingestOverflows(0);
+std::atomic<unsigned long long> ingestDroppedNewest(0);
+std::atomic<unsigned long long> ingestDroppedOldest(0);
+std::atomic<unsigned long long> ingestDeduplicated(0);
+std::atomic<unsigned long long> ingestUnmatched(0);
+std::atomic<unsigned long long> ingestEncoded(0);
+std::atomic<size_t> ingestQueueHighWater(0); // deepest any single worker queue has been
+
+// Performs one blocking read or write. Works for both overlapped (named pipe) and synchronous (stdio) handles;
+// pipe handles must be overlapped so that a pending read doesn't block writes on the same handle.
+bool transferOnce(HANDLE handle, HANDLE event, char* buffer, DWORD length, bool write, DWORD& transferred) {
+	OVERLAPPED overlapped = {};
+	overlapped.hEvent = event;
+	ResetEvent(event);
+	BOOL ok = write ? WriteFile(handle, buffer, length, nullptr, &overlapped) : ReadFile(handle, buffer, length, nullptr, &overlapped);
+	if (!ok && GetLastError() != ERROR_IO_PENDING) {
+		return false;
+	}
+	transferred = 0;
+	return GetOverlappedResult(handle, &overlapped, &transferred, TRUE) && transferred > 0;
+}
+
+bool transferFully(HANDLE handle, HANDLE event, char* buffer, DWORD length, bool write) {
+	while (length > 0) {
+		DWORD transferred;
+		if (!transferOnce(handle, event, buffer, length, write, transferred)) {
+			return false;
+		}
+		buffer += transferred;
+		length -= transferred;
+	}
+	return true;
+}
+
+unsigned int commandClient(JsonObject^ command) {
+	return (unsigned int)command->GetNamedNumber("_client", 0);
+}
+
+// Command IDs are only unique per client
+String^ requestKey(unsigned int clientId, double commandId) {
+	return clientId.ToString() + "/" + commandId.ToString();
+}
+
+// Only commands with a numeric _id can be tracked, aborted or given a deadline. Any other _id is still echoed back.
+bool commandId(JsonObject^ command, double& id) {
+	if (!command->HasKey("_id")) {
+		return false;
+	}
+	IJsonValue^ value = command->GetNamedValue("_id");
+	if (value->ValueType != JsonValueType::Number) {
+		return false;
+	}
+	id = value->GetNumber();
+	return true;
+}
+
+// Microseconds on the performance counter, for spans and executor timings. The frequency is read at the start of main.
+LARGE_INTEGER monotonicFrequency;
+
+uint64_t monotonicUs() {
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / monotonicFrequency.QuadPart * 1000000 + now.QuadPart % monotonicFrequency.QuadPart * 1000000 / monotonicFrequency.QuadPart);
+}
+
+// Spans recorded while tracing is enabled with configure, written out by traceDump. The ring is only allocated when
+// tracing is first enabled and then lives as long as the process, so a span never races with freeing it.
+const size_t TRACE_RING_CAPACITY = 8192;
+std::atomic<bool> tracingEnabled(false);
+std::atomic<TraceRing*> traceRing(nullptr);
+
+void setTracingEnabled(bool enabled) {
+	if (enabled && traceRing.load() == nullptr) {
+		TraceRing* ring = new TraceRing(TRACE_RING_CAPACITY);
+		TraceRing* expected = nullptr;
+		if (!traceRing.compare_exchange_strong(expected, ring)) {
+			delete ring;
+		}
+	}
+	tracingEnabled = enabled;
+}
+
+template <size_t N>
+void copyTraceString(char (&out)[N], String^ value) {
+	if (value == nullptr || value->Length() == 0) {
+		out[0] = 0;
+		return;
+	}
+	int length = WideCharToMultiByte(CP_UTF8, 0, value->Data(), value->Length(), nullptr, 0, nullptr, nullptr);
+	std::string utf8(length, 0);
+	WideCharToMultiByte(CP_UTF8, 0, value->Data(), value->Length(), &utf8[0], length, nullptr, nullptr);
+	copyTraceString(out, utf8.c_str());
+}
+
+// Records a span from construction until end() or destruction. Does nothing unless tracing was enabled when the span
+// started.
+class TraceScope {
+public:
+	explicit TraceScope(const char* name, JsonObject^ command = nullptr) : active(tracingEnabled.load(std::memory_order_relaxed)) {
+		if (active) {
+			copyTraceString(span.name, name);
+			start(command);
+		}
+	}
+
+	TraceScope(String^ name, JsonObject^ command) : active(tracingEnabled.load(std::memory_order_relaxed)) {
+		if (active) {
+			copyTraceString(span.name, name);
+			start(command);
+		}
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+	~TraceScope() {
+		end();
+	}
+
+	// Spans of a command carry its _id and device, connect commands only have the address
+	void attach(JsonObject^ command) {
+		if (!active) {
+			return;
+		}
+		double id;
+		if (commandId(command, id)) {
+			span.clientId = commandClient(command);
+			span.commandId = (int64_t)id;
+		}
+		const wchar_t* deviceKeys[] = { L"device", L"address" };
+		for (auto deviceKey : deviceKeys) {
+			IJsonValue^ device = command->HasKey(StringReference(deviceKey)) ? command->GetNamedValue(StringReference(deviceKey)) : nullptr;
+			if (device != nullptr && device->ValueType == JsonValueType::String) {
+				copyTraceString(span.device, device->GetString());
+				break;
+			}
+		}
+	}
+
+	void end() {
+		if (!active) {
+			return;
+		}
+		active = false;
+		span.durationUs = monotonicUs() - span.startUs;
+		traceRing.load()->record(span);
+	}
+
+private:
+	void start(JsonObject^ command) {
+		span.device[0] = 0;
+		span.threadId = GetCurrentThreadId();
+		span.clientId = 0;
+		span.commandId = -1;
+		if (command != nullptr) {
+			attach(command);
+		}
+		span.startUs = monotonicUs();
+	}
+
+	TraceSpan span;
+	bool active;
+};
+
+// A PPL scheduler that runs tasks on a private Windows thread pool with a bounded number of threads, so that one kind
+// of work can't take every thread from the others. Counts what it runs for stats.
+class ThreadpoolScheduler : public concurrency::scheduler_interface {
+public:
+	bool create(unsigned int threads) {
+		pool = CreateThreadpool(nullptr);
+		if (pool == nullptr) {
+			return false;
+		}
+		InitializeThreadpoolEnvironment(&environment);
+		SetThreadpoolCallbackPool(&environment, pool);
+		setThreads(threads);
+		createdAt = monotonicUs();
+		return SetThreadpoolThreadMinimum(pool, 1) != FALSE;
+	}
+
+	void setThreads(unsigned int count) {
+		threads = count;
+		SetThreadpoolThreadMaximum(pool, count);
+	}
+
+	unsigned int threadCount() const {
+		return threads.load();
+	}
+
+	virtual void schedule(concurrency::TaskProc_t proc, void* param) override {
+		auto item = new WorkItem{ this, proc, param, monotonicUs() };
+		submitted++;
+		if (!TrySubmitThreadpoolCallback(run, item, &environment)) {
+			// only fails when out of memory, running late on the caller's thread beats losing the task
+			run(nullptr, item);
+		}
+	}
+
+	JsonObject^ stats() const {
+		unsigned long long started = startedCount.load();
+		uint64_t busy = busyUs.load();
+		uint64_t elapsed = monotonicUs() - createdAt;
+		JsonObject^ result = ref new JsonObject();
+		result->Insert("threads", JsonValue::CreateNumberValue(threads.load()));
+		result->Insert("running", JsonValue::CreateNumberValue(running.load()));
+		result->Insert("peakRunning", JsonValue::CreateNumberValue(peakRunning.load()));
+		result->Insert("queued", JsonValue::CreateNumberValue((double)(submitted.load() - started)));
+		result->Insert("submitted", JsonValue::CreateNumberValue((double)submitted.load()));
+		result->Insert("completed", JsonValue::CreateNumberValue((double)completed.load()));
+		result->Insert("busyMs", JsonValue::CreateNumberValue(busy / 1000.0));
+		result->Insert("maxQueueWaitMs", JsonValue::CreateNumberValue(maxQueueWaitUs.load() / 1000.0));
+		// busy share of the current thread count since startup
+		result->Insert("utilization", JsonValue::CreateNumberValue(elapsed > 0 ? (double)busy / ((double)elapsed * threads.load()) : 0));
+		return result;
+	}
+
+private:
+	struct WorkItem {
+		ThreadpoolScheduler* scheduler;
+		concurrency::TaskProc_t proc;
+		void* param;
+		uint64_t queuedAt;
+	};
+
+	static VOID CALLBACK run(PTP_CALLBACK_INSTANCE instance, PVOID context) {
+		std::unique_ptr<WorkItem> item(static_cast<WorkItem*>(context));
+		ThreadpoolScheduler* scheduler = item->scheduler;
+		uint64_t started = monotonicUs();
+		scheduler->startedCount++;
+		uint64_t waited = started - item->queuedAt;
+		uint64_t maxWaited = scheduler->maxQueueWaitUs.load();
+		while (waited > maxWaited && !scheduler->maxQueueWaitUs.compare_exchange_weak(maxWaited, waited)) {
+		}
+		unsigned int nowRunning = ++scheduler->running;
+		unsigned int peak = scheduler->peakRunning.load();
+		while (nowRunning > peak && !scheduler->peakRunning.compare_exchange_weak(peak, nowRunning)) {
+		}
+		item->proc(item->param);
+		scheduler->running--;
+		scheduler->busyUs += monotonicUs() - started;
+		scheduler->completed++;
+	}
+
+	PTP_POOL pool = nullptr;
+	TP_CALLBACK_ENVIRON environment;
+	uint64_t createdAt = 0;
+	std::atomic<unsigned int> threads{ 0 };
+	std::atomic<unsigned int> running{ 0 };
+	std::atomic<unsigned int> peakRunning{ 0 };
+	std::atomic<unsigned long long> submitted{ 0 };
+	std::atomic<unsigned long long> startedCount{ 0 };
+	std::atomic<unsigned long long> completed{ 0 };
+	std::atomic<uint64_t> busyUs{ 0 };
+	std::atomic<uint64_t> maxQueueWaitUs{ 0 };
+};
+
+// The I/O executor is the ambient PPL scheduler: command coroutines, their continuations after each WinRT await and
+// the work handed off by event handlers run there. Encoding responses runs on the compute executor, so a burst of
+// large results can't hold up the awaits of other commands. Handlers and tasks on either must not block: wait with
+// delay() or a task_completion_event instead of Sleep.
+const unsigned int DEFAULT_IO_THREADS = 4;
+const unsigned int MAX_EXECUTOR_THREADS = 64;
+std::shared_ptr<ThreadpoolScheduler> ioExecutor;
+std::shared_ptr<ThreadpoolScheduler> computeExecutor;
+
+unsigned int defaultComputeThreads() {
+	// half the cores, between 1 and 4
+	unsigned int threads = std::thread::hardware_concurrency() / 2;
+	return threads < 1 ? 1 : threads > 4 ? 4 : threads;
+}
+
+bool startExecutors() {
+	ioExecutor = std::make_shared<ThreadpoolScheduler>();
+	computeExecutor = std::make_shared<ThreadpoolScheduler>();
+	if (!ioExecutor->create(DEFAULT_IO_THREADS) || !computeExecutor->create(defaultComputeThreads())) {
+		return false;
+	}
+	concurrency::set_ambient_scheduler(ioExecutor);
+	return true;
+}
+
+template <typename Function>
+auto onComputeExecutor(Function function) -> decltype(concurrency::create_task(function)) {
+	return concurrency::create_task(function, concurrency::task_options(concurrency::scheduler_ptr(computeExecutor)));
+}
+
+unsigned int executorThreadsOption(JsonObject^ command, String^ name) {
+	double threads = command->GetNamedNumber(name);
+	if (threads < 1 || threads > MAX_EXECUTOR_THREADS) {
+		throw ref new InvalidArgumentException(name + " must be between 1 and " + MAX_EXECUTOR_THREADS.ToString());
+	}
+	return (unsigned int)threads;
+}
+
+// Intervals and timeouts given to configure are capped at a day
+const unsigned int MAX_OPTION_MS = 24 * 60 * 60 * 1000;
+
+double numberOption(JsonObject^ command, String^ name, double min, double max) {
+	double value = command->GetNamedNumber(name);
+	if (!(value >= min && value <= max)) {
+		throw ref new InvalidArgumentException(name + " must be between " + min.ToString() + " and " + max.ToString());
+	}
+	return value;
+}
+
+unsigned int unsignedOption(JsonObject^ command, String^ name, unsigned int max) {
+	return (unsigned int)numberOption(command, name, 0, max);
+}
+
+struct Delay {
+	PTP_TIMER timer = nullptr;
+	concurrency::task_completion_event<void> elapsed;
+};
+
+VOID CALLBACK delayElapsed(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer) {
+	static_cast<Delay*>(context)->elapsed.set();
+}
+
+// Completes after ms without holding a thread meanwhile; cancelled as soon as token is
+concurrency::task<void> delay(unsigned int ms, concurrency::cancellation_token token) {
+	auto pending = std::make_shared<Delay>();
+	pending->timer = CreateThreadpoolTimer(delayElapsed, pending.get(), nullptr);
+	if (pending->timer == nullptr) {
+		throw ref new FailureException(ref new String(L"Could not create timer"));
+	}
+	// negative due times are relative, in 100ns units
+	ULARGE_INTEGER dueTime;
+	dueTime.QuadPart = (ULONGLONG)(-(LONGLONG)ms * 10000);
+	FILETIME fileDueTime = { dueTime.LowPart, dueTime.HighPart };
+	SetThreadpoolTimer(pending->timer, &fileDueTime, 0, 0);
+	return concurrency::create_task(pending->elapsed, token).then([pending](concurrency::task<void> waited) {
+		SetThreadpoolTimer(pending->timer, nullptr, 0, 0);
+		WaitForThreadpoolTimerCallbacks(pending->timer, TRUE);
+		CloseThreadpoolTimer(pending->timer);
+		waited.get();
+	});
+}
+
+// Deadline applied to commands that don't carry their own "timeout" (in ms). 0 disables it.
+const unsigned int DEFAULT_COMMAND_TIMEOUT_MS = 60000;
+std::atomic<unsigned int> commandTimeoutMs(DEFAULT_COMMAND_TIMEOUT_MS);
+
+// A command in flight. Cancelling the source cancels every WinRT operation the command is awaiting, see withCommandToken.
+struct PendingCommand {
+	concurrency::cancellation_token_source source;
+	PTP_TIMER deadlineTimer = nullptr;
+	unsigned int timeoutMs = 0;
+	std::atomic<bool> timedOut{ false };
+};
+
+// keyed by requestKey(client, command id)
+CRITICAL_SECTION PendingCommandsCriticalSection;
+std::unordered_map<std::wstring, std::shared_ptr<PendingCommand>> pendingCommands;
+
+VOID CALLBACK commandDeadlineExpired(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer) {
+	// endCommand waits for this callback before the command is released. The awaiting coroutine resumes on the
+	// PPL scheduler, never inline on this thread.
+	auto pending = static_cast<PendingCommand*>(context);
+	pending->timedOut = true;
+	pending->source.cancel();
+}
+
+void armCommandDeadline(PendingCommand& pending) {
+	// negative due times are relative, in 100ns units
+	ULARGE_INTEGER dueTime;
+	dueTime.QuadPart = (ULONGLONG)(-(LONGLONG)pending.timeoutMs * 10000);
+	FILETIME fileDueTime = { dueTime.LowPart, dueTime.HighPart };
+	SetThreadpoolTimer(pending.deadlineTimer, &fileDueTime, 0, 0);
+}
+
+// Throws InvalidArgumentException when the command's timeout isn't a number of milliseconds
+std::shared_ptr<PendingCommand> beginCommand(JsonObject^ command) {
+	double timeoutMs = commandTimeoutMs.load();
+	if (command->HasKey("timeout")) {
+		IJsonValue^ timeout = command->GetNamedValue("timeout");
+		if (timeout->ValueType != JsonValueType::Number || !(timeout->GetNumber() >= 0) || timeout->GetNumber() > UINT_MAX) {
+			throw ref new InvalidArgumentException(ref new String(L"timeout must be a number of milliseconds"));
+		}
+		timeoutMs = timeout->GetNumber();
+	}
+	double id;
+	if (!commandId(command, id)) {
+		return nullptr;
+	}
+	auto pending = std::make_shared<PendingCommand>();
+	if (timeoutMs > 0) {
+		pending->timeoutMs = (unsigned int)timeoutMs;
+		pending->deadlineTimer = CreateThreadpoolTimer(commandDeadlineExpired, pending.get(), nullptr);
+	}
+	EnterCriticalSection(&PendingCommandsCriticalSection);
+	pendingCommands[requestKey(commandClient(command), id)->Data()] = pending;
+	if (pending->deadlineTimer != nullptr) {
+		armCommandDeadline(*pending);
+	}
+	LeaveCriticalSection(&PendingCommandsCriticalSection);
+	return pending;
+}
+
+void endCommand(JsonObject^ command, const std::shared_ptr<PendingCommand>& pending) {
+	double id;
+	if (pending == nullptr || !commandId(command, id)) {
+		return;
+	}
+	EnterCriticalSection(&PendingCommandsCriticalSection);
+	auto found = pendingCommands.find(requestKey(commandClient(command), id)->Data());
+	if (found != pendingCommands.end() && found->second == pending) {
+		pendingCommands.erase(found);
+	}
+	LeaveCriticalSection(&PendingCommandsCriticalSection);
+	if (pending->deadlineTimer != nullptr) {
+		SetThreadpoolTimer(pending->deadlineTimer, nullptr, 0, 0);
+		WaitForThreadpoolTimerCallbacks(pending->deadlineTimer, TRUE);
+		CloseThreadpoolTimer(pending->deadlineTimer);
+	}
+}
+
+// The deadline doesn't run while a pairing prompt waits for the user; it restarts in full once they answer
+void pauseCommandDeadline(String^ key) {
+	EnterCriticalSection(&PendingCommandsCriticalSection);
+	auto found = pendingCommands.find(key->Data());
+	if (found != pendingCommands.end() && found->second->deadlineTimer != nullptr) {
+		SetThreadpoolTimer(found->second->deadlineTimer, nullptr, 0, 0);
+	}
+	LeaveCriticalSection(&PendingCommandsCriticalSection);
+}
+
+void restartCommandDeadline(String^ key) {
+	EnterCriticalSection(&PendingCommandsCriticalSection);
+	auto found = pendingCommands.find(key->Data());
+	if (found != pendingCommands.end() && found->second->deadlineTimer != nullptr && !found->second->source.get_token().is_canceled()) {
+		armCommandDeadline(*found->second);
+	}
+	LeaveCriticalSection(&PendingCommandsCriticalSection);
+}
+
+// Returns false if the command already completed
+bool cancelCommand(String^ key) {
+	EnterCriticalSection(&PendingCommandsCriticalSection);
+	auto found = pendingCommands.find(key->Data());
+	std::shared_ptr<PendingCommand> pending;
+	if (found != pendingCommands.end()) {
+		pending = found->second;
+	}
+	LeaveCriticalSection(&PendingCommandsCriticalSection);
+	if (pending == nullptr) {
+		return false;
+	}
+	pending->source.cancel();
+	return true;
+}
+
+void cancelClientCommands(unsigned int clientId) {
+	std::wstring keyPrefix = clientId.ToString()->Data();
+	keyPrefix += L"/";
+	std::vector<std::shared_ptr<PendingCommand>> cancelled;
+	EnterCriticalSection(&PendingCommandsCriticalSection);
+	for (auto& pair : pendingCommands) {
+		if (pair.first.compare(0, keyPrefix.length(), keyPrefix) == 0) {
+			cancelled.push_back(pair.second);
+		}
+	}
+	LeaveCriticalSection(&PendingCommandsCriticalSection);
+	for (auto& pending : cancelled) {
+		pending->source.cancel();
+	}
+}
+
+// GATT commands are queued per flow, the pair of the client and the origin of the page that sent the command ("_origin"),
+// and started by a weighted fair scheduler so that one page flooding the radio doesn't starve the others. Each flow is
+// limited in commands in flight and, optionally, in commands started per second. Other commands run right away:
+// disconnect and unsubscribe release what the queued traffic holds, and accept/cancel answer a connect in flight.
+// The timeout of a queued command starts when it leaves the queue.
+const wchar_t* const SCHEDULED_COMMANDS[] = {
+	L"connect", L"services", L"characteristics", L"read", L"write", L"writeWithResponse", L"writeWithoutResponse",
+	L"subscribe", L"getDescriptor", L"getDescriptors", L"readDescriptorValue", L"writeDescriptorValue",
+	L"reliableWrite", L"commitReliableWrite",
+};
+
+typedef std::pair<unsigned int, std::wstring> CommandFlow;
+
+// Bounds of the scheduler options of configure. Weights are bounded on both sides, an origin with a weight close to 0
+// would never get its turn.
+const unsigned int MAX_CLIENT_IN_FLIGHT = 256;
+const unsigned int MAX_CLIENT_QUEUED = 65536;
+const double MAX_CLIENT_RATE_PER_SECOND = 100000;
+const double MIN_ORIGIN_WEIGHT = 0.01;
+const double MAX_ORIGIN_WEIGHT = 100;
+
+// Guards the scheduler, originWeights and schedulerTimerDueUs
+CRITICAL_SECTION SchedulerCriticalSection;
+FairScheduler<CommandFlow, JsonObject^> commandScheduler;
+std::unordered_map<std::wstring, double> originWeights; // origins not listed have weight 1
+uint64_t schedulerTimerDueUs = 0; // 0 when no timer is armed for a rate capped flow
+
+template <size_t N>
+bool isCommandIn(String^ cmd, const wchar_t* const (&commands)[N]) {
+	for (auto listed : commands) {
+		if (cmd->Equals(StringReference(listed))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+CommandFlow commandFlow(JsonObject^ command) {
+	return CommandFlow(commandClient(command), command->GetNamedString("_origin", "")->Data());
+}
+
+double originWeight(const std::wstring& origin) {
+	auto found = originWeights.find(origin);
+	return found != originWeights.end() ? found->second : 1;
+}
+
+concurrency::cancellation_token commandToken(JsonObject^ command) {
+	auto token = concurrency::cancellation_token::none();
+	double id;
+	if (!commandId(command, id)) {
+		return token;
+	}
+	EnterCriticalSection(&PendingCommandsCriticalSection);
+	auto found = pendingCommands.find(requestKey(commandClient(command), id)->Data());
+	if (found != pendingCommands.end()) {
+		token = found->second->source.get_token();
+	}
+	LeaveCriticalSection(&PendingCommandsCriticalSection);
+	return token;
+}
+
+// Awaiting the returned task instead of the operation itself lets a deadline or an abort command call Cancel() on
+// the operation, after which the await throws concurrency::task_canceled
+template <typename T>
+concurrency::task<T> withCommandToken(JsonObject^ command, Windows::Foundation::IAsyncOperation<T>^ operation) {
+	return concurrency::create_task(operation, commandToken(command));
+}
+
+// For a task shared between commands only this command's wait is cancelled, not the task itself
+template <typename T>
+concurrency::task<T> withCommandToken(JsonObject^ command, concurrency::task<T> shared) {
+	concurrency::task_completion_event<T> completed;
+	shared.then([completed](concurrency::task<T> result) {
+		try {
+			completed.set(result.get());
+		}
+		catch (...) {
+			completed.set_exception(std::current_exception());
+		}
+	});
+	return concurrency::create_task(completed, commandToken(command));
+}
+
+// Records the await of the task as a span of the command
+template <typename T>
+concurrency::task<T> withCommandSpan(JsonObject^ command, const char* spanName, concurrency::task<T> awaited) {
+	if (!tracingEnabled.load(std::memory_order_relaxed)) {
+		return awaited;
+	}
+	auto scope = std::make_shared<TraceScope>(spanName, command);
+	return awaited.then([scope](concurrency::task<T> completed) {
+		scope->end();
+		return completed;
+	});
+}
+
+// Also records the await as a span of the command, named after the WinRT call
+template <typename Operation>
+auto withCommandToken(JsonObject^ command, const char* spanName, Operation operation) -> decltype(withCommandToken(command, operation)) {
+	return withCommandSpan(command, spanName, withCommandToken(command, operation));
+}
+
+std::vector<unsigned int> clientList(const std::set<unsigned int>& clientIds) {
+	return std::vector<unsigned int>(clientIds.begin(), clientIds.end());
+}
+
+// Chrome and Firefox reject native messages to the extension larger than 1 MB
+const unsigned int MAX_OUTGOING_MESSAGE_SIZE = 1024 * 1024;
+// UTF-8 bytes of the message text carried by each fragment, see writeFragments
+const unsigned int FRAGMENT_DATA_SIZE = 256 * 1024;
+
+std::atomic<unsigned int> nextFragmentId(1);
+std::atomic<unsigned long long> outputMessages(0);
+std::atomic<unsigned long long> outputFragmentedMessages(0);
+std::atomic<unsigned long long> outputFragments(0);
+std::atomic<unsigned long long> outputLargestMessage(0);
+std::atomic<unsigned long long> outputDisconnectedClients(0); // for falling more than MAX_OUTBOUND_BYTES behind
+
+// How much a client may leave unread before it is disconnected. Dropping single frames instead would lose responses
+// and leave commands waiting forever.
+const size_t MAX_OUTBOUND_BYTES = 16 * 1024 * 1024;
+
+void recordOutputMessage(size_t size) {
+	outputMessages++;
+	unsigned long long largest = outputLargestMessage.load();
+	while (size > largest && !outputLargestMessage.compare_exchange_weak(largest, size)) {
+	}
+}
+
+std::vector<std::shared_ptr<Client>> findClients(const std::vector<unsigned int>& clientIds) {
+	std::vector<std::shared_ptr<Client>> result;
+	EnterCriticalSection(&ClientsCriticalSection);
+	for (auto clientId : clientIds) {
+		auto found = clients.find(clientId);
+		if (found != clients.end()) {
+			result.push_back(found->second);
+		}
+	}
+	LeaveCriticalSection(&ClientsCriticalSection);
+	return result;
+}
+
+// Stops queueing frames for the client and lets its writer thread exit. Unless the client is already being closed,
+// its reader is woken up so that it closes the client; that only works for pipe clients, a stdio client is the only
+// client there is to stall anyway.
+void closeOutbound(Client& client, bool wakeReader) {
+	EnterCriticalSection(&client.outputCriticalSection);
+	client.outputClosed = true;
+	client.outbound.clear();
+	client.outboundBytes = 0;
+	SetEvent(client.outboundReady);
+	LeaveCriticalSection(&client.outputCriticalSection);
+	if (wakeReader) {
+		CancelIoEx(client.input, nullptr);
+	}
+}
+
+// The client's writer thread, from addClient until closeOutbound
+void writeOutbound(std::shared_ptr<Client> client) {
+	while (WaitForSingleObject(client->outboundReady, INFINITE) == WAIT_OBJECT_0) {
+		while (true) {
+			EnterCriticalSection(&client->outputCriticalSection);
+			if (client->outputClosed) {
+				LeaveCriticalSection(&client->outputCriticalSection);
+				return;
+			}
+			if (client->outbound.empty()) {
+				ResetEvent(client->outboundReady);
+				LeaveCriticalSection(&client->outputCriticalSection);
+				break;
+			}
+			auto frame = client->outbound.front();
+			LeaveCriticalSection(&client->outputCriticalSection);
+
+			TraceScope writeSpan("frame.write");
+			// only this thread writes to the pipe, nothing else waits for it
+			bool written = transferFully(client->output, client->writeEvent, const_cast<char*>(frame->bytes.data()), (DWORD)frame->bytes.length(), true);
+			writeSpan.end();
+			if (!written) {
+				// the client went away
+				closeOutbound(*client, true);
+				return;
+			}
+			EnterCriticalSection(&client->outputCriticalSection);
+			// unless closeOutbound cleared the queue meanwhile
+			if (!client->outbound.empty() && client->outbound.front() == frame) {
+				client->outbound.pop_front();
+				client->outboundBytes -= frame->bytes.length();
+			}
+			LeaveCriticalSection(&client->outputCriticalSection);
+			if (frame->written) {
+				frame->written();
+			}
+		}
+	}
+}
+
+// frame starts with 4 bytes reserved for the length of the message that follows. Its contents are moved into the
+// outbound queues of the targets, which share them.
+void writeFrame(const std::vector<std::shared_ptr<Client>>& targets, std::string& frame, const std::function<void()>& written = nullptr) {
+	auto len = frame.length() - 4;
+	frame[0] = char(len >> 0);
+	frame[1] = char(len >> 8);
+	frame[2] = char(len >> 16);
+	frame[3] = char(len >> 24);
+	auto shared = std::make_shared<OutboundFrame>();
+	shared->bytes = std::move(frame);
+	shared->written = written;
+	for (auto& client : targets) {
+		EnterCriticalSection(&client->outputCriticalSection);
+		bool overflowed = false;
+		if (!client->outputClosed) {
+			if (client->outboundBytes + shared->bytes.length() > MAX_OUTBOUND_BYTES) {
+				overflowed = true;
+			}
+			else {
+				client->outbound.push_back(shared);
+				client->outboundBytes += shared->bytes.length();
+				SetEvent(client->outboundReady);
+			}
+		}
+		LeaveCriticalSection(&client->outputCriticalSection);
+		if (overflowed) {
+			outputDisconnectedClients++;
+			closeOutbound(*client, true);
+		}
+	}
+}
+
+void appendUtf8(std::string& out, const wchar_t* text, size_t length) {
+	if (length == 0) {
+		return;
+	}
+	size_t offset = out.length();
+	int utf8Length = WideCharToMultiByte(CP_UTF8, 0, text, (int)length, nullptr, 0, nullptr, nullptr);
+	out.resize(offset + utf8Length);
+	WideCharToMultiByte(CP_UTF8, 0, text, (int)length, &out[offset], utf8Length, nullptr, nullptr);
+}
+
+// Sends a message that doesn't fit in one native message as a series of
+// {"_type":"fragment","fragment":id,"index":i,"data":"...","final":true} messages. The data strings, concatenated in
+// index order, are the JSON text of the message; final is only present on the last fragment. The fragments of a message
+// are written in order but other messages, including other fragmented ones, may be written in between. Only one
+// fragment is encoded at a time, whatever the size of the message. written goes with the last fragment.
+void writeFragments(const std::vector<std::shared_ptr<Client>>& targets, String^ jsonString, const std::function<void()>& written) {
+	unsigned int fragmentId = nextFragmentId++;
+	unsigned int index = 0;
+	const wchar_t* text = jsonString->Data();
+	size_t length = jsonString->Length();
+	std::wstring data;
+	size_t dataSize = 0;
+	std::string frame;
+	for (size_t i = 0; i <= length; i++) {
+		bool last = i == length;
+		if (!last) {
+			wchar_t c = text[i];
+			if (c == L'"' || c == L'\\') {
+				data += L'\\';
+				data += c;
+				dataSize += 2;
+			}
+			else if (c < 0x20) {
+				wchar_t escaped[8];
+				swprintf_s(escaped, L"\\u%04x", (unsigned int)c);
+				data += escaped;
+				dataSize += 6;
+			}
+			else {
+				data += c;
+				// a surrogate pair is 4 bytes of UTF-8, counted with its high half
+				dataSize += c < 0x80 ? 1 : c < 0x800 ? 2 : (c >= 0xdc00 && c < 0xe000) ? 0 : (c >= 0xd800 && c < 0xdc00) ? 4 : 3;
+			}
+			// never split a surrogate pair between fragments
+			if (dataSize < FRAGMENT_DATA_SIZE || (c >= 0xd800 && c < 0xdc00) || i + 1 == length) {
+				continue;
+			}
+		}
+
+		TraceScope encodeSpan("encodeFragment");
+		char prefix[96];
+		sprintf_s(prefix, "{\"_type\":\"fragment\",\"fragment\":%u,\"index\":%u,\"data\":\"", fragmentId, index++);
+		frame.assign(4, 0);
+		frame += prefix;
+		appendUtf8(frame, data.c_str(), data.length());
+		frame += last ? "\",\"final\":true}" : "\"}";
+		encodeSpan.end();
+		writeFrame(targets, frame, last ? written : nullptr);
+		outputFragments++;
+		data.clear();
+		dataSize = 0;
+	}
+	outputFragmentedMessages++;
+}
+
+// written, if set, runs once per client after the message is in its pipe
+void writeObject(JsonObject^ jsonObject, const std::vector<unsigned int>& clientIds, const std::function<void()>& written = nullptr) {
+	auto targets = findClients(clientIds);
+	if (targets.empty()) {
+		return;
+	}
+
+	TraceScope encodeSpan("encode");
+	String^ jsonString = jsonObject->Stringify();
+	// at most 3 bytes of UTF-8 per UTF-16 code unit, only measure when that could be too large
+	size_t size = (size_t)jsonString->Length() * 3;
+	if (size > MAX_OUTGOING_MESSAGE_SIZE) {
+		size = WideCharToMultiByte(CP_UTF8, 0, jsonString->Data(), jsonString->Length(), nullptr, 0, nullptr, nullptr);
+	}
+	if (size > MAX_OUTGOING_MESSAGE_SIZE) {
+		encodeSpan.end();
+		recordOutputMessage(size);
+		writeFragments(targets, jsonString, written);
+		return;
+	}
+
+	std::string frame(4, 0);
+	appendUtf8(frame, jsonString->Data(), jsonString->Length());
+	encodeSpan.end();
+	recordOutputMessage(frame.length() - 4);
+	writeFrame(targets, frame, written);
+}
+
+void writeObject(JsonObject^ jsonObject, unsigned int clientId) {
+	writeObject(jsonObject, std::vector<unsigned int>{ clientId });
+}
+
+std::vector<unsigned int> subscriptionClientList(String^ key) {
+	std::vector<unsigned int> result;
+	EnterCriticalSection(&ClientsCriticalSection);
+	auto found = characteristicSubscribers.find(key->Data());
+	if (found != characteristicSubscribers.end()) {
+		result = found->second.clients();
+	}
+	LeaveCriticalSection(&ClientsCriticalSection);
+	return result;
+}
+
+// Returns false, adding nothing, when the client closed while its command was running. closeClient already released
+// what the client held, so nothing would ever remove the entry.
+bool addDeviceClient(String^ deviceId, unsigned int clientId) {
+	EnterCriticalSection(&ClientsCriticalSection);
+	bool open = clients.find(clientId) != clients.end();
+	if (open) {
+		deviceClients[deviceId->Data()].insert(clientId);
+	}
+	LeaveCriticalSection(&ClientsCriticalSection);
+	return open;
+}
+
+// Commands on a connected device, given by "device". Only the clients that connected to the device may use them.
+const wchar_t* const DEVICE_COMMANDS[] = {
+	L"disconnect", L"services", L"characteristics", L"read", L"write", L"writeWithResponse", L"writeWithoutResponse",
+	L"subscribe", L"unsubscribe", L"getDescriptor", L"getDescriptors", L"readDescriptorValue", L"writeDescriptorValue",
+	L"reliableWrite",
+};
+
+// Other clients get the same error as for an unknown device, so they can't probe for the connections of others
+void requireDeviceClient(JsonObject^ command) {
+	String^ deviceId = command->GetNamedString("device", "");
+	unsigned int clientId = commandClient(command);
+	EnterCriticalSection(&ClientsCriticalSection);
+	auto found = deviceClients.find(deviceId->Data());
+	bool held = found != deviceClients.end() && found->second.count(clientId) > 0;
+	LeaveCriticalSection(&ClientsCriticalSection);
+	if (!held) {
+		throw ref new FailureException(ref new String(L"Device not found"));
+	}
+}
+
+// Returns true when no other client is still using the device
+bool releaseDeviceClient(String^ deviceId, unsigned int clientId) {
+	EnterCriticalSection(&ClientsCriticalSection);
+	auto found = deviceClients.find(deviceId->Data());
+	bool lastClient = true;
+	if (found != deviceClients.end()) {
+		found->second.erase(clientId);
+		lastClient = found->second.empty();
+		if (lastClient) {
+			deviceClients.erase(found);
+		}
+	}
+	LeaveCriticalSection(&ClientsCriticalSection);
+	return lastClient;
+}
+
+std::vector<unsigned int> deviceClientList(String^ deviceId) {
+	std::vector<unsigned int> result;
+	EnterCriticalSection(&ClientsCriticalSection);
+	auto found = deviceClients.find(deviceId->Data());
+	if (found != deviceClients.end()) {
+		result = clientList(found->second);
+	}
+	LeaveCriticalSection(&ClientsCriticalSection);
+	return result;
+}
+
+// Returns the clients that were holding the device
+std::vector<unsigned int> releaseAllDeviceClients(String^ deviceId) {
+	std::vector<unsigned int> result;
+	EnterCriticalSection(&ClientsCriticalSection);
+	auto found = deviceClients.find(deviceId->Data());
+	if (found != deviceClients.end()) {
+		result = clientList(found->second);
+		deviceClients.erase(found);
+	}
+	LeaveCriticalSection(&ClientsCriticalSection);
+	return result;
+}
+
+// A device nobody holds anymore is kept connected, with its services and characteristic cache, for lingerMs so that a
+// page reload or navigation reconnects without a new FromBluetoothAddressAsync and an uncached service discovery
+const unsigned int DEFAULT_LINGER_MS = 10000;
+const unsigned int DEFAULT_LINGER_MAX_DEVICES = 4;
+const unsigned int DEFAULT_LINGER_MAX_CHARACTERISTICS = 256;
+const unsigned int MAX_LINGER_DEVICES = 64;
+const unsigned int MAX_LINGER_CHARACTERISTICS = 65536;
+const DWORD LINGER_SWEEP_INTERVAL_MS = 1000;
+
+std::atomic<unsigned int> lingerMs(DEFAULT_LINGER_MS); // 0 disconnects right away
+std::atomic<unsigned int> lingerMaxDevices(DEFAULT_LINGER_MAX_DEVICES);
+std::atomic<unsigned int> lingerMaxCharacteristics(DEFAULT_LINGER_MAX_CHARACTERISTICS); // cached by all lingering devices together
+std::atomic<bool> lingerMaintainConnection(false); // also ask Windows to keep the link up through a GattSession
+
+struct LingeringDevice {
+	ULONGLONG since;
+	ULONGLONG expiresAt;
+	size_t characteristics;
+	GenericAttributeProfile::GattSession^ session;
+};
+
+// Guards lingeringDevices and the sweep timer
+CRITICAL_SECTION LingerCriticalSection;
+std::unordered_map<std::wstring, LingeringDevice> lingeringDevices;
+PTP_TIMER lingerSweepTimer = nullptr;
+
+std::atomic<unsigned long long> lingerStarted(0);
+std::atomic<unsigned long long> lingerReclaimed(0);
+std::atomic<unsigned long long> lingerExpired(0);
+std::atomic<unsigned long long> lingerEvicted(0);
+
+// The services each connected device had when last discovered, to tell what a GattServicesChanged event changed.
+// A service is identified by its UUID and its start handle, as several services may share a UUID.
+struct KnownService {
+	std::wstring uuid;
+	unsigned short handle;
+
+	bool operator==(const KnownService& other) const {
+		return handle == other.handle && uuid == other.uuid;
+	}
+};
+
+struct DeviceServices {
+	std::vector<KnownService> services;
+	bool refreshing = false;
+	bool refreshAgain = false; // another change arrived while refreshing
+};
+
+CRITICAL_SECTION GattServicesCriticalSection;
+std::unordered_map<std::wstring, DeviceServices> deviceServices;
+
+void disconnectDevice(String^ deviceId);
+void removeSubscription(String^ key);
+bool reclaimLingeringDevice(String^ deviceId);
+void lingerDevice(String^ deviceId);
+void recordDeviceServices(String^ deviceId, Windows::Foundation::Collections::IVectorView<GenericAttributeProfile::GattDeviceService^>^ services);
+concurrency::task<void> refreshDeviceServices(String^ deviceId);
+
+// A connection being opened. Connects to an address that is already being connected to wait for that connection
+// instead of opening a second one. The connection doesn't belong to any of their commands: a deadline or abort only
+// ends that command's wait, and the connection is cancelled once nobody waits for it anymore.
+struct ConnectInProgress {
+	concurrency::cancellation_token_source source;
+	concurrency::task_completion_event<String^> opened;
+	unsigned int waiters = 0;
+};
+
+// Guards connectsInProgress and the waiters of its entries
+CRITICAL_SECTION ConnectCriticalSection;
+std::unordered_map<unsigned long long, std::shared_ptr<ConnectInProgress>> connectsInProgress;
+
+// Opens the connection and returns the device id, without assigning it to any client. command is the first one that
+// asked for the connection, only its trace spans are used.
+concurrency::task<String^> openDevice(JsonObject^ command, unsigned long long address, concurrency::cancellation_token token) {
+	auto device = co_await withCommandSpan(command, "FromBluetoothAddressAsync", concurrency::create_task(Bluetooth::BluetoothLEDevice::FromBluetoothAddressAsync(address), token));
+	if (device == nullptr) {
+		throw ref new FailureException(ref new String(L"Device not found (null)"));
+	}
+
+	insertIntoDeviceMap(devices, device->DeviceId, device);
+	device->ConnectionStatusChanged += ref new Windows::Foundation::TypedEventHandler<Bluetooth::BluetoothLEDevice^, Platform::Object^>(
+		[](Windows::Devices::Bluetooth::BluetoothLEDevice^ device, Platform::Object^ eventArgs) {
+			if (device->ConnectionStatus == Bluetooth::BluetoothConnectionStatus::Disconnected) {
+				// writing to clients and closing the device can block, so leave the Bluetooth callback thread at once
+				String^ deviceId = device->DeviceId;
+				concurrency::create_task([deviceId] {
+					JsonObject^ msg = ref new JsonObject();
+					msg->Insert("_type", JsonValue::CreateStringValue("disconnectEvent"));
+					msg->Insert("device", JsonValue::CreateStringValue(deviceId));
+					writeObject(msg, releaseAllDeviceClients(deviceId));
+					// clean up any subscriptions, etc.
+					disconnectDevice(deviceId);
+				});
+			}
+		});
+	device->GattServicesChanged += ref new Windows::Foundation::TypedEventHandler<Bluetooth::BluetoothLEDevice^, Platform::Object^>(
+		[](Windows::Devices::Bluetooth::BluetoothLEDevice^ device, Platform::Object^ eventArgs) {
+			refreshDeviceServices(device->DeviceId);
+		});
+	// Force a connection upon device selection
+	// https://learn.microsoft.com/en-us/uwp/api/windows.devices.bluetooth.bluetoothledevice.frombluetoothaddressasync?view=winrt-19041#windows-devices-bluetooth-bluetoothledevice-frombluetoothaddressasync(system-uint64)
+	int maxattempt = 3;
+	std::exception_ptr failure;
+	try {
+		for (int attemptcnt = 0; attemptcnt < maxattempt; attemptcnt++) {
+			auto services = co_await withCommandSpan(command, "GetGattServicesAsync", concurrency::create_task(device->GetGattServicesAsync(Bluetooth::BluetoothCacheMode::Uncached), token));
+			if (services->Status != Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success) {
+				// todo: more specific error message
+				// https://learn.microsoft.com/en-us/uwp/api/windows.devices.bluetooth.genericattributeprofile.gattcommunicationstatus?view=winrt-19041
+				if (attemptcnt == maxattempt - 1) {
+					throw ref new FailureException(services->Status.ToString());
+				}
+				co_await delay(3000, token);
+			}
+			else {
+				recordDeviceServices(device->DeviceId, services->Services);
+				break;
+			}
+		}
+	}
+	catch (...) {
+		failure = std::current_exception();
+	}
+	if (failure) {
+		// Don't keep a half connected device around unless another client connected to it in the meantime
+		EnterCriticalSection(&ClientsCriticalSection);
+		bool held = deviceClients.find(device->DeviceId->Data()) != deviceClients.end();
+		LeaveCriticalSection(&ClientsCriticalSection);
+		if (!held) {
+			disconnectDevice(device->DeviceId);
+		}
+		std::rethrow_exception(failure);
+	}
+
+	EnterCriticalSection(&BLELookupCriticalSection);
+	bluetoothAddressGattIdMap->Insert(address, device->DeviceId);
+	LeaveCriticalSection(&BLELookupCriticalSection);
+
+	co_return device->DeviceId;
+}
+
+concurrency::task<IJsonValue^> connectRequest(JsonObject^ command) {
+	String^ addressStr = command->GetNamedString("address", "");
+	unsigned long long address = parseBluetoothAddress(addressStr);
+	unsigned int clientId = commandClient(command);
+
+	// Share the connection when another client is already connected to this device
+	String^ existingDeviceId = nullptr;
+	EnterCriticalSection(&BLELookupCriticalSection);
+	if (bluetoothAddressGattIdMap->HasKey(address)) {
+		existingDeviceId = bluetoothAddressGattIdMap->Lookup(address);
+	}
+	LeaveCriticalSection(&BLELookupCriticalSection);
+	if (existingDeviceId != nullptr && findDevice(existingDeviceId) != nullptr) {
+		if (!addDeviceClient(existingDeviceId, clientId)) {
+			throw ref new FailureException(ref new String(L"Client closed"));
+		}
+		reclaimLingeringDevice(existingDeviceId);
+		co_return JsonValue::CreateStringValue(existingDeviceId);
+	}
+
+	std::shared_ptr<ConnectInProgress> connect;
+	bool opening = false;
+	EnterCriticalSection(&ConnectCriticalSection);
+	auto inProgress = connectsInProgress.find(address);
+	if (inProgress != connectsInProgress.end()) {
+		connect = inProgress->second;
+	}
+	else {
+		connect = std::make_shared<ConnectInProgress>();
+		connectsInProgress.emplace(address, connect);
+		opening = true;
+	}
+	connect->waiters++;
+	LeaveCriticalSection(&ConnectCriticalSection);
+
+	if (opening) {
+		openDevice(command, address, connect->source.get_token()).then([address, connect](concurrency::task<String^> opened) {
+			EnterCriticalSection(&ConnectCriticalSection);
+			auto found = connectsInProgress.find(address);
+			if (found != connectsInProgress.end() && found->second == connect) {
+				connectsInProgress.erase(found);
+			}
+			LeaveCriticalSection(&ConnectCriticalSection);
+			try {
+				connect->opened.set(opened.get());
+			}
+			catch (...) {
+				connect->opened.set_exception(std::current_exception());
+			}
+		});
+	}
+
+	// fails like the connection it waits for; a deadline or abort of this command only stops the wait
+	String^ deviceId = nullptr;
+	std::exception_ptr failure;
+	try {
+		deviceId = co_await withCommandToken(command, "connect.wait", concurrency::create_task(connect->opened));
+	}
+	catch (...) {
+		failure = std::current_exception();
+	}
+	EnterCriticalSection(&ConnectCriticalSection);
+	bool lastWaiter = --connect->waiters == 0;
+	if (lastWaiter && failure) {
+		// later connects open a new connection instead of joining the cancelled one
+		auto found = connectsInProgress.find(address);
+		if (found != connectsInProgress.end() && found->second == connect) {
+			connectsInProgress.erase(found);
+		}
+	}
+	LeaveCriticalSection(&ConnectCriticalSection);
+	if (failure) {
+		if (lastWaiter) {
+			// nobody wants the connection anymore; if it opened before the cancellation landed, let it linger
+			// like a device its last client closed
+			connect->source.cancel();
+			concurrency::create_task(connect->opened).then([](concurrency::task<String^> opened) {
+				try {
+					String^ deviceId = opened.get();
+					EnterCriticalSection(&ClientsCriticalSection);
+					bool held = deviceClients.find(deviceId->Data()) != deviceClients.end();
+					LeaveCriticalSection(&ClientsCriticalSection);
+					if (!held) {
+						lingerDevice(deviceId);
+					}
+				}
+				catch (...) {
+					// cancelled or failed, nothing was left open
+				}
+			});
+		}
+		std::rethrow_exception(failure);
+	}
+
+	if (!addDeviceClient(deviceId, clientId)) {
+		// unless another client that waited for this connection holds it by now
+		EnterCriticalSection(&ClientsCriticalSection);
+		bool held = deviceClients.find(deviceId->Data()) != deviceClients.end();
+		LeaveCriticalSection(&ClientsCriticalSection);
+		if (!held) {
+			lingerDevice(deviceId);
+		}
+		throw ref new FailureException(ref new String(L"Client closed"));
+	}
+	// another client that waited for this connection may have closed and left it lingering
+	reclaimLingeringDevice(deviceId);
+	co_return JsonValue::CreateStringValue(deviceId);
+}
+
+void disconnectDevice(String^ deviceId) {
+	// When disconnecting from a device, also remove all the characteristics from our cache.
+	std::vector<std::pair<String^, Bluetooth::GenericAttributeProfile::GattCharacteristic^>> removed;
+	EnterCriticalSection(&DeviceMapsCriticalSection);
+	if (!devices->HasKey(deviceId)) {
+		LeaveCriticalSection(&DeviceMapsCriticalSection);
+		return;
+	}
+	std::wstring keyPrefix = deviceId->Data();
+	keyPrefix += L"//";
+	for (auto pair : characteristicsMap) {
+		if (wcsncmp(pair->Key->Data(), keyPrefix.c_str(), keyPrefix.length()) == 0) {
+			removed.push_back(std::make_pair(pair->Key, pair->Value));
+		}
+	}
+	for (auto& pair : removed) {
+		characteristicsMap->Remove(pair.first);
+		if (characteristicsListenerMap->HasKey(pair.first)) {
+			characteristicsListenerMap->Remove(pair.first);
+		}
+		if (characteristicsSubscriptionMap->HasKey(pair.first)) {
+			characteristicsSubscriptionMap->Remove(pair.first);
+		}
+	}
+	devices->Remove(deviceId);
+	LeaveCriticalSection(&DeviceMapsCriticalSection);
+
+	for (auto& pair : removed) {
+		try {
+			auto service = pair.second->Service;
+			delete service->Session;
+			delete service;
+		}
+		catch (...) {
+			// Service is probably already closed
+		}
+		removeNotificationStats(pair.first);
+		EnterCriticalSection(&ClientsCriticalSection);
+		characteristicSubscribers.erase(pair.first->Data());
+		LeaveCriticalSection(&ClientsCriticalSection);
+	}
+
+	EnterCriticalSection(&GattServicesCriticalSection);
+	deviceServices.erase(deviceId->Data());
+	LeaveCriticalSection(&GattServicesCriticalSection);
 
-std::wstring formatBluetoothAddress(unsigned long long BluetoothAddress) {
-	std::wostringstream ret;
-	ret << std::hex << std::setfill(L'0')
-		<< std::setw(2) << ((BluetoothAddress >> (5 * 8)) & 0xff) << ":"
-		<< std::setw(2) << ((BluetoothAddress >> (4 * 8)) & 0xff) << ":"
-		<< std::setw(2) << ((BluetoothAddress >> (3 * 8)) & 0xff) << ":"
-		<< std::setw(2) << ((BluetoothAddress >> (2 * 8)) & 0xff) << ":"
-		<< std::setw(2) << ((BluetoothAddress >> (1 * 8)) & 0xff) << ":"
-		<< std::setw(2) << ((BluetoothAddress >> (0 * 8)) & 0xff);
-	return ret.str();
+	GenericAttributeProfile::GattSession^ lingerSession = nullptr;
+	EnterCriticalSection(&LingerCriticalSection);
+	auto lingering = lingeringDevices.find(deviceId->Data());
+	if (lingering != lingeringDevices.end()) {
+		lingerSession = lingering->second.session;
+		lingeringDevices.erase(lingering);
+	}
+	LeaveCriticalSection(&LingerCriticalSection);
+	if (lingerSession != nullptr) {
+		delete lingerSession;
+	}
 }
 
-Guid parseUuid(String^ uuid) {
-	if (uuid->Length() == 4) {
-		unsigned int uuidShort = std::stoul(uuid->Data(), 0, 16);
-		return Bluetooth::BluetoothUuidHelper::FromShortId(uuidShort);
+// Best effort, the device may already be gone. Takes the CCCD lock before the first await, so a subscribe that comes
+// after it, once the device is reclaimed, enables notifications again only after this write.
+concurrency::task<void> disableNotifications(String^ key, Bluetooth::GenericAttributeProfile::GattCharacteristic^ characteristic) {
+	CccdLock lock(key);
+	co_await lock.acquired();
+	try {
+		co_await concurrency::create_task(characteristic->WriteClientCharacteristicConfigurationDescriptorAsync(
+			Bluetooth::GenericAttributeProfile::GattClientCharacteristicConfigurationDescriptorValue::None));
 	}
-	GUID rawguid;
-	if (SUCCEEDED(IIDFromString(uuid->Data(), &rawguid))) {
-		return Guid(rawguid);
+	catch (...) {
 	}
-	else {
-		std::wstring msg = L"Invalid UUID: ";
-		msg += uuid->Data();
-		throw ref new InvalidArgumentException(ref new String(msg.c_str()));
+}
+
+// Drops the device's notification subscriptions while keeping its characteristics cached. Notifications are turned off
+// on the device as well, or it would keep sending them for as long as it lingers.
+void releaseDeviceSubscriptions(String^ deviceId) {
+	std::wstring keyPrefix = deviceId->Data();
+	keyPrefix += L"//";
+	std::vector<std::pair<String^, Bluetooth::GenericAttributeProfile::GattCharacteristic^>> subscribed;
+	EnterCriticalSection(&DeviceMapsCriticalSection);
+	for (auto pair : characteristicsSubscriptionMap) {
+		if (wcsncmp(pair->Key->Data(), keyPrefix.c_str(), keyPrefix.length()) == 0) {
+			auto characteristic = characteristicsMap->HasKey(pair->Key) ? characteristicsMap->Lookup(pair->Key) : nullptr;
+			subscribed.push_back(std::make_pair(pair->Key, characteristic));
+		}
+	}
+	LeaveCriticalSection(&DeviceMapsCriticalSection);
+	for (auto& pair : subscribed) {
+		removeSubscription(pair.first);
+		EnterCriticalSection(&ClientsCriticalSection);
+		characteristicSubscribers.erase(pair.first->Data());
+		LeaveCriticalSection(&ClientsCriticalSection);
+		if (pair.second != nullptr) {
+			disableNotifications(pair.first, pair.second);
+		}
 	}
 }
 
-CRITICAL_SECTION OutputCriticalSection;
-CRITICAL_SECTION BLELookupCriticalSection;
+size_t cachedCharacteristicCount(String^ deviceId) {
+	return cachedDeviceCharacteristics(deviceId).size();
+}
 
-void writeObject(JsonObject^ jsonObject) {
-	String^ jsonString = jsonObject->Stringify();
+// Devices that are still lingering but nobody reclaimed in the meantime are disconnected
+void disconnectUnheldDevices(const std::vector<std::wstring>& deviceIds) {
+	for (auto& deviceId : deviceIds) {
+		EnterCriticalSection(&ClientsCriticalSection);
+		bool held = deviceClients.find(deviceId) != deviceClients.end();
+		LeaveCriticalSection(&ClientsCriticalSection);
+		if (!held) {
+			disconnectDevice(ref new String(deviceId.c_str()));
+		}
+	}
+}
 
-	std::wstring_convert<std::codecvt_utf8<wchar_t>> convert;
-	std::string stringUtf8 = convert.to_bytes(jsonString->Data());
+// Deletes the sessions that kept lingering devices connected, outside of LingerCriticalSection
+void closeLingerSessions(const std::vector<GenericAttributeProfile::GattSession^>& sessions) {
+	for (auto session : sessions) {
+		delete session;
+	}
+}
 
-	auto len = stringUtf8.length();
+void armLingerSweep() {
+	// negative due times are relative, in 100ns units
+	ULARGE_INTEGER dueTime;
+	dueTime.QuadPart = (ULONGLONG)(-(LONGLONG)LINGER_SWEEP_INTERVAL_MS * 10000);
+	FILETIME fileDueTime = { dueTime.LowPart, dueTime.HighPart };
+	SetThreadpoolTimer(lingerSweepTimer, &fileDueTime, LINGER_SWEEP_INTERVAL_MS, LINGER_SWEEP_INTERVAL_MS / 2);
+}
 
-	EnterCriticalSection(&OutputCriticalSection);
-	std::cout << char(len >> 0)
-		<< char(len >> 8)
-		<< char(len >> 16)
-		<< char(len >> 24);
+// Runs every LINGER_SWEEP_INTERVAL_MS while any device is lingering
+VOID CALLBACK sweepLingeringDevices(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer) {
+	std::vector<std::wstring> expired;
+	std::vector<GenericAttributeProfile::GattSession^> sessions;
+	ULONGLONG now = GetTickCount64();
+	EnterCriticalSection(&LingerCriticalSection);
+	for (auto it = lingeringDevices.begin(); it != lingeringDevices.end();) {
+		if (it->second.expiresAt <= now) {
+			expired.push_back(it->first);
+			if (it->second.session != nullptr) {
+				sessions.push_back(it->second.session);
+			}
+			it = lingeringDevices.erase(it);
+		}
+		else {
+			it++;
+		}
+	}
+	if (lingeringDevices.empty()) {
+		SetThreadpoolTimer(lingerSweepTimer, nullptr, 0, 0);
+	}
+	LeaveCriticalSection(&LingerCriticalSection);
 
-	std::cout << stringUtf8 << std::flush;
-	LeaveCriticalSection(&OutputCriticalSection);
+	lingerExpired += expired.size();
+	closeLingerSessions(sessions);
+	disconnectUnheldDevices(expired);
 }
 
-concurrency::task<IJsonValue^> disconnectRequest(JsonObject^ command);
-
-concurrency::task<IJsonValue^> connectRequest(JsonObject^ command) {
-	String^ addressStr = command->GetNamedString("address", "");
-	unsigned long long address = std::stoull(addressStr->Data(), 0, 16);
-	auto device = co_await Bluetooth::BluetoothLEDevice::FromBluetoothAddressAsync(address);
-	if (device == nullptr) {
-		throw ref new FailureException(ref new String(L"Device not found (null)"));
+// Keeps the connection warm instead of disconnecting, called once the last client released the device
+void lingerDevice(String^ deviceId) {
+	unsigned int lingerFor = lingerMs.load();
+	if (lingerFor == 0 || lingerMaxDevices.load() == 0 || findDevice(deviceId) == nullptr) {
+		disconnectDevice(deviceId);
+		return;
+	}
+	releaseDeviceSubscriptions(deviceId);
+	size_t characteristics = cachedCharacteristicCount(deviceId);
+	if (characteristics > lingerMaxCharacteristics.load()) {
+		disconnectDevice(deviceId);
+		return;
 	}
 
-	devices->Insert(device->DeviceId, device);
-	device->ConnectionStatusChanged += ref new Windows::Foundation::TypedEventHandler<Bluetooth::BluetoothLEDevice^, Platform::Object^>(
-		[](Windows::Devices::Bluetooth::BluetoothLEDevice^ device, Platform::Object^ eventArgs) {
-			if (device->ConnectionStatus == Bluetooth::BluetoothConnectionStatus::Disconnected) {
-				JsonObject^ msg = ref new JsonObject();
-				msg->Insert("_type", JsonValue::CreateStringValue("disconnectEvent"));
-				msg->Insert("device", JsonValue::CreateStringValue(device->DeviceId));
-				writeObject(msg);
-				// clean up any subscriptions, etc.
-				auto disconnectArgs = ref new JsonObject();
-				disconnectArgs->Insert("device", JsonValue::CreateStringValue(device->DeviceId));
-				auto disconnectOp{ disconnectRequest(disconnectArgs) };
-				disconnectOp.wait();
+	// Make room within the caps by evicting the devices that have been lingering the longest
+	std::vector<std::wstring> evicted;
+	std::vector<GenericAttributeProfile::GattSession^> sessions;
+	ULONGLONG now = GetTickCount64();
+	EnterCriticalSection(&LingerCriticalSection);
+	auto previous = lingeringDevices.find(deviceId->Data());
+	if (previous != lingeringDevices.end()) {
+		if (previous->second.session != nullptr) {
+			sessions.push_back(previous->second.session);
+		}
+		lingeringDevices.erase(previous);
+	}
+	size_t totalCharacteristics = characteristics;
+	for (auto& pair : lingeringDevices) {
+		totalCharacteristics += pair.second.characteristics;
+	}
+	while (!lingeringDevices.empty()
+		&& (lingeringDevices.size() + 1 > lingerMaxDevices.load() || totalCharacteristics > lingerMaxCharacteristics.load())) {
+		auto oldest = lingeringDevices.begin();
+		for (auto it = lingeringDevices.begin(); it != lingeringDevices.end(); it++) {
+			if (it->second.since < oldest->second.since) {
+				oldest = it;
+			}
+		}
+		totalCharacteristics -= oldest->second.characteristics;
+		evicted.push_back(oldest->first);
+		if (oldest->second.session != nullptr) {
+			sessions.push_back(oldest->second.session);
+		}
+		lingeringDevices.erase(oldest);
+	}
+	if (lingeringDevices.empty()) {
+		armLingerSweep();
+	}
+	lingeringDevices[deviceId->Data()] = LingeringDevice{ now, now + lingerFor, characteristics, nullptr };
+	LeaveCriticalSection(&LingerCriticalSection);
+
+	lingerStarted++;
+	lingerEvicted += evicted.size();
+	closeLingerSessions(sessions);
+	disconnectUnheldDevices(evicted);
+
+	auto device = findDevice(deviceId);
+	if (lingerMaintainConnection.load() && device != nullptr) {
+		concurrency::create_task(GenericAttributeProfile::GattSession::FromDeviceIdAsync(device->BluetoothDeviceId))
+			.then([deviceId](concurrency::task<GenericAttributeProfile::GattSession^> sessionTask) {
+			GenericAttributeProfile::GattSession^ session = nullptr;
+			try {
+				session = sessionTask.get();
+				session->MaintainConnection = true;
+			}
+			catch (Exception^) {
+				// the device keeps lingering on its open services alone
+				return;
+			}
+			EnterCriticalSection(&LingerCriticalSection);
+			auto lingering = lingeringDevices.find(deviceId->Data());
+			bool stored = lingering != lingeringDevices.end() && lingering->second.session == nullptr;
+			if (stored) {
+				lingering->second.session = session;
+			}
+			LeaveCriticalSection(&LingerCriticalSection);
+			if (!stored) {
+				// reclaimed or disconnected in the meantime
+				delete session;
 			}
 		});
-	// Force a connection upon device selection
-	// https://learn.microsoft.com/en-us/uwp/api/windows.devices.bluetooth.bluetoothledevice.frombluetoothaddressasync?view=winrt-19041#windows-devices-bluetooth-bluetoothledevice-frombluetoothaddressasync(system-uint64)
-	int maxattempt = 3;
-	for (int attemptcnt = 0; attemptcnt < maxattempt; attemptcnt++) {
-		auto services = co_await device->GetGattServicesAsync(Bluetooth::BluetoothCacheMode::Uncached);
-		if (services->Status != Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success) {
-			// todo: more specific error message
-			// https://learn.microsoft.com/en-us/uwp/api/windows.devices.bluetooth.genericattributeprofile.gattcommunicationstatus?view=winrt-19041
-			if (attemptcnt == maxattempt - 1) {
-				throw ref new FailureException(services->Status.ToString());
+	}
+}
+
+// Returns true when the device was lingering, called after a client took hold of the device again
+bool reclaimLingeringDevice(String^ deviceId) {
+	GenericAttributeProfile::GattSession^ session = nullptr;
+	EnterCriticalSection(&LingerCriticalSection);
+	auto lingering = lingeringDevices.find(deviceId->Data());
+	bool found = lingering != lingeringDevices.end();
+	if (found) {
+		session = lingering->second.session;
+		lingeringDevices.erase(lingering);
+	}
+	LeaveCriticalSection(&LingerCriticalSection);
+	if (session != nullptr) {
+		delete session;
+	}
+	if (found) {
+		lingerReclaimed++;
+	}
+	return found;
+}
+
+void recordDeviceServices(String^ deviceId, Windows::Foundation::Collections::IVectorView<GenericAttributeProfile::GattDeviceService^>^ services) {
+	std::vector<KnownService> known;
+	for (auto service : services) {
+		known.push_back(KnownService{ uuidToString(service->Uuid)->Data(), service->AttributeHandle });
+	}
+	EnterCriticalSection(&GattServicesCriticalSection);
+	deviceServices[deviceId->Data()].services = known;
+	LeaveCriticalSection(&GattServicesCriticalSection);
+}
+
+// (uuid, handle) of the characteristics cached for one service of the device, sorted
+std::vector<KnownService> cachedServiceCharacteristics(String^ deviceId, unsigned short serviceHandle) {
+	std::vector<KnownService> result;
+	for (auto& pair : cachedDeviceCharacteristics(deviceId)) {
+		try {
+			if (pair.second->Service->AttributeHandle == serviceHandle) {
+				result.push_back(KnownService{ uuidToString(pair.second->Uuid)->Data(), pair.second->AttributeHandle });
 			}
-			co_await concurrency::create_task([] { Sleep(3000); });
 		}
-		else {
-			break;
+		catch (Exception^) {
+			// the service object is already closed
 		}
 	}
+	std::sort(result.begin(), result.end(), [](const KnownService& a, const KnownService& b) {
+		return a.handle != b.handle ? a.handle < b.handle : a.uuid < b.uuid;
+	});
+	return result;
+}
 
-	EnterCriticalSection(&BLELookupCriticalSection);
-	bluetoothAddressGattIdMap->Insert(address, device->DeviceId);
-	LeaveCriticalSection(&BLELookupCriticalSection);
+// Drops the cached characteristics of one service and their subscriptions. Returns the ended subscription IDs.
+JsonArray^ invalidateService(String^ deviceId, unsigned short serviceHandle) {
+	std::vector<String^> keys;
+	for (auto& pair : cachedDeviceCharacteristics(deviceId)) {
+		bool affected = true;
+		try {
+			affected = pair.second->Service->AttributeHandle == serviceHandle;
+		}
+		catch (Exception^) {
+			// a closed service is dropped along with the changed one
+		}
+		if (affected) {
+			keys.push_back(pair.first);
+		}
+	}
 
-	co_return JsonValue::CreateStringValue(device->DeviceId);
+	auto subscriptionIds = ref new JsonArray();
+	for (auto key : keys) {
+		JsonValue^ subscriptionId = nullptr;
+		if (findInDeviceMap(characteristicsSubscriptionMap, key, subscriptionId)) {
+			subscriptionIds->Append(subscriptionId);
+		}
+		removeSubscription(key);
+		EnterCriticalSection(&ClientsCriticalSection);
+		characteristicSubscribers.erase(key->Data());
+		LeaveCriticalSection(&ClientsCriticalSection);
+		EnterCriticalSection(&DeviceMapsCriticalSection);
+		if (characteristicsMap->HasKey(key)) {
+			characteristicsMap->Remove(key);
+		}
+		LeaveCriticalSection(&DeviceMapsCriticalSection);
+	}
+	return subscriptionIds;
 }
 
-concurrency::task<IJsonValue^> disconnectRequest(JsonObject^ command) {
-	String^ deviceId = command->GetNamedString("device", "");
-	if (!devices->HasKey(deviceId)) {
-		throw ref new FailureException(ref new String(L"Device not found"));
+void writeServiceChangedEvent(String^ deviceId, const KnownService& service, String^ change, JsonArray^ subscriptionIds) {
+	JsonObject^ msg = ref new JsonObject();
+	msg->Insert("_type", JsonValue::CreateStringValue("serviceChangedEvent"));
+	msg->Insert("device", JsonValue::CreateStringValue(deviceId));
+	msg->Insert("service", JsonValue::CreateStringValue(ref new String(service.uuid.c_str())));
+	msg->Insert("change", JsonValue::CreateStringValue(change));
+	if (subscriptionIds != nullptr && subscriptionIds->Size > 0) {
+		msg->Insert("subscriptionIds", subscriptionIds);
 	}
-	Bluetooth::BluetoothLEDevice^ device = devices->Lookup(deviceId);
+	writeObject(msg, deviceClientList(deviceId));
+}
 
-	// When disconnecting from a device, also remove all the characteristics from our cache.
-	auto newCharacteristicsMap = ref new Collections::Map<String^, Bluetooth::GenericAttributeProfile::GattCharacteristic^>();
-	for (auto pair : characteristicsMap)
-	{
-		bool removed = true;
-		try {
-			auto service = pair->Value->Service;
-			if (service->Session->DeviceId->Equals(device->DeviceId)) {
-				delete service->Session;
-				delete service;
-			}
-			else {
-				newCharacteristicsMap->Insert(pair->Key, pair->Value);
-				removed = false;
-			}
+bool containsService(const std::vector<KnownService>& services, const KnownService& service) {
+	return std::find(services.begin(), services.end(), service) != services.end();
+}
+
+// Rediscovers the device's services and invalidates only what changed since the last discovery
+concurrency::task<void> diffDeviceServices(String^ deviceId) {
+	auto device = findDevice(deviceId);
+	if (device == nullptr) {
+		co_return;
+	}
+	auto result = co_await device->GetGattServicesAsync(BluetoothCacheMode::Uncached);
+	if (result->Status != GenericAttributeProfile::GattCommunicationStatus::Success) {
+		co_return;
+	}
+
+	std::vector<KnownService> current;
+	for (auto service : result->Services) {
+		current.push_back(KnownService{ uuidToString(service->Uuid)->Data(), service->AttributeHandle });
+	}
+	std::vector<KnownService> previous;
+	EnterCriticalSection(&GattServicesCriticalSection);
+	auto found = deviceServices.find(deviceId->Data());
+	if (found != deviceServices.end()) {
+		previous = found->second.services;
+		found->second.services = current;
+	}
+	LeaveCriticalSection(&GattServicesCriticalSection);
+
+	std::vector<KnownService> added;
+	std::vector<KnownService> removed;
+	std::vector<KnownService> kept;
+	for (auto& service : current) {
+		(containsService(previous, service) ? kept : added).push_back(service);
+	}
+	for (auto& service : previous) {
+		if (!containsService(current, service)) {
+			removed.push_back(service);
 		}
-		catch (...) {
-			// Service is probably already closed, so we just skip it and it will be removed from the list
+	}
+
+	// A service that moved to other handles is reported as changed, invalidated under its old handle
+	std::vector<KnownService> changed;
+	for (auto it = removed.begin(); it != removed.end();) {
+		auto moved = std::find_if(added.begin(), added.end(), [&](const KnownService& service) { return service.uuid == it->uuid; });
+		if (moved != added.end()) {
+			changed.push_back(*it);
+			added.erase(moved);
+			it = removed.erase(it);
+		}
+		else {
+			it++;
 		}
+	}
 
-		if (removed) {
-			if (characteristicsListenerMap->HasKey(pair->Key)) {
-				characteristicsListenerMap->Remove(pair->Key);
+	// A service that kept its handles may still have changed characteristics. Only services with cached
+	// characteristics need checking, nothing is stale for the others.
+	for (auto& service : kept) {
+		auto cached = cachedServiceCharacteristics(deviceId, service.handle);
+		if (cached.empty()) {
+			continue;
+		}
+		GenericAttributeProfile::GattDeviceService^ deviceService = nullptr;
+		for (auto candidate : result->Services) {
+			if (candidate->AttributeHandle == service.handle) {
+				deviceService = candidate;
 			}
-			if (characteristicsSubscriptionMap->HasKey(pair->Key)) {
-				characteristicsSubscriptionMap->Remove(pair->Key);
+		}
+		auto characteristics = co_await deviceService->GetCharacteristicsAsync(BluetoothCacheMode::Uncached);
+		if (characteristics->Status != GenericAttributeProfile::GattCommunicationStatus::Success) {
+			changed.push_back(service);
+			continue;
+		}
+		std::vector<KnownService> fresh;
+		for (auto characteristic : characteristics->Characteristics) {
+			fresh.push_back(KnownService{ uuidToString(characteristic->Uuid)->Data(), characteristic->AttributeHandle });
+		}
+		for (auto& characteristic : cached) {
+			if (!containsService(fresh, characteristic)) {
+				changed.push_back(service);
+				break;
 			}
 		}
 	}
-	characteristicsMap = newCharacteristicsMap;
-	devices->Remove(deviceId);
+
+	for (auto& service : removed) {
+		writeServiceChangedEvent(deviceId, service, "removed", invalidateService(deviceId, service.handle));
+	}
+	for (auto& service : changed) {
+		writeServiceChangedEvent(deviceId, service, "changed", invalidateService(deviceId, service.handle));
+	}
+	for (auto& service : added) {
+		writeServiceChangedEvent(deviceId, service, "added", nullptr);
+	}
+}
+
+// Called on GattServicesChanged. Changes arriving during a refresh are coalesced into one more refresh.
+concurrency::task<void> refreshDeviceServices(String^ deviceId) {
+	EnterCriticalSection(&GattServicesCriticalSection);
+	auto found = deviceServices.find(deviceId->Data());
+	if (found == deviceServices.end() || found->second.refreshing) {
+		if (found != deviceServices.end()) {
+			found->second.refreshAgain = true;
+		}
+		LeaveCriticalSection(&GattServicesCriticalSection);
+		co_return;
+	}
+	found->second.refreshing = true;
+	LeaveCriticalSection(&GattServicesCriticalSection);
+
+	bool again = true;
+	while (again) {
+		try {
+			co_await diffDeviceServices(deviceId);
+		}
+		catch (Exception^) {
+			// the device went away, the disconnect path cleans up
+		}
+		EnterCriticalSection(&GattServicesCriticalSection);
+		found = deviceServices.find(deviceId->Data());
+		again = found != deviceServices.end() && found->second.refreshAgain;
+		if (found != deviceServices.end()) {
+			found->second.refreshAgain = false;
+			found->second.refreshing = again;
+		}
+		LeaveCriticalSection(&GattServicesCriticalSection);
+	}
+}
+
+concurrency::task<IJsonValue^> disconnectRequest(JsonObject^ command) {
+	String^ deviceId = command->GetNamedString("device", "");
+	if (findDevice(deviceId) == nullptr) {
+		throw ref new FailureException(ref new String(L"Device not found"));
+	}
+
+	// Keep the connection open while other clients are still using the device
+	if (releaseDeviceClient(deviceId, commandClient(command))) {
+		lingerDevice(deviceId);
+	}
 
 	return Concurrency::task_from_result<IJsonValue^>(JsonValue::CreateNullValue());
 }
 
 concurrency::task<Bluetooth::GenericAttributeProfile::GattDeviceServicesResult^> findServices(JsonObject^ command) {
-	String^ deviceId = command->GetNamedString("device", "");
-	if (!devices->HasKey(deviceId)) {
+	Bluetooth::BluetoothLEDevice^ device = findDevice(command->GetNamedString("device", ""));
+	if (device == nullptr) {
 		throw ref new FailureException(ref new String(L"Device not found"));
 	}
-	Bluetooth::BluetoothLEDevice^ device = devices->Lookup(deviceId);
 	if (command->HasKey("service")) {
-		co_return co_await device->GetGattServicesForUuidAsync(parseUuid(command->GetNamedString("service")));
+		co_return co_await withCommandToken(command, "GetGattServicesForUuidAsync", device->GetGattServicesForUuidAsync(parseUuid(command->GetNamedString("service"))));
 	}
 	else {
-		co_return co_await device->GetGattServicesAsync();
+		co_return co_await withCommandToken(command, "GetGattServicesAsync", device->GetGattServicesAsync());
 	}
 }
 
@@ -224,11 +2250,11 @@ concurrency::task<Bluetooth::GenericAttributeProfile::GattCharacteristicsResult^
 		throw ref new FailureException(ref new String(L"Requested service not found"));
 	}
 	auto service = services->GetAt(0);
-	auto results = co_await service->GetCharacteristicsAsync();
+	auto results = co_await withCommandToken(command, "GetCharacteristicsAsync", service->GetCharacteristicsAsync());
 	for (unsigned int i = 0; i < results->Characteristics->Size; i++) {
 		auto characteristic = results->Characteristics->GetAt(i);
-		auto key = characteristicKey(command->GetNamedString("device"), command->GetNamedString("service"), characteristic->Uuid.ToString());
-		characteristicsMap->Insert(key, characteristic);
+		auto key = characteristicKey(command->GetNamedString("device"), command->GetNamedString("service"), uuidToString(characteristic->Uuid));
+		insertIntoDeviceMap(characteristicsMap, key, characteristic);
 	}
 	co_return results;
 }
@@ -239,12 +2265,14 @@ concurrency::task<Bluetooth::GenericAttributeProfile::GattCharacteristic^> getCh
 	}
 
 	auto key = characteristicKey(command);
-	if (!characteristicsMap->HasKey(key)) {
-		co_await findCharacteristics(command);
+	Bluetooth::GenericAttributeProfile::GattCharacteristic^ characteristic = nullptr;
+	if (findInDeviceMap(characteristicsMap, key, characteristic)) {
+		co_return characteristic;
 	}
 
-	if (characteristicsMap->HasKey(key)) {
-		co_return characteristicsMap->Lookup(key);
+	co_await findCharacteristics(command);
+	if (findInDeviceMap(characteristicsMap, key, characteristic)) {
+		co_return characteristic;
 	}
 
 	throw ref new FailureException(ref new String(L"Requested characteristic not found"));
@@ -254,7 +2282,7 @@ concurrency::task<IJsonValue^> servicesRequest(JsonObject^ command) {
 	auto servicesResult = co_await findServices(command);
 	auto result = ref new JsonArray();
 	for (unsigned int i = 0; i < servicesResult->Services->Size; i++) {
-		result->Append(JsonValue::CreateStringValue(servicesResult->Services->GetAt(i)->Uuid.ToString()));
+		result->Append(JsonValue::CreateStringValue(uuidToString(servicesResult->Services->GetAt(i)->Uuid)));
 	}
 	co_return result;
 }
@@ -276,15 +2304,40 @@ concurrency::task<IJsonValue^> charactersticsRequest(JsonObject^ command) {
 		properties->SetNamedValue("authenticatedSignedWrites", JsonValue::CreateBooleanValue(props & (unsigned int)Bluetooth::GenericAttributeProfile::GattCharacteristicProperties::AuthenticatedSignedWrites));
 		properties->SetNamedValue("reliableWrite", JsonValue::CreateBooleanValue(props & (unsigned int)Bluetooth::GenericAttributeProfile::GattCharacteristicProperties::ReliableWrites));
 		properties->SetNamedValue("writableAuxiliaries", JsonValue::CreateBooleanValue(props & (unsigned int)Bluetooth::GenericAttributeProfile::GattCharacteristicProperties::WritableAuxiliaries));
-		characteristicJson->SetNamedValue("uuid", JsonValue::CreateStringValue(characteristic->Uuid.ToString()));
+		characteristicJson->SetNamedValue("uuid", JsonValue::CreateStringValue(uuidToString(characteristic->Uuid)));
 		characteristicJson->SetNamedValue("properties", properties);
 		result->Append(characteristicJson);
 	}
 	co_return result;
 }
 
+// Set when the client answers a pairing prompt, so that the PairingRequested handler can return at once and finish
+// the pairing from its deferral, see pairRequest. Keyed by requestKey(client, command id).
+CRITICAL_SECTION PairingCriticalSection;
+std::unordered_map<std::wstring, concurrency::task_completion_event<void>> pairingAnswers;
+
+concurrency::task<void> waitForPairingAnswer(String^ key) {
+	concurrency::task_completion_event<void> answered;
+	EnterCriticalSection(&PairingCriticalSection);
+	pairingAnswers[key->Data()] = answered;
+	LeaveCriticalSection(&PairingCriticalSection);
+	return concurrency::create_task(answered);
+}
+
+// answer is "accept" or "cancel"; a PIN or credential must be stored before accepting
+void answerPairing(String^ key, String^ answer) {
+	insertIntoDeviceMap(pairingRequestWaiting, key, answer);
+	EnterCriticalSection(&PairingCriticalSection);
+	auto found = pairingAnswers.find(key->Data());
+	if (found != pairingAnswers.end()) {
+		found->second.set();
+		pairingAnswers.erase(found);
+	}
+	LeaveCriticalSection(&PairingCriticalSection);
+}
+
 concurrency::task<IJsonValue^> acceptPairingRequest(JsonObject^ command) {
-	pairingRequestWaiting->Insert(command->GetNamedNumber("origId"), "accept");
+	answerPairing(requestKey(commandClient(command), command->GetNamedNumber("origId")), "accept");
 
 	JsonObject^ response = ref new JsonObject();
 	response->Insert("_type", JsonValue::CreateStringValue("noop"));
@@ -292,8 +2345,8 @@ concurrency::task<IJsonValue^> acceptPairingRequest(JsonObject^ command) {
 }
 
 concurrency::task<IJsonValue^> acceptPairingRequestPin(JsonObject^ command) {
-	pairingRequestWaiting->Insert(command->GetNamedNumber("origId"), "accept");
-	pairingRequestPasswordPIN->Insert(command->GetNamedNumber("origId"), command->GetNamedString("pin"));
+	insertIntoDeviceMap(pairingRequestPasswordPIN, requestKey(commandClient(command), command->GetNamedNumber("origId")), command->GetNamedString("pin"));
+	answerPairing(requestKey(commandClient(command), command->GetNamedNumber("origId")), "accept");
 
 	JsonObject^ response = ref new JsonObject();
 	response->Insert("_type", JsonValue::CreateStringValue("noop"));
@@ -301,9 +2354,9 @@ concurrency::task<IJsonValue^> acceptPairingRequestPin(JsonObject^ command) {
 }
 
 concurrency::task<IJsonValue^> acceptPairingRequestPasswordCredential(JsonObject^ command) {
-	pairingRequestWaiting->Insert(command->GetNamedNumber("origId"), "accept");
-	pairingRequestUsername->Insert(command->GetNamedNumber("origId"), command->GetNamedString("username"));
-	pairingRequestPasswordPIN->Insert(command->GetNamedNumber("origId"), command->GetNamedString("password"));
+	insertIntoDeviceMap(pairingRequestUsername, requestKey(commandClient(command), command->GetNamedNumber("origId")), command->GetNamedString("username"));
+	insertIntoDeviceMap(pairingRequestPasswordPIN, requestKey(commandClient(command), command->GetNamedNumber("origId")), command->GetNamedString("password"));
+	answerPairing(requestKey(commandClient(command), command->GetNamedNumber("origId")), "accept");
 
 	JsonObject^ response = ref new JsonObject();
 	response->Insert("_type", JsonValue::CreateStringValue("noop"));
@@ -311,7 +2364,7 @@ concurrency::task<IJsonValue^> acceptPairingRequestPasswordCredential(JsonObject
 }
 
 concurrency::task<IJsonValue^> cancelPairingRequest(JsonObject^ command) {
-	pairingRequestWaiting->Insert(command->GetNamedNumber("origId"), "cancel");
+	answerPairing(requestKey(commandClient(command), command->GetNamedNumber("origId")), "cancel");
 
 	JsonObject^ response = ref new JsonObject();
 	response->Insert("_type", JsonValue::CreateStringValue("noop"));
@@ -319,7 +2372,10 @@ concurrency::task<IJsonValue^> cancelPairingRequest(JsonObject^ command) {
 }
 
 concurrency::task<IJsonValue^> pairRequest(JsonObject^ command) {
-	Bluetooth::BluetoothLEDevice^ device = devices->Lookup(command->GetNamedString("device"));
+	Bluetooth::BluetoothLEDevice^ device = findDevice(command->GetNamedString("device"));
+	if (device == nullptr) {
+		throw ref new FailureException(ref new String(L"Device not found"));
+	}
 	// Pair the device if needed
 	if (device->DeviceInformation->Pairing->CanPair && !(device->DeviceInformation->Pairing->IsPaired)) {
 		Enumeration::DevicePairingKinds supportedCeremonies = Enumeration::DevicePairingKinds::ConfirmOnly;
@@ -328,11 +2384,14 @@ concurrency::task<IJsonValue^> pairRequest(JsonObject^ command) {
 		supportedCeremonies = supportedCeremonies | Enumeration::DevicePairingKinds::ConfirmPinMatch;
 		supportedCeremonies = supportedCeremonies | Enumeration::DevicePairingKinds::ProvidePasswordCredential;
 		auto commandId = command->GetNamedNumber("_id");
+		auto clientId = commandClient(command);
+		auto pairingKey = requestKey(clientId, commandId);
+		auto token = commandToken(command);
 		auto customPairing = device->DeviceInformation->Pairing->Custom;
 		customPairing->PairingRequested +=
 			ref new Windows::Foundation::TypedEventHandler<Windows::Devices::Enumeration::DeviceInformationCustomPairing^,
 			Windows::Devices::Enumeration::DevicePairingRequestedEventArgs^>(
-				[commandId](Enumeration::DeviceInformationCustomPairing^ customPairing, Enumeration::DevicePairingRequestedEventArgs^ pairRequestArgs) {
+				[commandId, clientId, pairingKey, token](Enumeration::DeviceInformationCustomPairing^ customPairing, Enumeration::DevicePairingRequestedEventArgs^ pairRequestArgs) {
 					auto deferral = pairRequestArgs->GetDeferral();
 					JsonObject^ msg = ref new JsonObject();
 					msg->Insert("pairingType", JsonValue::CreateBooleanValue(true));
@@ -358,39 +2417,61 @@ concurrency::task<IJsonValue^> pairRequest(JsonObject^ command) {
 					else if (pairRequestArgs->PairingKind == Enumeration::DevicePairingKinds::ProvidePasswordCredential) {
 						msg->Insert("_type", JsonValue::CreateStringValue("pairing_providePasswordCredential"));
 					}
-					pairingRequestWaiting->Insert(commandId, "waiting");
-					writeObject(msg);
-					// wait until accepted/cancelled
-					while (pairingRequestWaiting->Lookup(commandId)->Equals("waiting")) {
-						// wait
-						Sleep(500);
-					}
-					boolean cancel = false;
-					if (pairingRequestWaiting->Lookup(commandId)->Equals("cancel")) {
-						// do nothing because there is no reject method
+					insertIntoDeviceMap(pairingRequestWaiting, pairingKey, ref new String(L"waiting"));
+					auto answered = waitForPairingAnswer(pairingKey);
+					pauseCommandDeadline(pairingKey);
+					// an aborted command answers the prompt for the client
+					concurrency::cancellation_token_registration aborted;
+					if (token.is_cancelable()) {
+						aborted = token.register_callback([pairingKey] {
+							answerPairing(pairingKey, "cancel");
+						});
 					}
-					else if (pairRequestArgs->PairingKind == Enumeration::DevicePairingKinds::ConfirmOnly ||
-						pairRequestArgs->PairingKind == Enumeration::DevicePairingKinds::ConfirmPinMatch ||
-						pairRequestArgs->PairingKind == Enumeration::DevicePairingKinds::DisplayPin) {
-						pairRequestArgs->Accept();
-					}
-					else if (pairRequestArgs->PairingKind == Enumeration::DevicePairingKinds::ProvidePin) {
-						pairRequestArgs->Accept(pairingRequestPasswordPIN->Lookup(commandId));
-						pairingRequestPasswordPIN->Remove(commandId);
-					}
-					else if (pairRequestArgs->PairingKind == Enumeration::DevicePairingKinds::ProvidePasswordCredential) {
-						auto credential = ref new PasswordCredential();
-						credential->UserName = pairingRequestUsername->Lookup(commandId);
-						credential->Password = pairingRequestPasswordPIN->Lookup(commandId);
-						pairRequestArgs->AcceptWithPasswordCredential(credential);
-						pairingRequestUsername->Remove(commandId);
-						pairingRequestPasswordPIN->Remove(commandId);
-					}
-					pairingRequestWaiting->Remove(commandId);
+					writeObject(msg, clientId);
+					// the deferral keeps the pairing open while this callback returns without waiting for the user
+					answered.then([pairingKey, pairRequestArgs, deferral, token, aborted] {
+						if (token.is_cancelable()) {
+							token.deregister_callback(aborted);
+						}
+						restartCommandDeadline(pairingKey);
+						String^ answer = nullptr;
+						String^ username = nullptr;
+						String^ passwordPin = nullptr;
+						EnterCriticalSection(&DeviceMapsCriticalSection);
+						answer = pairingRequestWaiting->Lookup(pairingKey);
+						pairingRequestWaiting->Remove(pairingKey);
+						if (pairingRequestUsername->HasKey(pairingKey)) {
+							username = pairingRequestUsername->Lookup(pairingKey);
+							pairingRequestUsername->Remove(pairingKey);
+						}
+						if (pairingRequestPasswordPIN->HasKey(pairingKey)) {
+							passwordPin = pairingRequestPasswordPIN->Lookup(pairingKey);
+							pairingRequestPasswordPIN->Remove(pairingKey);
+						}
+						LeaveCriticalSection(&DeviceMapsCriticalSection);
 
-					deferral->Complete();
+						if (answer->Equals("cancel")) {
+							// do nothing because there is no reject method
+						}
+						else if (pairRequestArgs->PairingKind == Enumeration::DevicePairingKinds::ConfirmOnly ||
+							pairRequestArgs->PairingKind == Enumeration::DevicePairingKinds::ConfirmPinMatch ||
+							pairRequestArgs->PairingKind == Enumeration::DevicePairingKinds::DisplayPin) {
+							pairRequestArgs->Accept();
+						}
+						else if (pairRequestArgs->PairingKind == Enumeration::DevicePairingKinds::ProvidePin) {
+							pairRequestArgs->Accept(passwordPin);
+						}
+						else if (pairRequestArgs->PairingKind == Enumeration::DevicePairingKinds::ProvidePasswordCredential) {
+							auto credential = ref new PasswordCredential();
+							credential->UserName = username;
+							credential->Password = passwordPin;
+							pairRequestArgs->AcceptWithPasswordCredential(credential);
+						}
+
+						deferral->Complete();
+					});
 				});
-		auto pair_status = co_await customPairing->PairAsync(supportedCeremonies);
+		auto pair_status = co_await withCommandToken(command, "PairAsync", customPairing->PairAsync(supportedCeremonies));
 		// RejectedByHandler is raised in cases of cancellation
 		if (pair_status->Status != Enumeration::DevicePairingResultStatus::Paired
 			&& pair_status->Status != Enumeration::DevicePairingResultStatus::AlreadyPaired
@@ -407,7 +2488,7 @@ concurrency::task<IJsonValue^> pairRequest(JsonObject^ command) {
 
 concurrency::task<IJsonValue^> readRequest(JsonObject^ command, int skipPair = 0) {
 	auto characteristic = co_await getCharacteristic(command);
-	auto result = co_await characteristic->ReadValueAsync();
+	auto result = co_await withCommandToken(command, "ReadValueAsync", characteristic->ReadValueAsync());
 	if (result->Status != Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success && skipPair == 0) {
 		co_await pairRequest(command);
 		co_return co_await readRequest(command, 1);
@@ -415,25 +2496,16 @@ concurrency::task<IJsonValue^> readRequest(JsonObject^ command, int skipPair = 0
 	else if (result->Status != Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success) {
 		throw ref new FailureException(result->Status.ToString());
 	}
-	auto reader = Windows::Storage::Streams::DataReader::FromBuffer(result->Value);
-	auto valueArray = ref new JsonArray();
-	for (unsigned int i = 0; i < result->Value->Length; i++) {
-		valueArray->Append(JsonValue::CreateNumberValue(reader->ReadByte()));
-	}
-	co_return valueArray;
+	co_return bufferToJson(result->Value);
 }
 
 concurrency::task<IJsonValue^> writeRequest(JsonObject^ command, int reqWriteType = 0, int skipPair = 0) {
 	auto characteristic = co_await getCharacteristic(command);
-	auto writer = ref new Windows::Storage::Streams::DataWriter();
-	auto dataArray = command->GetNamedArray("value");
-	for (unsigned int i = 0; i < dataArray->Size; i++) {
-		writer->WriteByte((unsigned char)dataArray->GetNumberAt(i));
-	}
+	auto value = jsonToBuffer(command->GetNamedArray("value"));
 
 	bool writeWithoutResponse = (unsigned int)characteristic->CharacteristicProperties & (unsigned int)Bluetooth::GenericAttributeProfile::GattCharacteristicProperties::WriteWithoutResponse;
 	auto writeType = writeWithoutResponse ? Bluetooth::GenericAttributeProfile::GattWriteOption::WriteWithoutResponse : Bluetooth::GenericAttributeProfile::GattWriteOption::WriteWithResponse;
-	auto status = co_await characteristic->WriteValueAsync(writer->DetachBuffer(), writeType);
+	auto status = co_await withCommandToken(command, "WriteValueAsync", characteristic->WriteValueAsync(value, writeType));
 
 	// override if specified in request
 	if (reqWriteType == 1) {
@@ -454,119 +2526,456 @@ concurrency::task<IJsonValue^> writeRequest(JsonObject^ command, int reqWriteTyp
 	co_return JsonValue::CreateNullValue();
 }
 
-unsigned long nextSubscriptionId = 1;
+// Writes queued with reliableWrite go to the device as one prepared write exchange when committed, and are only
+// executed if every one of them was accepted. A transaction belongs to the client that began it and to the device of
+// its first write.
+const unsigned int MAX_RELIABLE_WRITES_PER_CLIENT = 16;
+
+struct ReliableWrite {
+	GenericAttributeProfile::GattReliableWriteTransaction^ transaction;
+	std::wstring deviceId;
+	unsigned int writes = 0;
+	unsigned int bytes = 0;
+};
+
+// keyed by requestKey(client, transaction id)
+CRITICAL_SECTION ReliableWriteCriticalSection;
+std::unordered_map<std::wstring, ReliableWrite> reliableWrites;
+unsigned int nextReliableWriteId = 1;
+
+String^ reliableWriteKey(JsonObject^ command) {
+	if (!command->HasKey("transaction")) {
+		throw ref new InvalidArgumentException(ref new String(L"Transaction id must be provided"));
+	}
+	return requestKey(commandClient(command), command->GetNamedNumber("transaction"));
+}
+
+IJsonValue^ beginReliableWriteRequest(JsonObject^ command) {
+	unsigned int clientId = commandClient(command);
+	std::wstring keyPrefix = clientId.ToString()->Data();
+	keyPrefix += L"/";
+	EnterCriticalSection(&ReliableWriteCriticalSection);
+	size_t openCount = std::count_if(reliableWrites.begin(), reliableWrites.end(), [&keyPrefix](const std::pair<const std::wstring, ReliableWrite>& pair) {
+		return pair.first.compare(0, keyPrefix.length(), keyPrefix) == 0;
+	});
+	if (openCount >= MAX_RELIABLE_WRITES_PER_CLIENT) {
+		LeaveCriticalSection(&ReliableWriteCriticalSection);
+		throw ref new FailureException(ref new String(L"Too many open reliable write transactions"));
+	}
+	unsigned int transactionId = nextReliableWriteId++;
+	ReliableWrite& reliableWrite = reliableWrites[requestKey(clientId, transactionId)->Data()];
+	reliableWrite.transaction = ref new GenericAttributeProfile::GattReliableWriteTransaction();
+	LeaveCriticalSection(&ReliableWriteCriticalSection);
+	return JsonValue::CreateNumberValue(transactionId);
+}
 
-concurrency::task<IJsonValue^> subscribeRequest(JsonObject^ command, int skipPair = 0) {
+// Only queues the write, nothing is sent before commitReliableWrite
+concurrency::task<IJsonValue^> reliableWriteRequest(JsonObject^ command) {
+	auto key = reliableWriteKey(command);
 	auto characteristic = co_await getCharacteristic(command);
+	if (!((unsigned int)characteristic->CharacteristicProperties & (unsigned int)GenericAttributeProfile::GattCharacteristicProperties::ReliableWrites)) {
+		throw ref new FailureException(ref new String(L"Characteristic doesn't support reliable writes"));
+	}
+	auto value = jsonToBuffer(command->GetNamedArray("value"));
+	std::wstring deviceId = command->GetNamedString("device")->Data();
+
+	EnterCriticalSection(&ReliableWriteCriticalSection);
+	auto found = reliableWrites.find(key->Data());
+	if (found == reliableWrites.end()) {
+		LeaveCriticalSection(&ReliableWriteCriticalSection);
+		throw ref new InvalidArgumentException(ref new String(L"Unknown reliable write transaction"));
+	}
+	if (found->second.writes > 0 && found->second.deviceId != deviceId) {
+		LeaveCriticalSection(&ReliableWriteCriticalSection);
+		throw ref new InvalidArgumentException(ref new String(L"A reliable write transaction can only write to one device"));
+	}
+	found->second.deviceId = deviceId;
+	found->second.transaction->WriteValue(characteristic, value);
+	found->second.writes++;
+	found->second.bytes += value->Length;
+	unsigned int writes = found->second.writes;
+	LeaveCriticalSection(&ReliableWriteCriticalSection);
+	co_return JsonValue::CreateNumberValue(writes);
+}
 
-	auto props = (unsigned int)characteristic->CharacteristicProperties;
+concurrency::task<IJsonValue^> commitReliableWriteRequest(JsonObject^ command) {
+	auto key = reliableWriteKey(command);
+	EnterCriticalSection(&ReliableWriteCriticalSection);
+	auto found = reliableWrites.find(key->Data());
+	if (found == reliableWrites.end()) {
+		LeaveCriticalSection(&ReliableWriteCriticalSection);
+		throw ref new InvalidArgumentException(ref new String(L"Unknown reliable write transaction"));
+	}
+	// a transaction can only be committed once, whatever the outcome
+	ReliableWrite reliableWrite = found->second;
+	reliableWrites.erase(found);
+	LeaveCriticalSection(&ReliableWriteCriticalSection);
 
-	if (props & (unsigned int)Bluetooth::GenericAttributeProfile::GattCharacteristicProperties::Notify) {
-		auto status = co_await characteristic->WriteClientCharacteristicConfigurationDescriptorAsync(Bluetooth::GenericAttributeProfile::GattClientCharacteristicConfigurationDescriptorValue::Notify);
-		if (status != Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success && skipPair == 0) {
-			co_await pairRequest(command);
-			co_return co_await subscribeRequest(command, 1);
+	if (reliableWrite.writes == 0) {
+		co_return JsonValue::CreateNullValue();
+	}
+	auto status = co_await withCommandToken(command, "CommitAsync", reliableWrite.transaction->CommitAsync());
+	if (status != GenericAttributeProfile::GattCommunicationStatus::Success) {
+		throw ref new FailureException(status.ToString());
+	}
+
+	JsonObject^ result = ref new JsonObject();
+	result->Insert("writes", JsonValue::CreateNumberValue(reliableWrite.writes));
+	result->Insert("bytes", JsonValue::CreateNumberValue(reliableWrite.bytes));
+	co_return result;
+}
+
+// Drops the queued writes, nothing was sent to the device yet
+IJsonValue^ abortReliableWriteRequest(JsonObject^ command) {
+	auto key = reliableWriteKey(command);
+	EnterCriticalSection(&ReliableWriteCriticalSection);
+	bool found = reliableWrites.erase(key->Data()) > 0;
+	LeaveCriticalSection(&ReliableWriteCriticalSection);
+	return JsonValue::CreateBooleanValue(found);
+}
+
+void removeClientReliableWrites(unsigned int clientId) {
+	std::wstring keyPrefix = clientId.ToString()->Data();
+	keyPrefix += L"/";
+	EnterCriticalSection(&ReliableWriteCriticalSection);
+	for (auto it = reliableWrites.begin(); it != reliableWrites.end();) {
+		if (it->first.compare(0, keyPrefix.length(), keyPrefix) == 0) {
+			it = reliableWrites.erase(it);
 		}
-		else if (status != Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success) {
-			throw ref new FailureException(status.ToString());
+		else {
+			++it;
 		}
 	}
-	else if (props & (unsigned int)Bluetooth::GenericAttributeProfile::GattCharacteristicProperties::Indicate) {
-		auto status = co_await characteristic->WriteClientCharacteristicConfigurationDescriptorAsync(Bluetooth::GenericAttributeProfile::GattClientCharacteristicConfigurationDescriptorValue::Indicate);
-		if (status != Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success && skipPair == 0) {
-			co_await pairRequest(command);
-			co_return co_await subscribeRequest(command, 1);
+	LeaveCriticalSection(&ReliableWriteCriticalSection);
+}
+
+std::atomic<unsigned long> nextSubscriptionId(1); // subscribes on different characteristics run concurrently
+
+// Returns the sequence number of the notification, starting at 1
+unsigned long long recordNotification(NotificationStats& stats, long long receivedAt, unsigned int length) {
+	EnterCriticalSection(&NotificationStatsCriticalSection);
+	unsigned long long sequence = ++stats.sequence;
+	stats.bytes += length;
+	if (sequence == 1) {
+		stats.firstTimestamp = receivedAt;
+	}
+	else {
+		double interval = (double)(receivedAt - stats.lastTimestamp);
+		if (sequence == 2) {
+			stats.intervalAverage = interval;
 		}
-		else if (status != Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success) {
-			throw ref new FailureException(status.ToString());
+		else {
+			stats.intervalAverage += (interval - stats.intervalAverage) / 16;
+			stats.jitter += (std::abs(interval - stats.lastInterval) - stats.jitter) / 16;
 		}
+		stats.lastInterval = interval;
+	}
+	stats.lastTimestamp = receivedAt;
+	LeaveCriticalSection(&NotificationStatsCriticalSection);
+	return sequence;
+}
+
+void recordNotificationWritten(NotificationStats& stats, long long receivedAt) {
+	double delay = (double)(currentUniversalTime() - receivedAt);
+	EnterCriticalSection(&NotificationStatsCriticalSection);
+	stats.queueDelayAverage = stats.queueDelaySamples++ == 0 ? delay : stats.queueDelayAverage + (delay - stats.queueDelayAverage) / 16;
+	if (delay > stats.queueDelayMax) {
+		stats.queueDelayMax = delay;
+	}
+	LeaveCriticalSection(&NotificationStatsCriticalSection);
+}
+
+Subscriber commandSubscriber(JsonObject^ command) {
+	return Subscriber(commandClient(command), command->GetNamedString("subscriber", "")->Data());
+}
+
+// Writes the CCCD, pairing first if the device requires it
+concurrency::task<void> writeCccd(JsonObject^ command, Bluetooth::GenericAttributeProfile::GattCharacteristic^ characteristic,
+	Bluetooth::GenericAttributeProfile::GattClientCharacteristicConfigurationDescriptorValue value) {
+	auto status = co_await withCommandToken(command, "WriteClientCharacteristicConfigurationDescriptorAsync", characteristic->WriteClientCharacteristicConfigurationDescriptorAsync(value));
+	if (status != Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success) {
+		co_await pairRequest(command);
+		status = co_await withCommandToken(command, "WriteClientCharacteristicConfigurationDescriptorAsync", characteristic->WriteClientCharacteristicConfigurationDescriptorAsync(value));
+	}
+	if (status != Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success) {
+		throw ref new FailureException(status.ToString());
+	}
+}
+
+// Must be called while holding the characteristic's CccdLock
+concurrency::task<IJsonValue^> enableNotifications(JsonObject^ command, Bluetooth::GenericAttributeProfile::GattCharacteristic^ characteristic, String^ key) {
+	JsonValue^ existingSubscriptionId = nullptr;
+	if (findInDeviceMap(characteristicsSubscriptionMap, key, existingSubscriptionId)) {
+		// another subscriber already enabled them
+		co_return existingSubscriptionId;
+	}
+
+	auto props = (unsigned int)characteristic->CharacteristicProperties;
+
+	if (props & (unsigned int)Bluetooth::GenericAttributeProfile::GattCharacteristicProperties::Notify) {
+		co_await writeCccd(command, characteristic, Bluetooth::GenericAttributeProfile::GattClientCharacteristicConfigurationDescriptorValue::Notify);
+	}
+	else if (props & (unsigned int)Bluetooth::GenericAttributeProfile::GattCharacteristicProperties::Indicate) {
+		co_await writeCccd(command, characteristic, Bluetooth::GenericAttributeProfile::GattClientCharacteristicConfigurationDescriptorValue::Indicate);
 	}
 	else {
 		throw ref new FailureException("Operation not supported.");
 	}
 
-	auto key = characteristicKey(command);
-	if (characteristicsSubscriptionMap->HasKey(key)) {
-		co_return characteristicsSubscriptionMap->Lookup(key);
-	}
+	auto subscriptionId = JsonValue::CreateNumberValue(nextSubscriptionId.fetch_add(1));
 
-	auto subscriptionId = JsonValue::CreateNumberValue(nextSubscriptionId++);
+	auto stats = std::make_shared<NotificationStats>();
+	stats->subscriptionId = subscriptionId->GetNumber();
+	EnterCriticalSection(&NotificationStatsCriticalSection);
+	notificationStats[key->Data()] = stats;
+	LeaveCriticalSection(&NotificationStatsCriticalSection);
 
+	// One registration per characteristic, fanned out to the clients of all its subscribers
 	Windows::Foundation::EventRegistrationToken cookie =
 		characteristic->ValueChanged += ref new Windows::Foundation::TypedEventHandler<Bluetooth::GenericAttributeProfile::GattCharacteristic^, Bluetooth::GenericAttributeProfile::GattValueChangedEventArgs^>(
-			[subscriptionId](Bluetooth::GenericAttributeProfile::GattCharacteristic^ characteristic, Bluetooth::GenericAttributeProfile::GattValueChangedEventArgs^ eventArgs) {
+			[subscriptionId, key, stats](Bluetooth::GenericAttributeProfile::GattCharacteristic^ characteristic, Bluetooth::GenericAttributeProfile::GattValueChangedEventArgs^ eventArgs) {
+				long long receivedAt = eventArgs->Timestamp.UniversalTime;
+				unsigned long long sequence = recordNotification(*stats, receivedAt, eventArgs->CharacteristicValue->Length);
+
 				JsonObject^ msg = ref new JsonObject();
 				msg->Insert("_type", JsonValue::CreateStringValue("valueChangedNotification"));
 				msg->Insert("subscriptionId", subscriptionId);
-				auto reader = Windows::Storage::Streams::DataReader::FromBuffer(eventArgs->CharacteristicValue);
-				auto valueArray = ref new JsonArray();
-				for (unsigned int i = 0; i < eventArgs->CharacteristicValue->Length; i++) {
-					valueArray->Append(JsonValue::CreateNumberValue(reader->ReadByte()));
-				}
-				msg->Insert("value", valueArray);
-				writeObject(msg);
+				// consecutive per subscription, so that receivers can tell lost notifications from late ones
+				msg->Insert("seq", JsonValue::CreateNumberValue((double)sequence));
+				msg->Insert("timestamp", JsonValue::CreateNumberValue(universalTimeToUnixMs(receivedAt)));
+				msg->Insert("value", bufferToJson(eventArgs->CharacteristicValue));
+				writeObject(msg, subscriptionClientList(key), [stats, receivedAt] {
+					recordNotificationWritten(*stats, receivedAt);
+				});
 			});
 
+	EnterCriticalSection(&DeviceMapsCriticalSection);
 	characteristicsListenerMap->Insert(key, cookie);
 	characteristicsSubscriptionMap->Insert(key, subscriptionId);
+	LeaveCriticalSection(&DeviceMapsCriticalSection);
+
+	co_return subscriptionId;
+}
+
+// Subscribing again with the same subscriber name is counted, it takes as many unsubscribes to leave
+concurrency::task<IJsonValue^> subscribeRequest(JsonObject^ command) {
+	auto characteristic = co_await getCharacteristic(command);
+	auto key = characteristicKey(command);
+	auto subscriber = commandSubscriber(command);
+
+	// Counted before waiting for the CCCD so that a concurrent last unsubscribe leaves notifications enabled
+	EnterCriticalSection(&ClientsCriticalSection);
+	bool clientOpen = clients.find(subscriber.first) != clients.end();
+	if (clientOpen) {
+		characteristicSubscribers[key->Data()].counts[subscriber]++;
+	}
+	LeaveCriticalSection(&ClientsCriticalSection);
+	if (!clientOpen) {
+		throw ref new FailureException(ref new String(L"Client closed"));
+	}
+
+	std::exception_ptr failure;
+	IJsonValue^ subscriptionId = nullptr;
+	bool orphaned = false;
+	try {
+		CccdLock lock(key);
+		co_await lock.acquired();
+		subscriptionId = co_await enableNotifications(command, characteristic, key);
+
+		// closeClient drops the client's subscribers while the CCCD is written, and it found no subscription to remove
+		// yet. Checked under the CCCD lock like the last unsubscribe.
+		EnterCriticalSection(&ClientsCriticalSection);
+		orphaned = characteristicSubscribers.find(key->Data()) == characteristicSubscribers.end();
+		LeaveCriticalSection(&ClientsCriticalSection);
+		if (orphaned) {
+			removeSubscription(key);
+			co_await concurrency::create_task(characteristic->WriteClientCharacteristicConfigurationDescriptorAsync(
+				Bluetooth::GenericAttributeProfile::GattClientCharacteristicConfigurationDescriptorValue::None));
+		}
+	}
+	catch (...) {
+		failure = std::current_exception();
+	}
+	if (failure) {
+		EnterCriticalSection(&ClientsCriticalSection);
+		auto subscribers = characteristicSubscribers.find(key->Data());
+		if (subscribers != characteristicSubscribers.end()) {
+			auto count = subscribers->second.counts.find(subscriber);
+			if (count != subscribers->second.counts.end() && --count->second == 0) {
+				subscribers->second.counts.erase(count);
+			}
+			if (subscribers->second.counts.empty()) {
+				characteristicSubscribers.erase(subscribers);
+			}
+		}
+		LeaveCriticalSection(&ClientsCriticalSection);
+		std::rethrow_exception(failure);
+	}
+	if (orphaned) {
+		throw ref new FailureException(ref new String(L"Client closed"));
+	}
+	co_return subscriptionId;
+}
+
+concurrency::task<IJsonValue^> unsubscribeRequest(JsonObject^ command) {
+	auto characteristic = co_await getCharacteristic(command);
+	auto key = characteristicKey(command);
+	auto subscriber = commandSubscriber(command);
+
+	EnterCriticalSection(&ClientsCriticalSection);
+	auto subscribers = characteristicSubscribers.find(key->Data());
+	if (subscribers != characteristicSubscribers.end()) {
+		auto count = subscribers->second.counts.find(subscriber);
+		if (count != subscribers->second.counts.end() && --count->second == 0) {
+			subscribers->second.counts.erase(count);
+		}
+		if (subscribers->second.counts.empty()) {
+			characteristicSubscribers.erase(subscribers);
+		}
+	}
+	LeaveCriticalSection(&ClientsCriticalSection);
+
+	CccdLock lock(key);
+	co_await lock.acquired();
+
+	// Checked under the CCCD lock, a new subscriber may have arrived in the meantime
+	EnterCriticalSection(&ClientsCriticalSection);
+	bool lastSubscriber = characteristicSubscribers.find(key->Data()) == characteristicSubscribers.end();
+	LeaveCriticalSection(&ClientsCriticalSection);
+	JsonValue^ subscriptionId = nullptr;
+	if (!findInDeviceMap(characteristicsSubscriptionMap, key, subscriptionId)) {
+		co_return JsonValue::CreateNullValue();
+	}
+	if (!lastSubscriber) {
+		co_return subscriptionId;
+	}
+
+	co_await writeCccd(command, characteristic, Bluetooth::GenericAttributeProfile::GattClientCharacteristicConfigurationDescriptorValue::None);
+
+	removeSubscription(key);
 
 	co_return subscriptionId;
 }
 
-concurrency::task<IJsonValue^> unsubscribeRequest(JsonObject^ command, int skipPair = 0) {
-	auto characteristic = co_await getCharacteristic(command);
-
-	auto status = co_await characteristic->WriteClientCharacteristicConfigurationDescriptorAsync(Bluetooth::GenericAttributeProfile::GattClientCharacteristicConfigurationDescriptorValue::None);
-	if (status != Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success && skipPair == 0) {
-		co_await pairRequest(command);
-		co_return co_await unsubscribeRequest(command, 1);
+// Notification counters for the client's subscriptions, or only for the given subscriptionId
+IJsonValue^ subscriptionStatsRequest(JsonObject^ command) {
+	unsigned int clientId = commandClient(command);
+	bool singleSubscription = command->HasKey("subscriptionId");
+	double subscriptionId = command->GetNamedNumber("subscriptionId", 0);
+
+	std::vector<std::wstring> keys;
+	EnterCriticalSection(&ClientsCriticalSection);
+	for (auto& pair : characteristicSubscribers) {
+		if (pair.second.hasClient(clientId)) {
+			keys.push_back(pair.first);
+		}
 	}
-	else if (status != Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success) {
-		throw ref new FailureException(status.ToString());
+	LeaveCriticalSection(&ClientsCriticalSection);
+
+	auto result = ref new JsonArray();
+	EnterCriticalSection(&NotificationStatsCriticalSection);
+	for (auto& key : keys) {
+		auto found = notificationStats.find(key);
+		if (found == notificationStats.end() || (singleSubscription && found->second->subscriptionId != subscriptionId)) {
+			continue;
+		}
+		auto& stats = *found->second;
+		auto item = ref new JsonObject();
+		item->Insert("subscriptionId", JsonValue::CreateNumberValue(stats.subscriptionId));
+		item->Insert("notifications", JsonValue::CreateNumberValue((double)stats.sequence));
+		item->Insert("bytes", JsonValue::CreateNumberValue((double)stats.bytes));
+		item->Insert("firstTimestamp", stats.sequence > 0 ? JsonValue::CreateNumberValue(universalTimeToUnixMs(stats.firstTimestamp)) : JsonValue::CreateNullValue());
+		item->Insert("lastTimestamp", stats.sequence > 0 ? JsonValue::CreateNumberValue(universalTimeToUnixMs(stats.lastTimestamp)) : JsonValue::CreateNullValue());
+		item->Insert("ratePerSecond", JsonValue::CreateNumberValue(stats.intervalAverage > 0 ? 10000000.0 / stats.intervalAverage : 0));
+		item->Insert("intervalMs", JsonValue::CreateNumberValue(stats.intervalAverage / 10000.0));
+		item->Insert("jitterMs", JsonValue::CreateNumberValue(stats.jitter / 10000.0));
+		item->Insert("queueDelayMs", JsonValue::CreateNumberValue(stats.queueDelayAverage / 10000.0));
+		item->Insert("queueDelayMaxMs", JsonValue::CreateNumberValue(stats.queueDelayMax / 10000.0));
+		result->Append(item);
 	}
+	LeaveCriticalSection(&NotificationStatsCriticalSection);
+	return result;
+}
 
-	auto key = characteristicKey(command);
+// Timings of the process start, in the 100ns units of currentUniversalTime, reported by Start and stats
+long long processCreated = 0; // when Windows created the process
+long long mainEntered = 0;
+std::atomic<long long> firstStartWritten(0);
+std::atomic<long long> adapterFetched(0);
 
-	if (characteristicsListenerMap->HasKey(key)) {
-		characteristic->ValueChanged -= characteristicsListenerMap->Lookup(key);
-	}
+double elapsedMs(long long from, long long to) {
+	return from != 0 && to >= from ? (to - from) / 10000.0 : 0;
+}
+
+JsonObject^ startupTimings() {
+	JsonObject^ result = ref new JsonObject();
+	result->Insert("processToMainMs", JsonValue::CreateNumberValue(elapsedMs(processCreated, mainEntered)));
+	result->Insert("mainToStartMs", JsonValue::CreateNumberValue(elapsedMs(mainEntered, firstStartWritten.load())));
+	result->Insert("mainToAdapterMs", JsonValue::CreateNumberValue(elapsedMs(mainEntered, adapterFetched.load())));
+	return result;
+}
 
-	auto subscriptionId = characteristicsSubscriptionMap->Lookup(key);
+// The default adapter is fetched in the background at startup, so that the first availability check doesn't pay for it
+CRITICAL_SECTION AdapterCriticalSection;
+concurrency::task<BluetoothAdapter^> defaultAdapterTask;
 
-	characteristicsListenerMap->Remove(key);
-	characteristicsSubscriptionMap->Remove(key);
+void prefetchDefaultAdapter() {
+	auto task = concurrency::create_task(BluetoothAdapter::GetDefaultAsync());
+	EnterCriticalSection(&AdapterCriticalSection);
+	defaultAdapterTask = task;
+	LeaveCriticalSection(&AdapterCriticalSection);
+	task.then([](concurrency::task<BluetoothAdapter^> result) {
+		try {
+			result.get();
+		}
+		catch (Exception^) {
+			// checkAvailability looks it up again
+		}
+		adapterFetched = currentUniversalTime();
+	});
+}
 
-	co_return subscriptionId;
+concurrency::task<BluetoothAdapter^> defaultAdapter() {
+	EnterCriticalSection(&AdapterCriticalSection);
+	auto task = defaultAdapterTask;
+	LeaveCriticalSection(&AdapterCriticalSection);
+	return task;
 }
 
 concurrency::task<IJsonValue^> checkAvailability(JsonObject^ command) {
-	auto adapter = co_await BluetoothAdapter::GetDefaultAsync();
-	if (adapter != nullptr) {
-		co_return JsonValue::CreateBooleanValue(true);
+	BluetoothAdapter^ adapter = nullptr;
+	try {
+		adapter = co_await withCommandToken(command, "GetDefaultAsync", defaultAdapter());
+	}
+	catch (Exception^) {
+		// looked up again below
 	}
-	co_return JsonValue::CreateBooleanValue(false);
+	if (adapter == nullptr) {
+		// an adapter may have been plugged in or enabled since it was fetched
+		adapter = co_await withCommandToken(command, "GetDefaultAsync", BluetoothAdapter::GetDefaultAsync());
+		if (adapter != nullptr) {
+			EnterCriticalSection(&AdapterCriticalSection);
+			defaultAdapterTask = concurrency::task_from_result(adapter);
+			LeaveCriticalSection(&AdapterCriticalSection);
+		}
+	}
+	co_return JsonValue::CreateBooleanValue(adapter != nullptr);
 }
 
-concurrency::task<IJsonValue^> getDescriptorUuidAndValueAsJson(GenericAttributeProfile::GattDescriptor^ descriptor, BluetoothCacheMode cacheMode = BluetoothCacheMode::Uncached) {
+concurrency::task<IJsonValue^> getDescriptorUuidAndValueAsJson(JsonObject^ command, GenericAttributeProfile::GattDescriptor^ descriptor, BluetoothCacheMode cacheMode = BluetoothCacheMode::Uncached) {
 	auto result = ref new JsonObject();
 
-	result->Insert("uuid", JsonValue::CreateStringValue(descriptor->Uuid.ToString()));
+	result->Insert("uuid", JsonValue::CreateStringValue(uuidToString(descriptor->Uuid)));
 
 	GenericAttributeProfile::GattReadResult^ descValue;
 
-	descValue = co_await descriptor->ReadValueAsync(cacheMode);
+	descValue = co_await withCommandToken(command, "descriptor.ReadValueAsync", descriptor->ReadValueAsync(cacheMode));
 
 	if (descValue->Status != GenericAttributeProfile::GattCommunicationStatus::Success) {
 		throw ref new FailureException("Unable to read descriptor value: " + descValue->Status.ToString());
 	}
 
-	auto reader = Windows::Storage::Streams::DataReader::FromBuffer(descValue->Value);
-	auto valueArray = ref new JsonArray();
-	for (unsigned int i = 0; i < descValue->Value->Length; i++) {
-		valueArray->Append(JsonValue::CreateNumberValue(reader->ReadByte()));
-	}
-
-	result->Insert("value", valueArray);
+	result->Insert("value", bufferToJson(descValue->Value));
 
 	co_return result;
 }
@@ -574,7 +2983,7 @@ concurrency::task<IJsonValue^> getDescriptorUuidAndValueAsJson(GenericAttributeP
 concurrency::task<GenericAttributeProfile::GattDescriptor^> retrieveFirstDescriptor(JsonObject^ command) {
 	auto characteristic = co_await getCharacteristic(command);
 	auto descriptorUuid = parseUuid(command->GetNamedString("descriptor"));
-	auto descriptors = co_await characteristic->GetDescriptorsForUuidAsync(descriptorUuid, BluetoothCacheMode::Uncached);
+	auto descriptors = co_await withCommandToken(command, "GetDescriptorsForUuidAsync", characteristic->GetDescriptorsForUuidAsync(descriptorUuid, BluetoothCacheMode::Uncached));
 	if (descriptors->Status != GenericAttributeProfile::GattCommunicationStatus::Success) {
 		throw ref new FailureException("Unable to retrieve descriptors");
 	}
@@ -587,7 +2996,7 @@ concurrency::task<GenericAttributeProfile::GattDescriptor^> retrieveFirstDescrip
 concurrency::task<IJsonValue^> getDescriptor(JsonObject^ command, BluetoothCacheMode cacheMode = BluetoothCacheMode::Uncached) {
 	auto firstDesc = co_await retrieveFirstDescriptor(command);
 
-	auto result = co_await getDescriptorUuidAndValueAsJson(firstDesc, cacheMode);
+	auto result = co_await getDescriptorUuidAndValueAsJson(command, firstDesc, cacheMode);
 
 	co_return result;
 }
@@ -602,10 +3011,10 @@ concurrency::task<IJsonValue^> getDescriptors(JsonObject^ command) {
 
 	if (command->HasKey("descriptor")) {
 		auto descriptorUuid = parseUuid(command->GetNamedString("descriptor"));
-		descriptors = co_await characteristic->GetDescriptorsForUuidAsync(descriptorUuid, BluetoothCacheMode::Uncached);
+		descriptors = co_await withCommandToken(command, "GetDescriptorsForUuidAsync", characteristic->GetDescriptorsForUuidAsync(descriptorUuid, BluetoothCacheMode::Uncached));
 	}
 	else {
-		descriptors = co_await characteristic->GetDescriptorsAsync(BluetoothCacheMode::Uncached);
+		descriptors = co_await withCommandToken(command, "GetDescriptorsAsync", characteristic->GetDescriptorsAsync(BluetoothCacheMode::Uncached));
 	}
 
 	if (descriptors->Status != GenericAttributeProfile::GattCommunicationStatus::Success) {
@@ -616,7 +3025,7 @@ concurrency::task<IJsonValue^> getDescriptors(JsonObject^ command) {
 
 	for (int i = 0; i < descSize; i++) {
 		auto desDesc = descriptors->Descriptors->GetAt(i);
-		auto resultInner = co_await getDescriptorUuidAndValueAsJson(desDesc, BluetoothCacheMode::Cached);
+		auto resultInner = co_await getDescriptorUuidAndValueAsJson(command, desDesc, BluetoothCacheMode::Cached);
 		resultlist->Append(resultInner);
 	}
 
@@ -628,21 +3037,884 @@ concurrency::task<IJsonValue^> getDescriptors(JsonObject^ command) {
 concurrency::task<IJsonValue^> writeDescriptorValue(JsonObject^ command) {
 	auto firstDesc = co_await retrieveFirstDescriptor(command);
 
-	auto writer = ref new Windows::Storage::Streams::DataWriter();
-	auto dataArray = command->GetNamedArray("value");
-	for (unsigned int i = 0; i < dataArray->Size; i++) {
-		writer->WriteByte((unsigned char)dataArray->GetNumberAt(i));
-	}
+	auto value = jsonToBuffer(command->GetNamedArray("value"));
 
-	auto writeStatus = co_await firstDesc->WriteValueAsync(writer->DetachBuffer());
+	auto writeStatus = co_await withCommandToken(command, "descriptor.WriteValueAsync", firstDesc->WriteValueAsync(value));
 
 	if (writeStatus != GenericAttributeProfile::GattCommunicationStatus::Success) {
 		throw ref new FailureException("Unable to write descriptor value: " + writeStatus.ToString());
 	}
 
-	auto result = co_await getDescriptorUuidAndValueAsJson(firstDesc, BluetoothCacheMode::Uncached);
+	auto result = co_await getDescriptorUuidAndValueAsJson(command, firstDesc, BluetoothCacheMode::Uncached);
+
+	co_return result;
+}
+
+static_assert(sizeof(AdvertisementUuid) == sizeof(GUID), "AdvertisementUuid must have the layout of a GUID");
+
+inline const GUID& asGuid(const AdvertisementUuid& uuid) {
+	return reinterpret_cast<const GUID&>(uuid);
+}
+
+std::wstring utf8ToWide(const uint8_t* data, size_t length) {
+	if (length == 0) {
+		return std::wstring();
+	}
+	int count = MultiByteToWideChar(CP_UTF8, 0, reinterpret_cast<const char*>(data), (int)length, nullptr, 0);
+	std::wstring result(count, L'\0');
+	MultiByteToWideChar(CP_UTF8, 0, reinterpret_cast<const char*>(data), (int)length, &result[0], count);
+	return result;
+}
+
+bool matchesScanFilter(const ScanFilter& filter, unsigned long long address, const std::wstring& name, const ParsedAdvertisement& advertisement) {
+	if (filter.hasAddress && filter.address != address) {
+		return false;
+	}
+	if (filter.hasName && filter.name != name) {
+		return false;
+	}
+	if (!filter.namePrefix.empty() && name.compare(0, filter.namePrefix.length(), filter.namePrefix) != 0) {
+		return false;
+	}
+	for (auto& service : filter.services) {
+		if (std::none_of(advertisement.serviceUuids.begin(), advertisement.serviceUuids.end(), [&](const AdvertisementUuid& uuid) {
+			return asGuid(uuid) == service;
+		})) {
+			return false;
+		}
+	}
+	if (!filter.companyIdentifiers.empty() && std::none_of(advertisement.manufacturerData.begin(), advertisement.manufacturerData.end(), [&](const AdvertisementManufacturerData& manufacturerData) {
+		return std::find(filter.companyIdentifiers.begin(), filter.companyIdentifiers.end(), manufacturerData.companyIdentifier) != filter.companyIdentifiers.end();
+	})) {
+		return false;
+	}
+	if (!filter.serviceData.empty() && std::none_of(advertisement.serviceData.begin(), advertisement.serviceData.end(), [&](const AdvertisementServiceData& serviceData) {
+		return std::find(filter.serviceData.begin(), filter.serviceData.end(), asGuid(serviceData.uuid)) != filter.serviceData.end();
+	})) {
+		return false;
+	}
+	return true;
+}
+
+// Collects the sessions interested in an advertisement and the clients owning them
+void matchScanSessions(unsigned long long address, const std::wstring& localName, const ParsedAdvertisement& advertisement,
+	std::vector<unsigned int>& clientIds, JsonArray^ sessionIds, bool& rawSections) {
+	std::set<unsigned int> matchedClients;
+	std::wstring name = localName;
+
+	EnterCriticalSection(&ScanCriticalSection);
+	if (!name.empty()) {
+		if (advertisedNames.size() >= MAX_ADVERTISED_NAMES && advertisedNames.find(address) == advertisedNames.end()) {
+			advertisedNames.clear();
+		}
+		advertisedNames[address] = name;
+	}
+	else {
+		auto found = advertisedNames.find(address);
+		if (found != advertisedNames.end()) {
+			name = found->second;
+		}
+	}
+	for (auto& pair : scanSessions) {
+		auto& session = pair.second;
+		if (session.filters.empty() || std::any_of(session.filters.begin(), session.filters.end(), [&](const ScanFilter& filter) {
+			return matchesScanFilter(filter, address, name, advertisement);
+		})) {
+			matchedClients.insert(session.clientId);
+			sessionIds->Append(JsonValue::CreateNumberValue(session.id));
+			rawSections = rawSections || session.rawSections;
+		}
+	}
+	LeaveCriticalSection(&ScanCriticalSection);
+
+	clientIds = clientList(matchedClients);
+}
+
+// Flattens the advertisement's data sections back into a raw payload so that it can be parsed in a single pass.
+// Sections that don't fit are dropped.
+void readAdvertisementPayload(Bluetooth::Advertisement::BluetoothLEAdvertisement^ advertisement, AdvertisementRecord& record) {
+	record.payloadLength = 0;
+	for (auto section : advertisement->DataSections) {
+		auto data = section->Data;
+		unsigned int length = data->Length;
+		// longer sections can't be represented as an AD structure
+		if (length > 254 || record.payloadLength + 2 + length > MAX_ADVERTISEMENT_PAYLOAD) {
+			continue;
+		}
+		uint8_t* structure = record.payload + record.payloadLength;
+		structure[0] = (uint8_t)(length + 1);
+		structure[1] = section->DataType;
+		if (length > 0) {
+			memcpy(structure + 2, bufferBytes(data), length);
+		}
+		record.payloadLength += (unsigned short)(2 + length);
+	}
+}
+
+// Runs on the thread Windows delivers advertisements on: only copies the advertisement and hands it to a worker
+void advertisementReceived(Bluetooth::Advertisement::BluetoothLEAdvertisementWatcher^ watcher, Bluetooth::Advertisement::BluetoothLEAdvertisementReceivedEventArgs^ eventArgs) {
+	// TransmitPowerLevelInDBm requires Windows 10 version 2004, the advertised Tx Power Level is used before that
+	static const bool transmitPowerPresent = Windows::Foundation::Metadata::ApiInformation::IsPropertyPresent(
+		"Windows.Devices.Bluetooth.Advertisement.BluetoothLEAdvertisementReceivedEventArgs",
+		"TransmitPowerLevelInDBm");
+
+	thread_local AdvertisementRecord record;
+	record.address = eventArgs->BluetoothAddress;
+	record.timestamp = eventArgs->Timestamp.UniversalTime;
+	record.rssi = eventArgs->RawSignalStrengthInDBm;
+	record.hasTransmitPower = transmitPowerPresent && eventArgs->TransmitPowerLevelInDBm != nullptr;
+	record.transmitPower = record.hasTransmitPower ? eventArgs->TransmitPowerLevelInDBm->Value : 0;
+	record.advertisementType = (unsigned char)eventArgs->AdvertisementType;
+	readAdvertisementPayload(eventArgs->Advertisement, record);
+	ingestReceived++;
+
+	auto& worker = *ingestWorkers[std::hash<unsigned long long>()(record.address) % INGEST_WORKER_COUNT];
+	if (!worker.queue.tryPush(record)) {
+		ingestOverflows++;
+		if (ingestDropPolicy.load() == IngestDropPolicy::DropNewest) {
+			ingestDroppedNewest++;
+			return;
+		}
+		thread_local AdvertisementRecord discarded;
+		while (!worker.queue.tryPush(record)) {
+			if (worker.queue.tryPop(discarded)) {
+				ingestDroppedOldest++;
+			}
+		}
+	}
+
+	size_t depth = worker.queue.approximateSize();
+	size_t highWater = ingestQueueHighWater.load();
+	while (depth > highWater && !ingestQueueHighWater.compare_exchange_weak(highWater, depth)) {
+	}
+
+	// pairs with the fence in runIngestWorker so that a worker going idle can't miss this record
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (worker.idle.load()) {
+		SetEvent(worker.wakeEvent);
+	}
+}
+
+// FNV-1a over the advertisement type and payload
+unsigned long long hashAdvertisement(const AdvertisementRecord& record) {
+	unsigned long long hash = 14695981039346656037ULL;
+	hash = (hash ^ record.advertisementType) * 1099511628211ULL;
+	for (unsigned int i = 0; i < record.payloadLength; i++) {
+		hash = (hash ^ record.payload[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Returns true if the device sent the same advertisement within the dedup interval
+bool isDuplicateAdvertisement(IngestWorker& worker, const AdvertisementRecord& record) {
+	unsigned int dedupMs = ingestDedupMs.load();
+	if (dedupMs == 0) {
+		return false;
+	}
+	unsigned long long payloadHash = hashAdvertisement(record);
+	auto found = worker.recentAdvertisements.find(record.address);
+	if (found != worker.recentAdvertisements.end()) {
+		// timestamps are in 100ns units
+		if (found->second.payloadHash == payloadHash && record.timestamp - found->second.timestamp < (long long)dedupMs * 10000) {
+			return true;
+		}
+	}
+	else if (worker.recentAdvertisements.size() >= MAX_DEDUPLICATED_ADDRESSES) {
+		worker.recentAdvertisements.clear();
+	}
+	worker.recentAdvertisements[record.address] = RecentAdvertisement{ payloadHash, record.timestamp };
+	return false;
+}
+
+// The scan result for an advertisement, without the scan sessions it matched or the gattId
+JsonObject^ scanResultJson(const AdvertisementRecord& record, const ParsedAdvertisement& advertisement, const std::wstring& localName, bool rawSections) {
+	JsonObject^ msg = ref new JsonObject();
+	msg->Insert("_type", JsonValue::CreateStringValue("scanResult"));
+	wchar_t addressText[BLUETOOTH_ADDRESS_LENGTH + 1];
+	formatBluetoothAddress(record.address, addressText);
+	msg->Insert("bluetoothAddress", JsonValue::CreateStringValue(StringReference(addressText, BLUETOOTH_ADDRESS_LENGTH)));
+	msg->Insert("rssi", JsonValue::CreateNumberValue(record.rssi));
+	msg->Insert("timestamp", JsonValue::CreateNumberValue(universalTimeToUnixMs(record.timestamp)));
+	msg->Insert("advType", JsonValue::CreateStringValue(((Bluetooth::Advertisement::BluetoothLEAdvertisementType)record.advertisementType).ToString()));
+	msg->Insert("localName", JsonValue::CreateStringValue(StringReference(localName.c_str(), (unsigned int)localName.length())));
+	msg->Insert("flags", advertisement.hasFlags ? JsonValue::CreateNumberValue(advertisement.flags) : JsonValue::CreateNullValue());
+	msg->Insert("appearance", advertisement.hasAppearance ? JsonValue::CreateNumberValue(advertisement.appearance) : JsonValue::CreateNullValue());
+
+	if (record.hasTransmitPower) {
+		msg->Insert("txPower", JsonValue::CreateNumberValue(record.transmitPower));
+	}
+	else if (advertisement.hasTxPower) {
+		msg->Insert("txPower", JsonValue::CreateNumberValue(advertisement.txPower));
+	}
+	else {
+		msg->Insert("txPower", JsonValue::CreateNullValue());
+	}
+
+	JsonArray^ serviceUuids = ref new JsonArray();
+	for (auto& uuid : advertisement.serviceUuids) {
+		serviceUuids->Append(JsonValue::CreateStringValue(uuidToString(Guid(asGuid(uuid)))));
+	}
+	msg->Insert("serviceUuids", serviceUuids);
+
+	auto manufacturerDataJson = ref new JsonArray();
+	for (auto& manufacturerData : advertisement.manufacturerData) {
+		auto manufacturerItem = ref new JsonObject();
+		manufacturerItem->Insert("companyIdentifier", JsonValue::CreateNumberValue(manufacturerData.companyIdentifier));
+		manufacturerItem->Insert("data", bytesToJson(manufacturerData.data, manufacturerData.length));
+		manufacturerDataJson->Append(manufacturerItem);
+	}
+	msg->Insert("manufacturerData", manufacturerDataJson);
+
+	auto serviceDataJson = ref new JsonArray();
+	for (auto& serviceData : advertisement.serviceData) {
+		auto serviceDataItem = ref new JsonObject();
+		// 16 and 32-bit UUIDs are reported as numbers, as advertised
+		if (serviceData.uuidLength == 16) {
+			serviceDataItem->Insert("service", JsonValue::CreateStringValue(uuidToString(Guid(asGuid(serviceData.uuid)))));
+		}
+		else {
+			serviceDataItem->Insert("service", JsonValue::CreateNumberValue(serviceData.shortUuid));
+		}
+		serviceDataItem->Insert("data", bytesToJson(serviceData.data, serviceData.length));
+		serviceDataJson->Append(serviceDataItem);
+	}
+	msg->Insert("serviceData", serviceDataJson);
+
+	if (rawSections) {
+		auto sectionsJson = ref new JsonArray();
+		for (auto& section : advertisement.sections) {
+			auto sectionItem = ref new JsonObject();
+			sectionItem->Insert("type", JsonValue::CreateNumberValue(section.type));
+			sectionItem->Insert("data", bytesToJson(section.data, section.length));
+			sectionsJson->Append(sectionItem);
+		}
+		msg->Insert("dataSections", sectionsJson);
+	}
+	return msg;
+}
+
+// Devices seen recently, so that a device chooser can list them before the first advertisement of its own scan arrives.
+// Fed by every advertisement the ingest workers process, whether or not a scan session wanted it. Shared by all clients
+// on purpose: they all see the same radio, and any of them could start a scan to see the same devices.
+// The least recently seen device makes room for a new one.
+const size_t MAX_RECENT_DEVICES = 256;
+const unsigned int DEFAULT_RECENT_DEVICE_MAX_AGE_MS = 5 * 60 * 1000;
+std::atomic<unsigned int> recentDeviceMaxAgeMs(DEFAULT_RECENT_DEVICE_MAX_AGE_MS);
+
+// The last advertisement of the device, keeping only the payload bytes actually advertised
+struct RecentDevice {
+	long long timestamp;
+	short rssi;
+	bool hasTransmitPower;
+	short transmitPower;
+	unsigned char advertisementType;
+	std::vector<uint8_t> payload;
+	std::wstring localName; // the last one advertised, names are often only in scan responses
+	std::list<unsigned long long>::iterator recency;
+};
+
+CRITICAL_SECTION RecentDevicesCriticalSection;
+std::unordered_map<unsigned long long, RecentDevice> recentDevices;
+std::list<unsigned long long> recentDeviceOrder; // addresses, most recently seen first
+
+void recordRecentDevice(const AdvertisementRecord& record, const std::wstring& localName) {
+	EnterCriticalSection(&RecentDevicesCriticalSection);
+	auto found = recentDevices.find(record.address);
+	if (found == recentDevices.end()) {
+		if (recentDevices.size() >= MAX_RECENT_DEVICES) {
+			recentDevices.erase(recentDeviceOrder.back());
+			recentDeviceOrder.pop_back();
+		}
+		found = recentDevices.emplace(record.address, RecentDevice()).first;
+		recentDeviceOrder.push_front(record.address);
+		found->second.recency = recentDeviceOrder.begin();
+	}
+	else {
+		recentDeviceOrder.splice(recentDeviceOrder.begin(), recentDeviceOrder, found->second.recency);
+	}
+	RecentDevice& device = found->second;
+	device.timestamp = record.timestamp;
+	device.rssi = record.rssi;
+	device.hasTransmitPower = record.hasTransmitPower;
+	device.transmitPower = record.transmitPower;
+	device.advertisementType = record.advertisementType;
+	device.payload.assign(record.payload, record.payload + record.payloadLength);
+	if (!localName.empty()) {
+		device.localName = localName;
+	}
+	LeaveCriticalSection(&RecentDevicesCriticalSection);
+}
+
+void processAdvertisement(const AdvertisementRecord& record, ParsedAdvertisement& advertisement) {
+	parseAdvertisementData(record.payload, record.payloadLength, advertisement);
+
+	auto bluetoothAddress = record.address;
+	std::wstring localName = utf8ToWide(advertisement.localName, advertisement.localNameLength);
+	recordRecentDevice(record, localName);
+
+	std::vector<unsigned int> clientIds;
+	auto sessionIds = ref new JsonArray();
+	bool rawSections = false;
+	matchScanSessions(bluetoothAddress, localName, advertisement, clientIds, sessionIds, rawSections);
+	if (clientIds.empty()) {
+		ingestUnmatched++;
+		return;
+	}
+	ingestEncoded++;
+
+	JsonObject^ msg = scanResultJson(record, advertisement, localName, rawSections);
+	msg->Insert("scanSessions", sessionIds);
+
+	EnterCriticalSection(&BLELookupCriticalSection);
+	if (bluetoothAddressGattIdMap->HasKey(bluetoothAddress) && !(bluetoothAddressGattIdMap->Lookup(bluetoothAddress)->Equals(""))) {
+		auto gattId = bluetoothAddressGattIdMap->Lookup(bluetoothAddress);
+		LeaveCriticalSection(&BLELookupCriticalSection);
+		msg->Insert("gattId", !(gattId->Equals("")) ? JsonValue::CreateStringValue(gattId) : JsonValue::CreateNullValue());
+		writeObject(msg, clientIds);
+		return;
+	}
+	else {
+		if (bleInProgressLookups.find(bluetoothAddress) == bleInProgressLookups.end()) {
+			// TODO: possible memory leak, consider adding expiration
+			bleInProgressLookups.emplace(bluetoothAddress, concurrency::task_completion_event<String^>());
+			LeaveCriticalSection(&BLELookupCriticalSection);
+			concurrency::create_task([bluetoothAddress]()->concurrency::task<void> {
+				EnterCriticalSection(&BLELookupCriticalSection);
+				auto tce = bleInProgressLookups.at(bluetoothAddress);
+				LeaveCriticalSection(&BLELookupCriticalSection);
+				auto bleDevice = co_await Bluetooth::BluetoothLEDevice::FromBluetoothAddressAsync(bluetoothAddress);
+				if (bleDevice != nullptr) {
+					EnterCriticalSection(&BLELookupCriticalSection);
+					bluetoothAddressGattIdMap->Insert(bluetoothAddress, bleDevice->DeviceId);
+					LeaveCriticalSection(&BLELookupCriticalSection);
+					tce.set(bleDevice->DeviceId);
+				}
+				else {
+					EnterCriticalSection(&BLELookupCriticalSection);
+					bluetoothAddressGattIdMap->Insert(bluetoothAddress, ref new String(L""));
+					LeaveCriticalSection(&BLELookupCriticalSection);
+					tce.set(ref new String(L""));
+				}
+			});
+		}
+		else {
+			LeaveCriticalSection(&BLELookupCriticalSection);
+		}
+
+		auto msgStr = msg->Stringify();
+		concurrency::create_task([bluetoothAddress, msgStr, clientIds]()->concurrency::task<void> {
+			JsonObject^ msg = JsonObject::Parse(msgStr);
+
+			EnterCriticalSection(&BLELookupCriticalSection);
+			auto tce = bleInProgressLookups.at(bluetoothAddress);
+			LeaveCriticalSection(&BLELookupCriticalSection);
+			auto gattIdFromTce = co_await concurrency::task<String^>(tce);
+			
+			String^ gattId;
+			EnterCriticalSection(&BLELookupCriticalSection);
+			if (bluetoothAddressGattIdMap->HasKey(bluetoothAddress)) {
+				gattId = bluetoothAddressGattIdMap->Lookup(bluetoothAddress);
+			}
+			else {
+				gattId = gattIdFromTce;
+				//bluetoothAddressGattIdMap->Insert(bluetoothAddress, gattId);
+			}
+			LeaveCriticalSection(&BLELookupCriticalSection);
+
+			msg->Insert("gattId", !(gattId->Equals("")) ? JsonValue::CreateStringValue(gattId) : JsonValue::CreateNullValue());
+			writeObject(msg, clientIds);
+		});
+	}
+}
+
+void runIngestWorker(IngestWorker& worker) {
+	Microsoft::WRL::Wrappers::RoInitializeWrapper initialize(RO_INIT_MULTITHREADED);
+	ParsedAdvertisement advertisement;
+	// records are large, so keep this one off the stack
+	auto record = std::make_unique<AdvertisementRecord>();
+	while (true) {
+		if (!worker.queue.tryPop(*record)) {
+			worker.idle.store(true);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!worker.queue.tryPop(*record)) {
+				WaitForSingleObject(worker.wakeEvent, INFINITE);
+				worker.idle.store(false);
+				continue;
+			}
+			worker.idle.store(false);
+		}
+
+		if (isDuplicateAdvertisement(worker, *record)) {
+			ingestDeduplicated++;
+			continue;
+		}
+		try {
+			processAdvertisement(*record, advertisement);
+		}
+		catch (Exception^) {
+			// a device that disappears mid-lookup shouldn't stop the worker
+		}
+	}
+}
+
+// Called under ScanCriticalSection before the watcher first starts
+void startIngestWorkers() {
+	if (ingestWorkersStarted.load(std::memory_order_relaxed)) {
+		return;
+	}
+	for (unsigned int i = 0; i < INGEST_WORKER_COUNT; i++) {
+		ingestWorkers[i] = std::make_unique<IngestWorker>();
+	}
+	for (unsigned int i = 0; i < INGEST_WORKER_COUNT; i++) {
+		IngestWorker* worker = ingestWorkers[i].get();
+		std::thread([worker] {
+			runIngestWorker(*worker);
+		}).detach();
+	}
+	ingestWorkersStarted.store(true, std::memory_order_release);
+}
+
+// Runs the cheapest watcher configuration that satisfies every live session: stopped when there are none,
+// and passive unless at least one session wants scan responses
+void updateWatcher() {
+	using namespace Bluetooth::Advertisement;
+
+	EnterCriticalSection(&ScanCriticalSection);
+	try {
+		bool anyActive = std::any_of(scanSessions.begin(), scanSessions.end(), [](const std::pair<const unsigned int, ScanSession>& pair) {
+			return pair.second.active;
+		});
+		auto mode = anyActive ? BluetoothLEScanningMode::Active : BluetoothLEScanningMode::Passive;
+		bool running = bleAdvertisementWatcher != nullptr && bleAdvertisementWatcher->Status == BluetoothLEAdvertisementWatcherStatus::Started;
+
+		if (scanSessions.empty()) {
+			if (running) {
+				bleAdvertisementWatcher->Stop();
+			}
+		}
+		else if (!running || bleAdvertisementWatcher->ScanningMode != mode) {
+			if (running) {
+				bleAdvertisementWatcher->Stop();
+			}
+			startIngestWorkers();
+			// a watcher can't be restarted until it has finished stopping, so always start a fresh one
+			bleAdvertisementWatcher = ref new BluetoothLEAdvertisementWatcher();
+			bleAdvertisementWatcher->ScanningMode = mode;
+			bleAdvertisementWatcher->Received += ref new Windows::Foundation::TypedEventHandler<BluetoothLEAdvertisementWatcher^, BluetoothLEAdvertisementReceivedEventArgs^>(&advertisementReceived);
+			bleAdvertisementWatcher->Start();
+		}
+	}
+	catch (Exception^) {
+		LeaveCriticalSection(&ScanCriticalSection);
+		throw;
+	}
+	LeaveCriticalSection(&ScanCriticalSection);
+}
+
+ScanFilter parseScanFilter(JsonObject^ filter) {
+	ScanFilter result;
+	if (filter->HasKey("address")) {
+		result.hasAddress = true;
+		result.address = parseBluetoothAddress(filter->GetNamedString("address"));
+	}
+	if (filter->HasKey("name")) {
+		result.hasName = true;
+		result.name = filter->GetNamedString("name")->Data();
+	}
+	result.namePrefix = filter->GetNamedString("namePrefix", "")->Data();
+	if (filter->HasKey("services")) {
+		auto services = filter->GetNamedArray("services");
+		for (unsigned int i = 0; i < services->Size; i++) {
+			result.services.push_back(parseUuid(services->GetStringAt(i)));
+		}
+	}
+	if (filter->HasKey("companyIdentifiers")) {
+		auto companyIdentifiers = filter->GetNamedArray("companyIdentifiers");
+		for (unsigned int i = 0; i < companyIdentifiers->Size; i++) {
+			result.companyIdentifiers.push_back((unsigned short)companyIdentifiers->GetNumberAt(i));
+		}
+	}
+	if (filter->HasKey("serviceData")) {
+		auto serviceData = filter->GetNamedArray("serviceData");
+		for (unsigned int i = 0; i < serviceData->Size; i++) {
+			result.serviceData.push_back(parseUuid(serviceData->GetStringAt(i)));
+		}
+	}
+	return result;
+}
+
+// Starts a scan session for the client and returns its id. Scan results carry the ids of the sessions they matched.
+IJsonValue^ scanRequest(JsonObject^ command) {
+	ScanSession session;
+	session.clientId = commandClient(command);
+	session.active = command->GetNamedBoolean("active", true);
+	session.rawSections = command->GetNamedBoolean("rawSections", false);
+	if (command->HasKey("filters")) {
+		auto filters = command->GetNamedArray("filters");
+		for (unsigned int i = 0; i < filters->Size; i++) {
+			session.filters.push_back(parseScanFilter(filters->GetObjectAt(i)));
+		}
+	}
+
+	EnterCriticalSection(&ScanCriticalSection);
+	session.id = nextScanSessionId++;
+	scanSessions[session.id] = session;
+	LeaveCriticalSection(&ScanCriticalSection);
+
+	try {
+		updateWatcher();
+	}
+	catch (Exception^) {
+		EnterCriticalSection(&ScanCriticalSection);
+		scanSessions.erase(session.id);
+		LeaveCriticalSection(&ScanCriticalSection);
+		throw;
+	}
+	return JsonValue::CreateNumberValue(session.id);
+}
+
+void removeClientScanSessions(unsigned int clientId) {
+	EnterCriticalSection(&ScanCriticalSection);
+	for (auto it = scanSessions.begin(); it != scanSessions.end();) {
+		if (it->second.clientId == clientId) {
+			it = scanSessions.erase(it);
+		}
+		else {
+			it++;
+		}
+	}
+	LeaveCriticalSection(&ScanCriticalSection);
+}
+
+// The devices advertised within maxAgeMs that match any of the filters, most recent first. Entries have the format of
+// scan results without scanSessions, with the last advertised name, the gattId when it is already known and their
+// age in ms. No scan is started.
+IJsonValue^ recentDevicesRequest(JsonObject^ command) {
+	std::vector<ScanFilter> filters;
+	if (command->HasKey("filters")) {
+		auto filtersJson = command->GetNamedArray("filters");
+		for (unsigned int i = 0; i < filtersJson->Size; i++) {
+			filters.push_back(parseScanFilter(filtersJson->GetObjectAt(i)));
+		}
+	}
+	bool rawSections = command->GetNamedBoolean("rawSections", false);
+	long long now = currentUniversalTime();
+	unsigned int maxAgeMs = command->HasKey("maxAgeMs") ? unsignedOption(command, "maxAgeMs", MAX_OPTION_MS) : recentDeviceMaxAgeMs.load();
+	long long oldest = now - (long long)maxAgeMs * 10000;
+
+	std::vector<std::pair<unsigned long long, RecentDevice>> snapshot;
+	EnterCriticalSection(&RecentDevicesCriticalSection);
+	for (auto& pair : recentDevices) {
+		if (pair.second.timestamp >= oldest) {
+			snapshot.push_back(pair);
+		}
+	}
+	LeaveCriticalSection(&RecentDevicesCriticalSection);
+	std::sort(snapshot.begin(), snapshot.end(), [](const std::pair<unsigned long long, RecentDevice>& a, const std::pair<unsigned long long, RecentDevice>& b) {
+		return a.second.timestamp > b.second.timestamp;
+	});
+
+	auto result = ref new JsonArray();
+	ParsedAdvertisement advertisement;
+	AdvertisementRecord record;
+	for (auto& pair : snapshot) {
+		const RecentDevice& device = pair.second;
+		record.address = pair.first;
+		record.timestamp = device.timestamp;
+		record.rssi = device.rssi;
+		record.hasTransmitPower = device.hasTransmitPower;
+		record.transmitPower = device.transmitPower;
+		record.advertisementType = device.advertisementType;
+		record.payloadLength = (unsigned short)device.payload.size();
+		memcpy(record.payload, device.payload.data(), device.payload.size());
+		parseAdvertisementData(record.payload, record.payloadLength, advertisement);
+		if (!filters.empty() && !std::any_of(filters.begin(), filters.end(), [&](const ScanFilter& filter) {
+			return matchesScanFilter(filter, record.address, device.localName, advertisement);
+		})) {
+			continue;
+		}
+		JsonObject^ entry = scanResultJson(record, advertisement, device.localName, rawSections);
+		entry->Insert("age", JsonValue::CreateNumberValue((double)(now - record.timestamp) / 10000.0));
+
+		String^ gattId = nullptr;
+		EnterCriticalSection(&BLELookupCriticalSection);
+		if (bluetoothAddressGattIdMap->HasKey(record.address)) {
+			gattId = bluetoothAddressGattIdMap->Lookup(record.address);
+		}
+		LeaveCriticalSection(&BLELookupCriticalSection);
+		entry->Insert("gattId", gattId != nullptr && !gattId->Equals("") ? JsonValue::CreateStringValue(gattId) : JsonValue::CreateNullValue());
+		result->Append(entry);
+	}
+	return result;
+}
+
+// Stops one of the client's sessions, or all of them when no session is given
+IJsonValue^ stopScanRequest(JsonObject^ command) {
+	unsigned int clientId = commandClient(command);
+	auto session = command->GetNamedValue("session", JsonValue::CreateNullValue());
+	if (session->ValueType == JsonValueType::Number) {
+		EnterCriticalSection(&ScanCriticalSection);
+		auto found = scanSessions.find((unsigned int)session->GetNumber());
+		if (found != scanSessions.end() && found->second.clientId == clientId) {
+			scanSessions.erase(found);
+		}
+		LeaveCriticalSection(&ScanCriticalSection);
+	}
+	else {
+		removeClientScanSessions(clientId);
+	}
+	updateWatcher();
+	return JsonValue::CreateNullValue();
+}
+
+// Server-wide runtime options shared by all clients. Only the options present in the command are changed,
+// the current values are returned.
+IJsonValue^ configureRequest(JsonObject^ command) {
+	if (command->HasKey("ingestDropPolicy")) {
+		String^ policy = command->GetNamedString("ingestDropPolicy");
+		if (policy->Equals("dropNewest")) {
+			ingestDropPolicy = IngestDropPolicy::DropNewest;
+		}
+		else if (policy->Equals("dropOldest")) {
+			ingestDropPolicy = IngestDropPolicy::DropOldest;
+		}
+		else {
+			throw ref new InvalidArgumentException("Unknown ingestDropPolicy: " + policy);
+		}
+	}
+	if (command->HasKey("ingestDedupMs")) {
+		ingestDedupMs = unsignedOption(command, "ingestDedupMs", MAX_OPTION_MS);
+	}
+	if (command->HasKey("commandTimeoutMs")) {
+		commandTimeoutMs = unsignedOption(command, "commandTimeoutMs", MAX_OPTION_MS);
+	}
+	if (command->HasKey("lingerMs")) {
+		lingerMs = unsignedOption(command, "lingerMs", MAX_OPTION_MS);
+	}
+	if (command->HasKey("lingerMaxDevices")) {
+		lingerMaxDevices = unsignedOption(command, "lingerMaxDevices", MAX_LINGER_DEVICES);
+	}
+	if (command->HasKey("lingerMaxCharacteristics")) {
+		lingerMaxCharacteristics = unsignedOption(command, "lingerMaxCharacteristics", MAX_LINGER_CHARACTERISTICS);
+	}
+	if (command->HasKey("lingerMaintainConnection")) {
+		lingerMaintainConnection = command->GetNamedBoolean("lingerMaintainConnection");
+	}
+	if (command->HasKey("tracing")) {
+		setTracingEnabled(command->GetNamedBoolean("tracing"));
+	}
+	if (command->HasKey("recentDeviceMaxAgeMs")) {
+		recentDeviceMaxAgeMs = unsignedOption(command, "recentDeviceMaxAgeMs", MAX_OPTION_MS);
+	}
+	if (command->HasKey("clientMaxInFlight") || command->HasKey("clientRatePerSecond") || command->HasKey("clientBurst") || command->HasKey("clientMaxQueued")) {
+		EnterCriticalSection(&SchedulerCriticalSection);
+		FairSchedulerLimits limits = commandScheduler.getLimits();
+		LeaveCriticalSection(&SchedulerCriticalSection);
+		if (command->HasKey("clientMaxInFlight")) {
+			limits.maxInFlight = (unsigned int)numberOption(command, "clientMaxInFlight", 1, MAX_CLIENT_IN_FLIGHT);
+		}
+		if (command->HasKey("clientRatePerSecond")) {
+			limits.ratePerSecond = numberOption(command, "clientRatePerSecond", 0, MAX_CLIENT_RATE_PER_SECOND);
+		}
+		if (command->HasKey("clientBurst")) {
+			limits.burst = numberOption(command, "clientBurst", 1, MAX_CLIENT_RATE_PER_SECOND);
+		}
+		if (command->HasKey("clientMaxQueued")) {
+			limits.maxQueued = (size_t)numberOption(command, "clientMaxQueued", 1, MAX_CLIENT_QUEUED);
+		}
+		EnterCriticalSection(&SchedulerCriticalSection);
+		commandScheduler.setLimits(limits);
+		LeaveCriticalSection(&SchedulerCriticalSection);
+	}
+	if (command->HasKey("originWeights")) {
+		std::unordered_map<std::wstring, double> weights;
+		auto weightsJson = command->GetNamedObject("originWeights");
+		for (auto pair : weightsJson) {
+			double weight = pair->Value->GetNumber();
+			if (!(weight >= MIN_ORIGIN_WEIGHT && weight <= MAX_ORIGIN_WEIGHT)) {
+				throw ref new InvalidArgumentException("Weight of " + pair->Key + " must be between " + MIN_ORIGIN_WEIGHT.ToString() + " and " + MAX_ORIGIN_WEIGHT.ToString());
+			}
+			weights[pair->Key->Data()] = weight;
+		}
+		EnterCriticalSection(&SchedulerCriticalSection);
+		originWeights = weights;
+		LeaveCriticalSection(&SchedulerCriticalSection);
+	}
+	if (command->HasKey("ioThreads")) {
+		ioExecutor->setThreads(executorThreadsOption(command, "ioThreads"));
+	}
+	if (command->HasKey("computeThreads")) {
+		computeExecutor->setThreads(executorThreadsOption(command, "computeThreads"));
+	}
+
+	JsonObject^ result = ref new JsonObject();
+	result->Insert("ingestDropPolicy", JsonValue::CreateStringValue(ingestDropPolicy.load() == IngestDropPolicy::DropNewest ? "dropNewest" : "dropOldest"));
+	result->Insert("ingestDedupMs", JsonValue::CreateNumberValue(ingestDedupMs.load()));
+	result->Insert("commandTimeoutMs", JsonValue::CreateNumberValue(commandTimeoutMs.load()));
+	result->Insert("lingerMs", JsonValue::CreateNumberValue(lingerMs.load()));
+	result->Insert("lingerMaxDevices", JsonValue::CreateNumberValue(lingerMaxDevices.load()));
+	result->Insert("lingerMaxCharacteristics", JsonValue::CreateNumberValue(lingerMaxCharacteristics.load()));
+	result->Insert("lingerMaintainConnection", JsonValue::CreateBooleanValue(lingerMaintainConnection.load()));
+	result->Insert("tracing", JsonValue::CreateBooleanValue(tracingEnabled.load()));
+	result->Insert("recentDeviceMaxAgeMs", JsonValue::CreateNumberValue(recentDeviceMaxAgeMs.load()));
+	result->Insert("ioThreads", JsonValue::CreateNumberValue(ioExecutor->threadCount()));
+	result->Insert("computeThreads", JsonValue::CreateNumberValue(computeExecutor->threadCount()));
+	EnterCriticalSection(&SchedulerCriticalSection);
+	FairSchedulerLimits limits = commandScheduler.getLimits();
+	JsonObject^ weights = ref new JsonObject();
+	for (auto& pair : originWeights) {
+		weights->Insert(ref new String(pair.first.c_str()), JsonValue::CreateNumberValue(pair.second));
+	}
+	LeaveCriticalSection(&SchedulerCriticalSection);
+	result->Insert("clientMaxInFlight", JsonValue::CreateNumberValue(limits.maxInFlight));
+	result->Insert("clientRatePerSecond", JsonValue::CreateNumberValue(limits.ratePerSecond));
+	result->Insert("clientBurst", JsonValue::CreateNumberValue(limits.burst));
+	result->Insert("clientMaxQueued", JsonValue::CreateNumberValue((double)limits.maxQueued));
+	result->Insert("originWeights", weights);
+	return result;
+}
+
+// Cancels another command of the same client, given its _id. The aborted command fails with "Operation aborted".
+IJsonValue^ abortRequest(JsonObject^ command) {
+	if (!command->HasKey("id")) {
+		throw ref new InvalidArgumentException(ref new String(L"Command id must be provided"));
+	}
+	unsigned int clientId = commandClient(command);
+	double id = command->GetNamedNumber("id");
+	if (cancelCommand(requestKey(clientId, id))) {
+		return JsonValue::CreateBooleanValue(true);
+	}
+
+	// a command still waiting for its turn never starts
+	EnterCriticalSection(&SchedulerCriticalSection);
+	auto removed = commandScheduler.removeQueued([clientId, id](const CommandFlow& flow, JsonObject^ queued) {
+		double queuedId;
+		return flow.first == clientId && commandId(queued, queuedId) && queuedId == id;
+	});
+	LeaveCriticalSection(&SchedulerCriticalSection);
+	for (auto queued : removed) {
+		JsonObject^ response = ref new JsonObject();
+		response->Insert("_type", JsonValue::CreateStringValue("response"));
+		response->Insert("_id", queued->GetNamedValue("_id"));
+		response->Insert("error", JsonValue::CreateStringValue("Operation aborted"));
+		writeObject(response, clientId);
+	}
+	return JsonValue::CreateBooleanValue(!removed.empty());
+}
+
+// Writes the retained spans to a Chrome trace-event file in the temp directory and returns its path. Clients can't choose
+// the path, this process may run with more rights than the page that asked.
+IJsonValue^ traceDumpRequest(JsonObject^ command) {
+	TraceRing* ring = traceRing.load();
+	if (ring == nullptr) {
+		throw ref new FailureException(ref new String(L"Tracing was never enabled"));
+	}
+	auto spans = ring->snapshot();
+	std::string json = chromeTraceJson(spans, GetCurrentProcessId());
+
+	wchar_t tempPath[MAX_PATH + 1];
+	DWORD tempPathLength = GetTempPath(MAX_PATH + 1, tempPath);
+	if (tempPathLength == 0 || tempPathLength > MAX_PATH) {
+		throw ref new FailureException(ref new String(L"No temp directory"));
+	}
+	wchar_t fileName[64];
+	swprintf_s(fileName, L"BLEServer-trace-%lu-%lld.json", GetCurrentProcessId(), currentUniversalTime());
+	String^ path = ref new String(tempPath) + ref new String(fileName);
+	HANDLE file = CreateFile(path->Data(), GENERIC_WRITE, 0, nullptr, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		throw ref new FailureException(ref new String(L"Could not create trace file"));
+	}
+	DWORD written = 0;
+	BOOL ok = WriteFile(file, json.data(), (DWORD)json.length(), &written, nullptr);
+	CloseHandle(file);
+	if (!ok || written != json.length()) {
+		throw ref new FailureException(ref new String(L"Could not write trace file"));
+	}
+
+	JsonObject^ result = ref new JsonObject();
+	result->Insert("path", JsonValue::CreateStringValue(path));
+	result->Insert("spans", JsonValue::CreateNumberValue((double)spans.size()));
+	result->Insert("recorded", JsonValue::CreateNumberValue((double)ring->recorded()));
+	result->Insert("capacity", JsonValue::CreateNumberValue((double)ring->size()));
+	return result;
+}
+
+IJsonValue^ statsRequest(JsonObject^ command) {
+	size_t queueDepth = 0;
+	if (ingestWorkersStarted.load(std::memory_order_acquire)) {
+		for (auto& worker : ingestWorkers) {
+			queueDepth += worker->queue.approximateSize();
+		}
+	}
+
+	JsonObject^ ingest = ref new JsonObject();
+	ingest->Insert("received", JsonValue::CreateNumberValue((double)ingestReceived.load()));
+	ingest->Insert("overflows", JsonValue::CreateNumberValue((double)ingestOverflows.load()));
+	ingest->Insert("droppedNewest", JsonValue::CreateNumberValue((double)ingestDroppedNewest.load()));
+	ingest->Insert("droppedOldest", JsonValue::CreateNumberValue((double)ingestDroppedOldest.load()));
+	ingest->Insert("deduplicated", JsonValue::CreateNumberValue((double)ingestDeduplicated.load()));
+	ingest->Insert("unmatched", JsonValue::CreateNumberValue((double)ingestUnmatched.load()));
+	ingest->Insert("encoded", JsonValue::CreateNumberValue((double)ingestEncoded.load()));
+	ingest->Insert("queueDepth", JsonValue::CreateNumberValue((double)queueDepth));
+	ingest->Insert("queueHighWater", JsonValue::CreateNumberValue((double)ingestQueueHighWater.load()));
+	ingest->Insert("queueCapacity", JsonValue::CreateNumberValue((double)INGEST_QUEUE_CAPACITY));
+	ingest->Insert("workers", JsonValue::CreateNumberValue(INGEST_WORKER_COUNT));
+	EnterCriticalSection(&RecentDevicesCriticalSection);
+	ingest->Insert("recentDevices", JsonValue::CreateNumberValue((double)recentDevices.size()));
+	LeaveCriticalSection(&RecentDevicesCriticalSection);
+
+	EnterCriticalSection(&LingerCriticalSection);
+	size_t lingeringCount = lingeringDevices.size();
+	LeaveCriticalSection(&LingerCriticalSection);
+	JsonObject^ linger = ref new JsonObject();
+	linger->Insert("devices", JsonValue::CreateNumberValue((double)lingeringCount));
+	linger->Insert("started", JsonValue::CreateNumberValue((double)lingerStarted.load()));
+	linger->Insert("reclaimed", JsonValue::CreateNumberValue((double)lingerReclaimed.load()));
+	linger->Insert("expired", JsonValue::CreateNumberValue((double)lingerExpired.load()));
+	linger->Insert("evicted", JsonValue::CreateNumberValue((double)lingerEvicted.load()));
+
+	JsonObject^ output = ref new JsonObject();
+	output->Insert("messages", JsonValue::CreateNumberValue((double)outputMessages.load()));
+	output->Insert("fragmentedMessages", JsonValue::CreateNumberValue((double)outputFragmentedMessages.load()));
+	output->Insert("fragments", JsonValue::CreateNumberValue((double)outputFragments.load()));
+	output->Insert("largestMessage", JsonValue::CreateNumberValue((double)outputLargestMessage.load()));
+	output->Insert("disconnectedClients", JsonValue::CreateNumberValue((double)outputDisconnectedClients.load()));
+
+	EnterCriticalSection(&SchedulerCriticalSection);
+	auto usage = commandScheduler.usage();
+	LeaveCriticalSection(&SchedulerCriticalSection);
+	JsonArray^ clientUsage = ref new JsonArray();
+	for (auto& pair : usage) {
+		const FairSchedulerUsage& flowUsage = pair.second;
+		JsonObject^ entry = ref new JsonObject();
+		entry->Insert("client", JsonValue::CreateNumberValue(pair.first.first));
+		entry->Insert("origin", JsonValue::CreateStringValue(ref new String(pair.first.second.c_str())));
+		entry->Insert("weight", JsonValue::CreateNumberValue(flowUsage.weight));
+		entry->Insert("queued", JsonValue::CreateNumberValue((double)flowUsage.queued));
+		entry->Insert("inFlight", JsonValue::CreateNumberValue(flowUsage.inFlight));
+		entry->Insert("peakInFlight", JsonValue::CreateNumberValue(flowUsage.peakInFlight));
+		entry->Insert("submitted", JsonValue::CreateNumberValue((double)flowUsage.submitted));
+		entry->Insert("started", JsonValue::CreateNumberValue((double)flowUsage.started));
+		entry->Insert("completed", JsonValue::CreateNumberValue((double)flowUsage.completed));
+		entry->Insert("rejected", JsonValue::CreateNumberValue((double)flowUsage.rejected));
+		entry->Insert("aborted", JsonValue::CreateNumberValue((double)flowUsage.removed));
+		entry->Insert("throttled", JsonValue::CreateNumberValue((double)flowUsage.throttled));
+		entry->Insert("queueWaitMs", JsonValue::CreateNumberValue((double)flowUsage.totalQueueWaitUs / 1000));
+		entry->Insert("maxQueueWaitMs", JsonValue::CreateNumberValue((double)flowUsage.maxQueueWaitUs / 1000));
+		clientUsage->Append(entry);
+	}
 
-	co_return result;
+	JsonObject^ result = ref new JsonObject();
+	result->Insert("ingest", ingest);
+	result->Insert("linger", linger);
+	result->Insert("output", output);
+	result->Insert("clients", clientUsage);
+	JsonObject^ executors = ref new JsonObject();
+	executors->Insert("io", ioExecutor->stats());
+	executors->Insert("compute", computeExecutor->stats());
+	result->Insert("executors", executors);
+	result->Insert("startup", startupTimings());
+	return result;
 }
 
 concurrency::task<void> processCommand(JsonObject^ command) {
@@ -651,20 +3923,50 @@ concurrency::task<void> processCommand(JsonObject^ command) {
 	IJsonValue^ result = nullptr;
 	response->Insert("_type", JsonValue::CreateStringValue("response"));
 	response->Insert("_id", command->GetNamedValue("_id", JsonValue::CreateNullValue()));
+	std::shared_ptr<PendingCommand> pending;
+	TraceScope dispatchSpan(cmd, command);
 
 	try {
+		pending = beginCommand(command);
+
+		if (isCommandIn(cmd, DEVICE_COMMANDS)) {
+			requireDeviceClient(command);
+		}
+
 		if (cmd->Equals("ping")) {
 			result = JsonValue::CreateStringValue("pong");
 		}
 
 		if (cmd->Equals("scan")) {
-			bleAdvertisementWatcher->Start();
-			result = JsonValue::CreateNullValue();
+			result = scanRequest(command);
 		}
 
 		if (cmd->Equals("stopScan")) {
-			bleAdvertisementWatcher->Stop();
-			result = JsonValue::CreateNullValue();
+			result = stopScanRequest(command);
+		}
+
+		if (cmd->Equals("recentDevices")) {
+			result = recentDevicesRequest(command);
+		}
+
+		if (cmd->Equals("abort")) {
+			result = abortRequest(command);
+		}
+
+		if (cmd->Equals("configure")) {
+			result = configureRequest(command);
+		}
+
+		if (cmd->Equals("stats")) {
+			result = statsRequest(command);
+		}
+
+		if (cmd->Equals("traceDump")) {
+			result = traceDumpRequest(command);
+		}
+
+		if (cmd->Equals("subscriptionStats")) {
+			result = subscriptionStatsRequest(command);
 		}
 
 		if (cmd->Equals("connect")) {
@@ -699,6 +4001,22 @@ concurrency::task<void> processCommand(JsonObject^ command) {
 			result = co_await writeRequest(command, 2);
 		}
 
+		if (cmd->Equals("beginReliableWrite")) {
+			result = beginReliableWriteRequest(command);
+		}
+
+		if (cmd->Equals("reliableWrite")) {
+			result = co_await reliableWriteRequest(command);
+		}
+
+		if (cmd->Equals("commitReliableWrite")) {
+			result = co_await commitReliableWriteRequest(command);
+		}
+
+		if (cmd->Equals("abortReliableWrite")) {
+			result = abortReliableWriteRequest(command);
+		}
+
 		if (cmd->Equals("subscribe")) {
 			result = co_await subscribeRequest(command);
 		}
@@ -749,283 +4067,607 @@ concurrency::task<void> processCommand(JsonObject^ command) {
 		else {
 			response->Insert("error", JsonValue::CreateStringValue("Unknown command"));
 		}
-		writeObject(response);
+	}
+	catch (const concurrency::task_canceled&) {
+		response->Insert("error", JsonValue::CreateStringValue(pending != nullptr && pending->timedOut ? "Operation timed out" : "Operation aborted"));
 	}
 	catch (Exception^ e) {
-		response->Insert("error", JsonValue::CreateStringValue(e->ToString()));
-		writeObject(response);
+		// a cancelled WinRT operation can also surface as an HRESULT
+		if (pending != nullptr && pending->source.get_token().is_canceled()) {
+			response->Insert("error", JsonValue::CreateStringValue(pending->timedOut ? "Operation timed out" : "Operation aborted"));
+		}
+		else {
+			response->Insert("error", JsonValue::CreateStringValue(e->ToString()));
+		}
 	}
 	catch (...) {
 		response->Insert("error", JsonValue::CreateStringValue("Unknown error"));
-		writeObject(response);
 	}
+	endCommand(command, pending);
+	dispatchSpan.end();
+
+	unsigned int clientId = commandClient(command);
+	co_await onComputeExecutor([response, clientId] {
+		writeObject(response, clientId);
+	});
 }
 
-int main(Array<String^>^ args) {
-	CreateMutex(NULL, FALSE, L"BLEServer");
+void dispatchScheduledCommands();
 
-	Microsoft::WRL::Wrappers::RoInitializeWrapper initialize(RO_INIT_MULTITHREADED);
+void runScheduledCommand(const CommandFlow& flow, JsonObject^ command) {
+	processCommand(command).then([flow](concurrency::task<void> processed) {
+		try {
+			processed.get();
+		}
+		catch (...) {
+			// processCommand reports its own failures
+		}
+		EnterCriticalSection(&SchedulerCriticalSection);
+		commandScheduler.complete(flow);
+		LeaveCriticalSection(&SchedulerCriticalSection);
+		dispatchScheduledCommands();
+	});
+}
 
-	CoInitializeSecurity(
-		nullptr, // TODO: "O:BAG:BAD:(A;;0x7;;;PS)(A;;0x3;;;SY)(A;;0x7;;;BA)(A;;0x3;;;AC)(A;;0x3;;;LS)(A;;0x3;;;NS)"
-		-1,
-		nullptr,
-		nullptr,
-		RPC_C_AUTHN_LEVEL_DEFAULT,
-		RPC_C_IMP_LEVEL_IDENTIFY,
-		NULL,
-		EOAC_NONE,
-		nullptr);
+// Starts every queued command that may start now, and arms a timer for the earliest rate capped flow if there is one
+void dispatchScheduledCommands() {
+	std::vector<std::pair<CommandFlow, JsonObject^>> runnable;
+	unsigned int timerMs = 0;
+	EnterCriticalSection(&SchedulerCriticalSection);
+	uint64_t now = monotonicUs();
+	CommandFlow flow;
+	JsonObject^ command;
+	while (commandScheduler.next(now, flow, command)) {
+		runnable.push_back(std::make_pair(flow, command));
+	}
+	uint64_t readyUs = 0;
+	if (commandScheduler.nextReadyUs(now, readyUs) && (schedulerTimerDueUs == 0 || readyUs < schedulerTimerDueUs)) {
+		schedulerTimerDueUs = readyUs;
+		timerMs = readyUs > now ? (unsigned int)((readyUs - now + 999) / 1000) : 1;
+	}
+	LeaveCriticalSection(&SchedulerCriticalSection);
 
-	if (!InitializeCriticalSectionAndSpinCount(&OutputCriticalSection, 0x00000400)) {
-		return -1;
+	for (auto& next : runnable) {
+		runScheduledCommand(next.first, next.second);
+	}
+	if (timerMs > 0) {
+		delay(timerMs, concurrency::cancellation_token::none()).then([readyUs]() {
+			EnterCriticalSection(&SchedulerCriticalSection);
+			if (schedulerTimerDueUs == readyUs) {
+				schedulerTimerDueUs = 0;
+			}
+			LeaveCriticalSection(&SchedulerCriticalSection);
+			dispatchScheduledCommands();
+		});
 	}
+}
 
-	if (!InitializeCriticalSectionAndSpinCount(&BLELookupCriticalSection, 0x00000400)) {
-		return -1;
+// Entry point of every command a client sends
+void submitCommand(JsonObject^ command) {
+	String^ cmd = command->GetNamedString("cmd", "");
+	if (!isCommandIn(cmd, SCHEDULED_COMMANDS)) {
+		auto processed = processCommand(command);
+		if (cmd->Equals("configure")) {
+			// new limits may let queued commands start
+			processed.then([]() {
+				dispatchScheduledCommands();
+			});
+		}
+		return;
 	}
 
-	bleAdvertisementWatcher = ref new Bluetooth::Advertisement::BluetoothLEAdvertisementWatcher();
-	bleAdvertisementWatcher->ScanningMode = Bluetooth::Advertisement::BluetoothLEScanningMode::Active;
-	bleAdvertisementWatcher->Received += ref new Windows::Foundation::TypedEventHandler<Bluetooth::Advertisement::BluetoothLEAdvertisementWatcher^, Windows::Devices::Bluetooth::Advertisement::BluetoothLEAdvertisementReceivedEventArgs^>(
-		[](Bluetooth::Advertisement::BluetoothLEAdvertisementWatcher^ watcher, Bluetooth::Advertisement::BluetoothLEAdvertisementReceivedEventArgs^ eventArgs) {
-			unsigned int index = -1;
+	CommandFlow flow = commandFlow(command);
+	EnterCriticalSection(&SchedulerCriticalSection);
+	bool queued = commandScheduler.enqueue(flow, command, monotonicUs(), originWeight(flow.second));
+	LeaveCriticalSection(&SchedulerCriticalSection);
+	if (!queued) {
+		JsonObject^ response = ref new JsonObject();
+		response->Insert("_type", JsonValue::CreateStringValue("response"));
+		response->Insert("_id", command->GetNamedValue("_id", JsonValue::CreateNullValue()));
+		response->Insert("error", JsonValue::CreateStringValue("Too many commands queued"));
+		writeObject(response, flow.first);
+		return;
+	}
+	dispatchScheduledCommands();
+}
 
-			JsonObject^ msg = ref new JsonObject();
-			msg->Insert("_type", JsonValue::CreateStringValue("scanResult"));
-			msg->Insert("bluetoothAddress", JsonValue::CreateStringValue(ref new String(formatBluetoothAddress(eventArgs->BluetoothAddress).c_str())));
-			msg->Insert("rssi", JsonValue::CreateNumberValue(eventArgs->RawSignalStrengthInDBm));
-			// TODO fix timestamp calculation
-			msg->Insert("timestamp", JsonValue::CreateNumberValue((double)eventArgs->Timestamp.UniversalTime / 10000.0 + 11644480800000));
-			msg->Insert("advType", JsonValue::CreateStringValue(eventArgs->AdvertisementType.ToString()));
-			msg->Insert("localName", JsonValue::CreateStringValue(eventArgs->Advertisement->LocalName));
-			
-			// appearance
-			auto appearanceData = eventArgs->Advertisement->GetSectionsByType(0x19);
-			if (appearanceData->Size > 0) {
-				auto appearanceSection = appearanceData->GetAt(0);
-				auto reader = Windows::Storage::Streams::DataReader::FromBuffer(appearanceSection->Data);
-				unsigned short appearanceValue = reader->ReadUInt16();
-				msg->Insert("appearance", JsonValue::CreateNumberValue(appearanceValue));
-			}
-			else {
-				msg->Insert("appearance", JsonValue::CreateNullValue());
-			}
+std::shared_ptr<Client> addClient(HANDLE input, HANDLE output, bool ownsHandles) {
+	EnterCriticalSection(&ClientsCriticalSection);
+	auto client = std::make_shared<Client>(nextClientId++, input, output, ownsHandles);
+	clients[client->id] = client;
+	LeaveCriticalSection(&ClientsCriticalSection);
+	std::thread([client] { writeOutbound(client); }).detach();
+	return client;
+}
 
-			// txPower requires Windows 10 version 2004
-			if (Windows::Foundation::Metadata::ApiInformation::IsPropertyPresent(
-				"Windows.Devices.Bluetooth.Advertisement.BluetoothLEAdvertisementReceivedEventArgs",
-				"TransmitPowerLevelInDBm")) {
-				if (eventArgs->TransmitPowerLevelInDBm != nullptr) {
-					msg->Insert("txPower", JsonValue::CreateNumberValue(eventArgs->TransmitPowerLevelInDBm->Value));
-				}
-				else {
-					msg->Insert("txPower", JsonValue::CreateNullValue());
-				}
-			}
-			else {
-				msg->Insert("txPower", JsonValue::CreateNullValue());
-			}
+void removeSubscription(String^ key) {
+	Bluetooth::GenericAttributeProfile::GattCharacteristic^ characteristic = nullptr;
+	Windows::Foundation::EventRegistrationToken cookie;
+	bool listening = false;
+	EnterCriticalSection(&DeviceMapsCriticalSection);
+	if (characteristicsListenerMap->HasKey(key)) {
+		listening = true;
+		cookie = characteristicsListenerMap->Lookup(key);
+		if (characteristicsMap->HasKey(key)) {
+			characteristic = characteristicsMap->Lookup(key);
+		}
+		characteristicsListenerMap->Remove(key);
+	}
+	if (characteristicsSubscriptionMap->HasKey(key)) {
+		characteristicsSubscriptionMap->Remove(key);
+	}
+	LeaveCriticalSection(&DeviceMapsCriticalSection);
+	if (listening && characteristic != nullptr) {
+		characteristic->ValueChanged -= cookie;
+	}
+	removeNotificationStats(key);
+}
 
-			JsonArray^ serviceUuids = ref new JsonArray();
-			for (unsigned int i = 0; i < eventArgs->Advertisement->ServiceUuids->Size; i++) {
-				serviceUuids->Append(JsonValue::CreateStringValue(eventArgs->Advertisement->ServiceUuids->GetAt(i).ToString()));
-			}
-			msg->Insert("serviceUuids", serviceUuids);
+// Releases everything the client was using: its commands in flight, its scan sessions, its subscriptions, its device connections and pending pairing prompts
+void closeClient(unsigned int clientId) {
+	std::vector<std::wstring> unusedSubscriptions;
+	std::vector<std::wstring> unusedDevices;
+
+	EnterCriticalSection(&ClientsCriticalSection);
+	auto found = clients.find(clientId);
+	if (found != clients.end()) {
+		closeOutbound(*found->second, false);
+		clients.erase(found);
+	}
+	if (clients.empty()) {
+		lastClientDisconnect = GetTickCount64();
+	}
+	for (auto it = characteristicSubscribers.begin(); it != characteristicSubscribers.end();) {
+		if (it->second.removeClient(clientId) && it->second.counts.empty()) {
+			unusedSubscriptions.push_back(it->first);
+			it = characteristicSubscribers.erase(it);
+		}
+		else {
+			it++;
+		}
+	}
+	for (auto it = deviceClients.begin(); it != deviceClients.end();) {
+		if (it->second.erase(clientId) > 0 && it->second.empty()) {
+			unusedDevices.push_back(it->first);
+			it = deviceClients.erase(it);
+		}
+		else {
+			it++;
+		}
+	}
+	LeaveCriticalSection(&ClientsCriticalSection);
+
+	// queued commands are dropped unanswered, there is no one left to answer
+	EnterCriticalSection(&SchedulerCriticalSection);
+	commandScheduler.removeFlows([clientId](const CommandFlow& flow) {
+		return flow.first == clientId;
+	});
+	LeaveCriticalSection(&SchedulerCriticalSection);
+	cancelClientCommands(clientId);
+	removeClientReliableWrites(clientId);
+	removeClientScanSessions(clientId);
+	try {
+		updateWatcher();
+	}
+	catch (Exception^) {
+		// nothing left to report the failure to
+	}
+	for (auto& key : unusedSubscriptions) {
+		removeSubscription(ref new String(key.c_str()));
+	}
+	for (auto& deviceId : unusedDevices) {
+		lingerDevice(ref new String(deviceId.c_str()));
+	}
 
-			auto manufacturerData = eventArgs->Advertisement->ManufacturerData;
+	std::wstring keyPrefix = clientId.ToString()->Data();
+	keyPrefix += L"/";
+	std::vector<String^> waitingPairings;
+	EnterCriticalSection(&DeviceMapsCriticalSection);
+	for (auto pair : pairingRequestWaiting) {
+		if (wcsncmp(pair->Key->Data(), keyPrefix.c_str(), keyPrefix.length()) == 0 && pair->Value->Equals("waiting")) {
+			waitingPairings.push_back(pair->Key);
+		}
+	}
+	LeaveCriticalSection(&DeviceMapsCriticalSection);
+	for (auto key : waitingPairings) {
+		answerPairing(key, "cancel");
+	}
+}
 
-			auto manufacturerDataJson = ref new JsonArray();
+// Every command processCommand understands, so that clients don't have to probe for them. Keep in sync with processCommand.
+const wchar_t* const SUPPORTED_COMMANDS[] = {
+	L"ping", L"scan", L"stopScan", L"abort", L"configure", L"stats", L"subscriptionStats", L"connect", L"disconnect",
+	L"services", L"characteristics", L"read", L"write", L"writeWithResponse", L"writeWithoutResponse", L"subscribe",
+	L"unsubscribe", L"accept", L"acceptPasswordCredential", L"acceptPin", L"cancel", L"availability", L"getDescriptor",
+	L"getDescriptors", L"readDescriptorValue", L"writeDescriptorValue", L"traceDump", L"beginReliableWrite",
+	L"reliableWrite", L"commitReliableWrite", L"abortReliableWrite", L"recentDevices",
+};
+
+// Optional behavior beyond the command set
+const wchar_t* const SERVER_FEATURES[] = {
+	L"scanSessions", // scan returns a session, filters and rawSections
+	L"commandTimeouts", // timeout on any command
+	L"subscribers", // subscriber on subscribe and unsubscribe
+	L"notificationSequence", // seq and timestamp on notifications
+	L"serviceChangedEvents",
+	L"connectionLinger",
+	L"tracing", // tracing option of configure, traceDump
+	L"reliableWrites",
+	L"fragments", // messages larger than maxMessageSize arrive as fragment messages
+	L"recentDevices", // recentDeviceMaxAgeMs option of configure
+	L"fairScheduling", // _origin on commands, client* and originWeights options of configure, clients in stats
+};
+
+JsonArray^ stringArray(const wchar_t* const* strings, size_t count) {
+	auto result = ref new JsonArray();
+	for (size_t i = 0; i < count; i++) {
+		result->Append(JsonValue::CreateStringValue(ref new String(strings[i])));
+	}
+	return result;
+}
 
-			for (unsigned int i = 0; i < manufacturerData->Size; i++) {
-				auto desiredItem = manufacturerData->GetAt(i);
-				auto manufacturerItem = ref new JsonObject();
+JsonObject^ serverCapabilities() {
+	JsonObject^ limits = ref new JsonObject();
+	limits->Insert("maxMessageSize", JsonValue::CreateNumberValue(MAX_OUTGOING_MESSAGE_SIZE));
+	limits->Insert("fragmentDataSize", JsonValue::CreateNumberValue(FRAGMENT_DATA_SIZE));
+	limits->Insert("maxAdvertisementPayload", JsonValue::CreateNumberValue((double)MAX_ADVERTISEMENT_PAYLOAD));
+	limits->Insert("ingestQueueCapacity", JsonValue::CreateNumberValue((double)INGEST_QUEUE_CAPACITY));
+	limits->Insert("commandTimeoutMs", JsonValue::CreateNumberValue(commandTimeoutMs.load()));
+
+	JsonObject^ result = ref new JsonObject();
+	result->Insert("commands", stringArray(SUPPORTED_COMMANDS, sizeof(SUPPORTED_COMMANDS) / sizeof(SUPPORTED_COMMANDS[0])));
+	result->Insert("features", stringArray(SERVER_FEATURES, sizeof(SERVER_FEATURES) / sizeof(SERVER_FEATURES[0])));
+	// characteristic and descriptor values are JSON arrays of byte values
+	JsonArray^ encodings = ref new JsonArray();
+	encodings->Append(JsonValue::CreateStringValue("json"));
+	result->Insert("encodings", encodings);
+	result->Insert("limits", limits);
+	return result;
+}
 
-				manufacturerItem->Insert("companyIdentifier", JsonValue::CreateNumberValue(desiredItem->CompanyId));
+void writeStartMessage(unsigned int clientId) {
+	long long expected = 0;
+	firstStartWritten.compare_exchange_strong(expected, currentUniversalTime());
 
-				auto reader = Windows::Storage::Streams::DataReader::FromBuffer(desiredItem->Data);
-				auto valueArray = ref new JsonArray();
-				for (unsigned int i = 0; i < desiredItem->Data->Length; i++) {
-					valueArray->Append(JsonValue::CreateNumberValue(reader->ReadByte()));
-				}
-				manufacturerItem->Insert("data", valueArray);
+	JsonObject^ msg = ref new JsonObject();
+	msg->Insert("_type", JsonValue::CreateStringValue("Start"));
+	// API version is required and will be incremented when breaking changes are made to the API
+	msg->Insert("apiVersion", JsonValue::CreateNumberValue(API_VERSION));
+	// the following two values are not currently validated but may be used in the future to determine whether to offer users an update to BLEServer
+	// third-party server implementations should change these values for their servers
+	msg->Insert("serverName", JsonValue::CreateStringValue("bleserver-win-cppcx"));
+	msg->Insert("serverVersion", JsonValue::CreateStringValue("0.5.3"));
+	msg->Insert("capabilities", serverCapabilities());
+	// time to Start is what every native messaging launch waits for
+	msg->Insert("startup", startupTimings());
+	writeObject(msg, clientId);
+}
 
-				manufacturerDataJson->Append(manufacturerItem);
-			}
+// Reads native messaging frames from the client until it disconnects
+void serveClient(std::shared_ptr<Client> client) {
+	writeStartMessage(client->id);
 
-			msg->Insert("manufacturerData", manufacturerDataJson);
+	std::wstring_convert<std::codecvt_utf8<wchar_t>> convert;
+	HANDLE readEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	std::vector<char> msgBuf;
+	while (true) {
+		unsigned int len = 0;
+		if (!transferFully(client->input, readEvent, reinterpret_cast<char*>(&len), 4, false)) {
+			break;
+		}
+		if (len == 0) {
+			continue;
+		}
+		// waiting for the length is idle time, the span starts with the body
+		TraceScope readSpan("frame.read");
+		msgBuf.resize(len);
+		if (!transferFully(client->input, readEvent, msgBuf.data(), len, false)) {
+			break;
+		}
+		readSpan.end();
 
+		try {
+			TraceScope parseSpan("parse");
+			String^ jsonStr = ref new String(convert.from_bytes(msgBuf.data(), msgBuf.data() + len).c_str());
+			JsonObject^ json = JsonObject::Parse(jsonStr);
+			json->Insert("_client", JsonValue::CreateNumberValue(client->id));
+			parseSpan.attach(json);
+			parseSpan.end();
+			submitCommand(json);
+		}
+		catch (std::exception& e) {
+			JsonObject^ msg = ref new JsonObject();
+			msg->Insert("_type", JsonValue::CreateStringValue("error"));
+			std::string eReason = std::string(e.what());
+			std::wstring wReason = std::wstring(eReason.begin(), eReason.end());
+			msg->Insert("error", JsonValue::CreateStringValue(ref new String(wReason.c_str())));
+			writeObject(msg, client->id);
+		}
+		catch (Exception^ e) {
+			JsonObject^ msg = ref new JsonObject();
+			msg->Insert("_type", JsonValue::CreateStringValue("error"));
+			msg->Insert("error", JsonValue::CreateStringValue(e->ToString()));
+			writeObject(msg, client->id);
+		}
+	}
+	CloseHandle(readEvent);
 
-			auto serviceDataJson = ref new JsonArray();
+	closeClient(client->id);
+}
 
-			auto SERVICE_DATA_TYPES = {
-				0x16, // Service Data - 16-bit UUID
-				0x20, // Service Data - 32-bit UUID
-				0x21, // Service Data - 128-bit UUID
-			};
+const DWORD PIPE_BUFFER_SIZE = 64 * 1024;
+// How long the daemon keeps running (and scanning state / connections warm) after the last client leaves
+const ULONGLONG DAEMON_IDLE_TIMEOUT_MS = 30 * 1000;
+const int DAEMON_CONNECT_ATTEMPTS = 100;
+const DWORD DAEMON_CONNECT_RETRY_MS = 50;
+
+std::wstring currentUserSid() {
+	std::wstring result;
+	HANDLE token;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token)) {
+		return result;
+	}
+	DWORD size = 0;
+	GetTokenInformation(token, TokenUser, nullptr, 0, &size);
+	std::vector<char> buffer(size);
+	LPWSTR sidString = nullptr;
+	if (size > 0 && GetTokenInformation(token, TokenUser, buffer.data(), size, &size)
+		&& ConvertSidToStringSidW(reinterpret_cast<TOKEN_USER*>(buffer.data())->User.Sid, &sidString)) {
+		result = sidString;
+		LocalFree(sidString);
+	}
+	CloseHandle(token);
+	return result;
+}
 
-			for (auto type : SERVICE_DATA_TYPES) {
-				auto serviceData = eventArgs->Advertisement->GetSectionsByType(type);
-				for (auto serviceDataSection : serviceData) {
-					auto reader = Windows::Storage::Streams::DataReader::FromBuffer(serviceDataSection->Data);
+// One daemon per user, shared by all Firefox profiles and windows of that user
+std::wstring daemonPipeName(const std::wstring& userSid) {
+	return L"\\\\.\\pipe\\BLEServer-" + userSid;
+}
 
-					auto serviceDataInner = ref new JsonObject();
+int runDaemon() {
+	std::wstring userSid = currentUserSid();
+	if (userSid.empty()) {
+		return -1;
+	}
+	std::wstring pipeName = daemonPipeName(userSid);
 
-					switch (type)
-					{
-						case 0x16:
-						{
-							unsigned short uuid16 = reader->ReadUInt16();
-							auto valueArray = ref new JsonArray();
-							while (reader->UnconsumedBufferLength > 0) {
-								valueArray->Append(JsonValue::CreateNumberValue(reader->ReadByte()));
-							}
-							serviceDataInner->Insert("service", JsonValue::CreateNumberValue(uuid16));
-							serviceDataInner->Insert("data", valueArray);
-							break;
-						}
-						case 0x20:
-						{
-							unsigned int uuid32 = reader->ReadUInt32();
-							auto valueArray = ref new JsonArray();
-							while (reader->UnconsumedBufferLength > 0) {
-								valueArray->Append(JsonValue::CreateNumberValue(reader->ReadByte()));
-							}
-							serviceDataInner->Insert("service", JsonValue::CreateNumberValue(uuid32));
-							serviceDataInner->Insert("data", valueArray);
-							break;
-						}
-						case 0x21:
-						{
-							auto uuid128 = reader->ReadGuid();
-							auto valueArray = ref new JsonArray();
-							while (reader->UnconsumedBufferLength > 0) {
-								valueArray->Append(JsonValue::CreateNumberValue(reader->ReadByte()));
-							}
-							serviceDataInner->Insert("service", JsonValue::CreateStringValue(uuid128.ToString()));
-							serviceDataInner->Insert("data", valueArray);
-							break;
-						}
-						default:
-						{
-							break;
-						}
-					}
+	// Only the current user and SYSTEM may connect
+	std::wstring sddl = L"D:P(A;;GA;;;SY)(A;;GA;;;" + userSid + L")";
+	SECURITY_ATTRIBUTES securityAttributes = { sizeof(securityAttributes) };
+	if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(sddl.c_str(), SDDL_REVISION_1, &securityAttributes.lpSecurityDescriptor, nullptr)) {
+		return -1;
+	}
 
-					serviceDataJson->Append(serviceDataInner);
+	lastClientDisconnect = GetTickCount64();
+	HANDLE connectedEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	bool firstInstance = true;
+	while (true) {
+		HANDLE pipe = CreateNamedPipeW(pipeName.c_str(),
+			PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | (firstInstance ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+			PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+			PIPE_UNLIMITED_INSTANCES, PIPE_BUFFER_SIZE, PIPE_BUFFER_SIZE, 0, &securityAttributes);
+		if (pipe == INVALID_HANDLE_VALUE) {
+			// another daemon already owns the pipe
+			return firstInstance ? 0 : -1;
+		}
+		firstInstance = false;
+
+		OVERLAPPED overlapped = {};
+		overlapped.hEvent = connectedEvent;
+		ResetEvent(connectedEvent);
+		bool connected = ConnectNamedPipe(pipe, &overlapped) != 0;
+		DWORD error = GetLastError();
+		if (!connected && error == ERROR_PIPE_CONNECTED) {
+			connected = true;
+		}
+		else if (!connected && error == ERROR_IO_PENDING) {
+			while (WaitForSingleObject(connectedEvent, 1000) == WAIT_TIMEOUT) {
+				EnterCriticalSection(&ClientsCriticalSection);
+				bool idle = clients.empty() && GetTickCount64() - lastClientDisconnect > DAEMON_IDLE_TIMEOUT_MS;
+				LeaveCriticalSection(&ClientsCriticalSection);
+				if (idle && WaitForSingleObject(connectedEvent, 0) == WAIT_TIMEOUT) {
+					CancelIo(pipe);
+					CloseHandle(pipe);
+					return 0;
 				}
 			}
+			DWORD unused;
+			connected = GetOverlappedResult(pipe, &overlapped, &unused, FALSE) != 0;
+		}
+		if (!connected) {
+			CloseHandle(pipe);
+			continue;
+		}
 
-			msg->Insert("serviceData", serviceDataJson);
-
-			// TODO flags / data sections ?
+		auto client = addClient(pipe, pipe, true);
+		std::thread([client] { serveClient(client); }).detach();
+	}
+}
 
-			auto bluetoothAddress = eventArgs->BluetoothAddress;
+// Firefox kills the native messaging host's job object when the extension disconnects,
+// so the daemon has to break away from it to outlive the shim that started it
+bool spawnDaemon() {
+	wchar_t path[MAX_PATH];
+	DWORD pathLength = GetModuleFileNameW(nullptr, path, MAX_PATH);
+	if (pathLength == 0 || pathLength == MAX_PATH) {
+		return false;
+	}
+	std::wstring commandLine = L"\"" + std::wstring(path) + L"\" --daemon";
+	STARTUPINFOW startupInfo = { sizeof(startupInfo) };
+	PROCESS_INFORMATION processInfo;
+	if (!CreateProcessW(path, &commandLine[0], nullptr, nullptr, FALSE,
+		DETACHED_PROCESS | CREATE_NEW_PROCESS_GROUP | CREATE_BREAKAWAY_FROM_JOB, nullptr, nullptr, &startupInfo, &processInfo)) {
+		return false;
+	}
+	CloseHandle(processInfo.hThread);
+	CloseHandle(processInfo.hProcess);
+	return true;
+}
 
-			EnterCriticalSection(&BLELookupCriticalSection);
-			if (bluetoothAddressGattIdMap->HasKey(bluetoothAddress) && !(bluetoothAddressGattIdMap->Lookup(bluetoothAddress)->Equals(""))) {
-				auto gattId = bluetoothAddressGattIdMap->Lookup(bluetoothAddress);
-				LeaveCriticalSection(&BLELookupCriticalSection);
-				msg->Insert("gattId", !(gattId->Equals("")) ? JsonValue::CreateStringValue(gattId) : JsonValue::CreateNullValue());
-				writeObject(msg);
-				return;
+// Connects to the running daemon, starting one if needed. Returns INVALID_HANDLE_VALUE if no daemon can be reached.
+HANDLE connectToDaemon() {
+	std::wstring userSid = currentUserSid();
+	if (userSid.empty()) {
+		return INVALID_HANDLE_VALUE;
+	}
+	std::wstring pipeName = daemonPipeName(userSid);
+
+	bool spawned = false;
+	for (int attempt = 0; attempt < DAEMON_CONNECT_ATTEMPTS; attempt++) {
+		HANDLE pipe = CreateFileW(pipeName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING,
+			FILE_FLAG_OVERLAPPED | SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION, nullptr);
+		if (pipe != INVALID_HANDLE_VALUE) {
+			return pipe;
+		}
+		DWORD error = GetLastError();
+		if (error == ERROR_PIPE_BUSY) {
+			WaitNamedPipeW(pipeName.c_str(), DAEMON_CONNECT_RETRY_MS);
+			continue;
+		}
+		if (error != ERROR_FILE_NOT_FOUND) {
+			break;
+		}
+		if (!spawned) {
+			if (!spawnDaemon()) {
+				break;
 			}
-			else {
-				if (bleInProgressLookups.find(bluetoothAddress) == bleInProgressLookups.end()) {
-					// TODO: possible memory leak, consider adding expiration
-					bleInProgressLookups.emplace(bluetoothAddress, concurrency::task_completion_event<String^>());
-					LeaveCriticalSection(&BLELookupCriticalSection);
-					concurrency::create_task([bluetoothAddress]()->concurrency::task<void> {
-						EnterCriticalSection(&BLELookupCriticalSection);
-						auto tce = bleInProgressLookups.at(bluetoothAddress);
-						LeaveCriticalSection(&BLELookupCriticalSection);
-						auto bleDevice = co_await Bluetooth::BluetoothLEDevice::FromBluetoothAddressAsync(bluetoothAddress);
-						if (bleDevice != nullptr) {
-							EnterCriticalSection(&BLELookupCriticalSection);
-							bluetoothAddressGattIdMap->Insert(bluetoothAddress, bleDevice->DeviceId);
-							LeaveCriticalSection(&BLELookupCriticalSection);
-							tce.set(bleDevice->DeviceId);
-						}
-						else {
-							EnterCriticalSection(&BLELookupCriticalSection);
-							bluetoothAddressGattIdMap->Insert(bluetoothAddress, ref new String(L""));
-							LeaveCriticalSection(&BLELookupCriticalSection);
-							tce.set(ref new String(L""));
-						}
-					});
-				}
-				else {
-					LeaveCriticalSection(&BLELookupCriticalSection);
-				}
+			spawned = true;
+		}
+		Sleep(DAEMON_CONNECT_RETRY_MS);
+	}
+	return INVALID_HANDLE_VALUE;
+}
+
+// Copies bytes from one handle to the other until either side closes
+void relay(HANDLE from, HANDLE to) {
+	std::vector<char> buffer(PIPE_BUFFER_SIZE);
+	HANDLE readEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	HANDLE writeEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	DWORD received;
+	while (transferOnce(from, readEvent, buffer.data(), (DWORD)buffer.size(), false, received)
+		&& transferFully(to, writeEvent, buffer.data(), received, true)) {
+	}
+	CloseHandle(readEvent);
+	CloseHandle(writeEvent);
+}
 
-				auto msgStr = msg->Stringify();
-				concurrency::create_task([bluetoothAddress, msgStr]()->concurrency::task<void> {
-					JsonObject^ msg = JsonObject::Parse(msgStr);
+// The shim only forwards native messaging frames between Firefox and the daemon
+int runShim(HANDLE pipe) {
+	HANDLE input = GetStdHandle(STD_INPUT_HANDLE);
+	HANDLE output = GetStdHandle(STD_OUTPUT_HANDLE);
+	// Whichever side closes first ends the process, which also disconnects us from the daemon
+	std::thread([input, pipe] {
+		relay(input, pipe);
+		ExitProcess(0);
+	}).detach();
+	relay(pipe, output);
+	return 0;
+}
 
-					EnterCriticalSection(&BLELookupCriticalSection);
-					auto tce = bleInProgressLookups.at(bluetoothAddress);
-					LeaveCriticalSection(&BLELookupCriticalSection);
-					auto gattIdFromTce = co_await concurrency::task<String^>(tce);
-					
-					String^ gattId;
-					EnterCriticalSection(&BLELookupCriticalSection);
-					if (bluetoothAddressGattIdMap->HasKey(bluetoothAddress)) {
-						gattId = bluetoothAddressGattIdMap->Lookup(bluetoothAddress);
-					}
-					else {
-						gattId = gattIdFromTce;
-						//bluetoothAddressGattIdMap->Insert(bluetoothAddress, gattId);
-					}
-					LeaveCriticalSection(&BLELookupCriticalSection);
+int main(Array<String^>^ args) {
+	mainEntered = currentUniversalTime();
+	FILETIME created, exited, kernelTime, userTime;
+	if (GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernelTime, &userTime)) {
+		processCreated = ((long long)created.dwHighDateTime << 32) | created.dwLowDateTime;
+	}
 
-					msg->Insert("gattId", !(gattId->Equals("")) ? JsonValue::CreateStringValue(gattId) : JsonValue::CreateNullValue());
-					writeObject(msg);
-				});
-			}
+	QueryPerformanceFrequency(&monotonicFrequency);
+
+	CreateMutex(NULL, FALSE, L"BLEServer");
+
+	bool daemonMode = false;
+	bool standaloneMode = false;
+	for (unsigned int i = 0; i < args->Length; i++) {
+		daemonMode = daemonMode || args[i]->Equals("--daemon");
+		standaloneMode = standaloneMode || args[i]->Equals("--standalone");
+	}
+
+	// When launched by Firefox, hand the connection over to the shared daemon, or serve it in-process if that fails
+	if (!daemonMode && !standaloneMode) {
+		HANDLE pipe = connectToDaemon();
+		if (pipe != INVALID_HANDLE_VALUE) {
+			return runShim(pipe);
 		}
-	);
+	}
 
-	JsonObject^ msg = ref new JsonObject();
-	msg->Insert("_type", JsonValue::CreateStringValue("Start"));
-	// API version is required and will be incremented when breaking changes are made to the API
-	msg->Insert("apiVersion", JsonValue::CreateNumberValue(API_VERSION));
-	// the following two values are not currently validated but may be used in the future to determine whether to offer users an update to BLEServer
-	// third-party server implementations should change these values for their servers
-	msg->Insert("serverName", JsonValue::CreateStringValue("bleserver-win-cppcx"));
-	msg->Insert("serverVersion", JsonValue::CreateStringValue("0.5.3"));
-	writeObject(msg);
+	Microsoft::WRL::Wrappers::RoInitializeWrapper initialize(RO_INIT_MULTITHREADED);
+
+	CoInitializeSecurity(
+		nullptr, // TODO: "O:BAG:BAD:(A;;0x7;;;PS)(A;;0x3;;;SY)(A;;0x7;;;BA)(A;;0x3;;;AC)(A;;0x3;;;LS)(A;;0x3;;;NS)"
+		-1,
+		nullptr,
+		nullptr,
+		RPC_C_AUTHN_LEVEL_DEFAULT,
+		RPC_C_IMP_LEVEL_IDENTIFY,
+		NULL,
+		EOAC_NONE,
+		nullptr);
+
+	if (!InitializeCriticalSectionAndSpinCount(&BLELookupCriticalSection, 0x00000400)) {
+		return -1;
+	}
 
-	// Set STDIN / STDOUT to binary mode
-	if ((_setmode(0, _O_BINARY) == -1) || (_setmode(1, _O_BINARY) == -1)) {
+	if (!InitializeCriticalSectionAndSpinCount(&UuidCriticalSection, 0x00000400)) {
 		return -1;
 	}
 
-	std::wstring_convert<std::codecvt_utf8<wchar_t>> convert;
-	try {
-		while (!std::cin.eof()) {
-			unsigned int len = 0;
-			std::cin.read(reinterpret_cast<char*>(&len), 4);
-
-			if (len > 0) {
-				char* msgBuf = new char[len];
-				std::cin.read(msgBuf, len);
-				String^ jsonStr = ref new String(convert.from_bytes(msgBuf, msgBuf + len).c_str());
-				delete[] msgBuf;
-				JsonObject^ json = JsonObject::Parse(jsonStr);
-				processCommand(json);
-			}
-		}
+	if (!InitializeCriticalSectionAndSpinCount(&ClientsCriticalSection, 0x00000400)) {
+		return -1;
 	}
-	catch (std::exception& e) {
-		JsonObject^ msg = ref new JsonObject();
-		msg->Insert("_type", JsonValue::CreateStringValue("error"));
-		std::string eReason = std::string(e.what());
-		std::wstring wReason = std::wstring(eReason.begin(), eReason.end());
-		msg->Insert("error", JsonValue::CreateStringValue(ref new String(wReason.c_str())));
-		writeObject(msg);
+
+	if (!InitializeCriticalSectionAndSpinCount(&ScanCriticalSection, 0x00000400)) {
+		return -1;
+	}
+
+	if (!InitializeCriticalSectionAndSpinCount(&NotificationStatsCriticalSection, 0x00000400)) {
+		return -1;
+	}
+	if (!InitializeCriticalSectionAndSpinCount(&PendingCommandsCriticalSection, 0x00000400)) {
+		return -1;
+	}
+	if (!InitializeCriticalSectionAndSpinCount(&LingerCriticalSection, 0x00000400)) {
+		return -1;
+	}
+	if (!InitializeCriticalSectionAndSpinCount(&GattServicesCriticalSection, 0x00000400)) {
+		return -1;
+	}
+	if (!InitializeCriticalSectionAndSpinCount(&AdapterCriticalSection, 0x00000400)) {
+		return -1;
+	}
+	if (!InitializeCriticalSectionAndSpinCount(&PairingCriticalSection, 0x00000400)) {
+		return -1;
+	}
+	if (!InitializeCriticalSectionAndSpinCount(&ReliableWriteCriticalSection, 0x00000400)) {
+		return -1;
+	}
+	if (!InitializeCriticalSectionAndSpinCount(&RecentDevicesCriticalSection, 0x00000400)) {
+		return -1;
+	}
+	if (!InitializeCriticalSectionAndSpinCount(&SchedulerCriticalSection, 0x00000400)) {
+		return -1;
+	}
+	if (!InitializeCriticalSectionAndSpinCount(&ConnectCriticalSection, 0x00000400)) {
+		return -1;
+	}
+	if (!InitializeCriticalSectionAndSpinCount(&DeviceMapsCriticalSection, 0x00000400)) {
+		return -1;
+	}
+	if (!startExecutors()) {
+		return -1;
+	}
+	lingerSweepTimer = CreateThreadpoolTimer(sweepLingeringDevices, nullptr, nullptr);
+	if (lingerSweepTimer == nullptr) {
+		return -1;
+	}
+
+	prefetchDefaultAdapter();
+
+	if (daemonMode) {
+		return runDaemon();
 	}
 
-	DeleteCriticalSection(&OutputCriticalSection);
+	serveClient(addClient(GetStdHandle(STD_INPUT_HANDLE), GetStdHandle(STD_OUTPUT_HANDLE), false));
 
 	return 0;
 }
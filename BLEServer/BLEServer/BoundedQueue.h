@@ -0,0 +1,106 @@
+// BoundedQueue.h : Fixed capacity lock-free multi-producer multi-consumer queue
+//
+// Copyright (C) 2023, Steven Nyman. License: MIT.
+//
+// Dmitry Vyukov's bounded MPMC queue: every cell carries a sequence number that tells producers and consumers whether
+// it is free or holds a value for the position they claimed, so neither side ever takes a lock or waits on the other.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+template <typename T>
+class BoundedQueue {
+public:
+	// capacity must be a power of two
+	explicit BoundedQueue(size_t capacity) : cells(new Cell[capacity]), mask(capacity - 1), enqueuePosition(0), dequeuePosition(0) {
+		for (size_t i = 0; i < capacity; i++) {
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	BoundedQueue(const BoundedQueue&) = delete;
+	BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+	// Returns false without blocking when the queue is full
+	bool tryPush(const T& value) {
+		Cell* cell;
+		size_t position = enqueuePosition.load(std::memory_order_relaxed);
+		while (true) {
+			cell = &cells[position & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+			if (difference == 0) {
+				if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			}
+			else if (difference < 0) {
+				return false;
+			}
+			else {
+				position = enqueuePosition.load(std::memory_order_relaxed);
+			}
+		}
+		cell->value = value;
+		cell->sequence.store(position + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Returns false without blocking when the queue is empty
+	bool tryPop(T& value) {
+		Cell* cell;
+		size_t position = dequeuePosition.load(std::memory_order_relaxed);
+		while (true) {
+			cell = &cells[position & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+			if (difference == 0) {
+				if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			}
+			else if (difference < 0) {
+				return false;
+			}
+			else {
+				position = dequeuePosition.load(std::memory_order_relaxed);
+			}
+		}
+		value = cell->value;
+		cell->sequence.store(position + mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	size_t capacity() const {
+		return mask + 1;
+	}
+
+	// Only a snapshot while other threads are pushing or popping
+	size_t approximateSize() const {
+		size_t enqueued = enqueuePosition.load(std::memory_order_relaxed);
+		size_t dequeued = dequeuePosition.load(std::memory_order_relaxed);
+		return enqueued > dequeued ? enqueued - dequeued : 0;
+	}
+
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	static const size_t CACHE_LINE_SIZE = 64;
+
+	std::unique_ptr<Cell[]> cells;
+	const size_t mask;
+	// padded onto separate cache lines so that producers and consumers don't contend; padding rather than alignas
+	// because over-aligned types can't be heap allocated reliably before C++17
+	char padding0[CACHE_LINE_SIZE];
+	std::atomic<size_t> enqueuePosition;
+	char padding1[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> dequeuePosition;
+	char padding2[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+};
@@ -0,0 +1,277 @@
+// FairScheduler.h : Weighted fair queuing of commands between clients, with in-flight limits and rate caps
+//
+// Copyright (C) 2023, Steven Nyman. License: MIT.
+//
+// Start-time fair queuing: every queued item is tagged with a virtual start time, the later of the scheduler's virtual
+// time and the finish tag of the previous item of its flow, and finishing 1 / weight later. The runnable flow whose head
+// has the smallest start tag goes next, so a flow that floods the queue only pushes its own later items back, and a flow
+// that was idle starts at the current virtual time instead of spending credit saved up while idle.
+// A flow is runnable while it has fewer items in flight than maxInFlight and, when it has a rate cap, a token in its
+// bucket. Buckets refill at ratePerSecond up to burst tokens.
+// The scheduling state of a flow is dropped once it has nothing queued or in flight and a full bucket, which loses
+// nothing: an idle flow starts at the current virtual time anyway, and a new flow gets a full bucket. Its usage counters
+// are kept until removeFlows forgets the key.
+// Not thread safe, callers hold their own lock.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <utility>
+#include <vector>
+
+struct FairSchedulerLimits {
+	unsigned int maxInFlight = 8;
+	double ratePerSecond = 0; // 0 means unlimited
+	double burst = 16;
+	size_t maxQueued = 512;
+};
+
+// Counters of one flow key since its first item, until removeFlows
+struct FairSchedulerUsage {
+	double weight = 1;
+	size_t queued = 0;
+	unsigned int inFlight = 0;
+	unsigned int peakInFlight = 0;
+	uint64_t submitted = 0;
+	uint64_t started = 0;
+	uint64_t completed = 0;
+	uint64_t rejected = 0; // the queue was full
+	uint64_t removed = 0; // taken out of the queue before starting
+	uint64_t throttled = 0; // items that had to wait for the rate cap
+	uint64_t totalQueueWaitUs = 0;
+	uint64_t maxQueueWaitUs = 0;
+};
+
+template <typename Key, typename T>
+class FairScheduler {
+public:
+	FairScheduler() : virtualTime(0) {
+	}
+
+	void setLimits(const FairSchedulerLimits& newLimits) {
+		limits = newLimits;
+		// a bucket that can't hold a whole token would never let anything through
+		if (limits.burst < 1) {
+			limits.burst = 1;
+		}
+		for (auto& pair : flows) {
+			if (pair.second.tokens > limits.burst) {
+				pair.second.tokens = limits.burst;
+			}
+		}
+	}
+
+	const FairSchedulerLimits& getLimits() const {
+		return limits;
+	}
+
+	// Returns false, leaving the item to the caller, when the flow already has maxQueued items waiting
+	bool enqueue(const Key& key, const T& item, uint64_t nowUs, double weight = 1) {
+		auto found = flows.find(key);
+		if (found == flows.end()) {
+			found = flows.emplace(key, Flow()).first;
+			found->second.tokens = limits.burst;
+			found->second.refilledUs = nowUs;
+			found->second.usage = &usages[key];
+		}
+		Flow& flow = found->second;
+		flow.usage->weight = weight > 0 ? weight : 1;
+		if (flow.queue.size() >= limits.maxQueued) {
+			flow.usage->rejected++;
+			return false;
+		}
+		Entry entry;
+		entry.item = item;
+		entry.startTag = flow.finishTag > virtualTime ? flow.finishTag : virtualTime;
+		entry.enqueuedUs = nowUs;
+		entry.throttled = false;
+		flow.finishTag = entry.startTag + 1 / flow.usage->weight;
+		flow.queue.push_back(entry);
+		flow.usage->submitted++;
+		return true;
+	}
+
+	// Takes the next item that may start now, if any. The caller reports its end with complete.
+	bool next(uint64_t nowUs, Key& key, T& item) {
+		dropIdleFlows(nowUs);
+		Flow* chosen = nullptr;
+		const Key* chosenKey = nullptr;
+		for (auto& pair : flows) {
+			Flow& flow = pair.second;
+			if (flow.queue.empty() || flow.usage->inFlight >= limits.maxInFlight) {
+				continue;
+			}
+			refill(flow, nowUs);
+			if (limits.ratePerSecond > 0 && flow.tokens < 1) {
+				if (!flow.queue.front().throttled) {
+					flow.queue.front().throttled = true;
+					flow.usage->throttled++;
+				}
+				continue;
+			}
+			if (chosen == nullptr || flow.queue.front().startTag < chosen->queue.front().startTag) {
+				chosen = &flow;
+				chosenKey = &pair.first;
+			}
+		}
+		if (chosen == nullptr) {
+			return false;
+		}
+
+		Entry& entry = chosen->queue.front();
+		virtualTime = entry.startTag;
+		key = *chosenKey;
+		item = entry.item;
+		uint64_t waitedUs = nowUs > entry.enqueuedUs ? nowUs - entry.enqueuedUs : 0;
+		chosen->queue.pop_front();
+		if (limits.ratePerSecond > 0) {
+			chosen->tokens -= 1;
+		}
+		chosen->usage->inFlight++;
+		if (chosen->usage->inFlight > chosen->usage->peakInFlight) {
+			chosen->usage->peakInFlight = chosen->usage->inFlight;
+		}
+		chosen->usage->started++;
+		chosen->usage->totalQueueWaitUs += waitedUs;
+		if (waitedUs > chosen->usage->maxQueueWaitUs) {
+			chosen->usage->maxQueueWaitUs = waitedUs;
+		}
+		return true;
+	}
+
+	void complete(const Key& key) {
+		auto found = flows.find(key);
+		if (found != flows.end() && found->second.usage->inFlight > 0) {
+			found->second.usage->inFlight--;
+			found->second.usage->completed++;
+		}
+	}
+
+	// When the earliest flow that is only waiting for its rate cap gets a token. Returns false if no flow is.
+	bool nextReadyUs(uint64_t nowUs, uint64_t& readyUs) {
+		bool waiting = false;
+		if (limits.ratePerSecond <= 0) {
+			return false;
+		}
+		for (auto& pair : flows) {
+			Flow& flow = pair.second;
+			if (flow.queue.empty() || flow.usage->inFlight >= limits.maxInFlight) {
+				continue;
+			}
+			refill(flow, nowUs);
+			uint64_t flowReadyUs = nowUs;
+			if (flow.tokens < 1) {
+				flowReadyUs += (uint64_t)((1 - flow.tokens) / limits.ratePerSecond * 1000000) + 1;
+			}
+			if (!waiting || flowReadyUs < readyUs) {
+				readyUs = flowReadyUs;
+				waiting = true;
+			}
+		}
+		return waiting;
+	}
+
+	// Takes the queued items matching predicate(key, item) out of the queues, oldest first per flow
+	template <typename Predicate>
+	std::vector<T> removeQueued(Predicate predicate) {
+		std::vector<T> removed;
+		for (auto& pair : flows) {
+			auto& queue = pair.second.queue;
+			for (auto it = queue.begin(); it != queue.end();) {
+				if (predicate(pair.first, it->item)) {
+					removed.push_back(it->item);
+					pair.second.usage->removed++;
+					it = queue.erase(it);
+				}
+				else {
+					it++;
+				}
+			}
+		}
+		return removed;
+	}
+
+	// Forgets the flows matching predicate(key) along with their counters, returning the items they still had queued.
+	// Items of theirs still in flight may still be completed, that is ignored.
+	template <typename Predicate>
+	std::vector<T> removeFlows(Predicate predicate) {
+		std::vector<T> removed;
+		for (auto it = usages.begin(); it != usages.end();) {
+			if (predicate(it->first)) {
+				auto flow = flows.find(it->first);
+				if (flow != flows.end()) {
+					for (auto& entry : flow->second.queue) {
+						removed.push_back(entry.item);
+					}
+					flows.erase(flow);
+				}
+				it = usages.erase(it);
+			}
+			else {
+				it++;
+			}
+		}
+		return removed;
+	}
+
+	std::vector<std::pair<Key, FairSchedulerUsage>> usage() const {
+		std::vector<std::pair<Key, FairSchedulerUsage>> result;
+		result.reserve(usages.size());
+		for (auto& pair : usages) {
+			FairSchedulerUsage flowUsage = pair.second;
+			auto flow = flows.find(pair.first);
+			flowUsage.queued = flow != flows.end() ? flow->second.queue.size() : 0;
+			result.push_back(std::make_pair(pair.first, flowUsage));
+		}
+		return result;
+	}
+
+private:
+	struct Entry {
+		T item;
+		double startTag;
+		uint64_t enqueuedUs;
+		bool throttled;
+	};
+
+	struct Flow {
+		std::deque<Entry> queue;
+		double finishTag = 0;
+		double tokens = 0;
+		uint64_t refilledUs = 0;
+		FairSchedulerUsage* usage = nullptr; // in usages, which outlives the flow
+	};
+
+	void dropIdleFlows(uint64_t nowUs) {
+		for (auto it = flows.begin(); it != flows.end();) {
+			Flow& flow = it->second;
+			if (flow.queue.empty() && flow.usage->inFlight == 0) {
+				refill(flow, nowUs);
+				if (limits.ratePerSecond <= 0 || flow.tokens >= limits.burst) {
+					it = flows.erase(it);
+					continue;
+				}
+			}
+			it++;
+		}
+	}
+
+	void refill(Flow& flow, uint64_t nowUs) {
+		if (limits.ratePerSecond <= 0 || nowUs <= flow.refilledUs) {
+			return;
+		}
+		flow.tokens += (double)(nowUs - flow.refilledUs) * limits.ratePerSecond / 1000000;
+		if (flow.tokens > limits.burst) {
+			flow.tokens = limits.burst;
+		}
+		flow.refilledUs = nowUs;
+	}
+
+	FairSchedulerLimits limits;
+	std::map<Key, Flow> flows; // only the flows that are busy or still refilling their bucket
+	std::map<Key, FairSchedulerUsage> usages;
+	double virtualTime;
+};
@@ -0,0 +1,196 @@
+// Tracing.h : Span recording with a fixed-size ring buffer and Chrome trace-event output
+//
+// Copyright (C) 2023, Steven Nyman. License: MIT.
+//
+// Recording a span claims the next slot with one atomic increment and copies the span into it, overwriting the oldest
+// span once the ring is full, so tracing can stay enabled. The snapshot can be written as a Chrome trace-event JSON
+// file, to be opened in chrome://tracing or https://ui.perfetto.dev.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct TraceSpan {
+	char name[48];
+	char device[96]; // empty when the span isn't about one device
+	uint64_t startUs;
+	uint64_t durationUs;
+	uint32_t threadId;
+	uint32_t clientId;
+	int64_t commandId; // -1 when the span isn't part of a command
+};
+
+// Copies a null terminated UTF-8 string, truncated on a character boundary to fit
+template <size_t N>
+inline void copyTraceString(char (&out)[N], const char* in) {
+	size_t length = 0;
+	while (length < N - 1 && in[length] != 0) {
+		length++;
+	}
+	if (in[length] != 0) {
+		// don't leave half of a multi-byte character behind
+		while (length > 0 && ((unsigned char)in[length] & 0xc0) == 0x80) {
+			length--;
+		}
+	}
+	std::copy(in, in + length, out);
+	out[length] = 0;
+}
+
+class TraceRing {
+public:
+	explicit TraceRing(size_t capacity) : slots(new Slot[capacity]), capacity(capacity), next(0) {
+		for (size_t i = 0; i < capacity; i++) {
+			slots[i].lock.clear();
+			slots[i].ticket = EMPTY;
+		}
+	}
+
+	TraceRing(const TraceRing&) = delete;
+	TraceRing& operator=(const TraceRing&) = delete;
+
+	void record(const TraceSpan& span) {
+		uint64_t ticket = next.fetch_add(1, std::memory_order_relaxed);
+		Slot& slot = slots[ticket % capacity];
+		// only contended when the ring wraps around during a copy, or while a snapshot reads the slot
+		while (slot.lock.test_and_set(std::memory_order_acquire)) {
+		}
+		// a writer that was lapped by a whole ring must not overwrite the newer span
+		if (slot.ticket == EMPTY || slot.ticket < ticket) {
+			slot.ticket = ticket;
+			slot.span = span;
+		}
+		slot.lock.clear(std::memory_order_release);
+	}
+
+	// The retained spans, oldest first
+	std::vector<TraceSpan> snapshot() const {
+		std::vector<std::pair<uint64_t, TraceSpan>> retained;
+		retained.reserve(capacity);
+		for (size_t i = 0; i < capacity; i++) {
+			Slot& slot = slots[i];
+			while (slot.lock.test_and_set(std::memory_order_acquire)) {
+			}
+			if (slot.ticket != EMPTY) {
+				retained.push_back(std::make_pair(slot.ticket, slot.span));
+			}
+			slot.lock.clear(std::memory_order_release);
+		}
+		std::sort(retained.begin(), retained.end(), [](const std::pair<uint64_t, TraceSpan>& a, const std::pair<uint64_t, TraceSpan>& b) {
+			return a.first < b.first;
+		});
+		std::vector<TraceSpan> result;
+		result.reserve(retained.size());
+		for (auto& pair : retained) {
+			result.push_back(pair.second);
+		}
+		return result;
+	}
+
+	// Spans recorded since creation, including the overwritten ones
+	uint64_t recorded() const {
+		return next.load(std::memory_order_relaxed);
+	}
+
+	size_t size() const {
+		return capacity;
+	}
+
+private:
+	static const uint64_t EMPTY = ~(uint64_t)0;
+
+	struct Slot {
+		std::atomic_flag lock;
+		uint64_t ticket;
+		TraceSpan span;
+	};
+
+	std::unique_ptr<Slot[]> slots;
+	const size_t capacity;
+	std::atomic<uint64_t> next;
+};
+
+inline void appendTraceJsonString(std::string& out, const char* value) {
+	out += '"';
+	for (const char* c = value; *c != 0; c++) {
+		switch (*c) {
+			case '"':
+				out += "\\\"";
+				break;
+			case '\\':
+				out += "\\\\";
+				break;
+			default:
+				if ((unsigned char)*c < 0x20) {
+					char escaped[8];
+					snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*c);
+					out += escaped;
+				}
+				else {
+					out += *c;
+				}
+				break;
+		}
+	}
+	out += '"';
+}
+
+inline void appendTraceEvent(std::string& out, const TraceSpan& span, const char* phase, uint64_t timestamp, uint32_t processId) {
+	char number[64];
+	out += "{\"name\":";
+	appendTraceJsonString(out, span.name);
+	out += ",\"ph\":\"";
+	out += phase;
+	snprintf(number, sizeof(number), "\",\"ts\":%llu", (unsigned long long)timestamp);
+	out += number;
+	if (phase[0] == 'X') {
+		snprintf(number, sizeof(number), ",\"dur\":%llu", (unsigned long long)span.durationUs);
+		out += number;
+	}
+	snprintf(number, sizeof(number), ",\"pid\":%u,\"tid\":%u", processId, span.threadId);
+	out += number;
+	if (span.commandId >= 0) {
+		snprintf(number, sizeof(number), ",\"cat\":\"command\",\"id\":\"%u/%lld\"", span.clientId, (long long)span.commandId);
+		out += number;
+	}
+	out += ",\"args\":{";
+	if (span.commandId >= 0) {
+		snprintf(number, sizeof(number), "\"id\":%lld,\"client\":%u", (long long)span.commandId, span.clientId);
+		out += number;
+	}
+	if (span.device[0] != 0) {
+		out += span.commandId >= 0 ? ",\"device\":" : "\"device\":";
+		appendTraceJsonString(out, span.device);
+	}
+	out += "}}";
+}
+
+// JSON object format of the Trace Event Format. Spans of a command are async begin/end pairs that share the command's
+// track, because its awaits resume on whichever thread pool thread is free and would not nest on any one thread.
+// Other spans are complete ("X") events on the thread that recorded them.
+inline std::string chromeTraceJson(const std::vector<TraceSpan>& spans, uint32_t processId) {
+	std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	for (size_t i = 0; i < spans.size(); i++) {
+		const TraceSpan& span = spans[i];
+		if (i > 0) {
+			out += ',';
+		}
+		if (span.commandId >= 0) {
+			appendTraceEvent(out, span, "b", span.startUs, processId);
+			out += ',';
+			appendTraceEvent(out, span, "e", span.startUs + span.durationUs, processId);
+		}
+		else {
+			appendTraceEvent(out, span, "X", span.startUs, processId);
+		}
+	}
+	out += "]}";
+	return out;
+}
@@ -0,0 +1,83 @@
+// Do not manually edit this file. Contents generated by ../../update_uuids.py from https://bitbucket.org/bluetooth-SIG/public/src/main/assigned_numbers/uuids/
+// Sorted short UUIDs of the standard GATT services, characteristics and descriptors.
+
+#pragma once
+
+const unsigned short STANDARD_GATT_SHORT_UUIDS[] = {
+	0x1800, 0x1801, 0x1802, 0x1803, 0x1804, 0x1805, 0x1806, 0x1807,
+	0x1808, 0x1809, 0x180A, 0x180D, 0x180E, 0x180F, 0x1810, 0x1811,
+	0x1812, 0x1813, 0x1814, 0x1815, 0x1816, 0x1818, 0x1819, 0x181A,
+	0x181B, 0x181C, 0x181D, 0x181E, 0x181F, 0x1820, 0x1821, 0x1822,
+	0x1823, 0x1824, 0x1825, 0x1826, 0x1827, 0x1828, 0x1829, 0x183A,
+	0x183B, 0x183C, 0x183D, 0x183E, 0x183F, 0x1840, 0x1843, 0x1844,
+	0x1845, 0x1846, 0x1847, 0x1848, 0x1849, 0x184A, 0x184B, 0x184C,
+	0x184D, 0x184E, 0x184F, 0x1850, 0x1851, 0x1852, 0x1853, 0x1854,
+	0x1855, 0x1856, 0x1857, 0x1858, 0x1859, 0x185A, 0x185B, 0x185C,
+	0x185D, 0x185E, 0x185F, 0x2900, 0x2901, 0x2902, 0x2903, 0x2904,
+	0x2905, 0x2906, 0x2907, 0x2908, 0x2909, 0x290A, 0x290B, 0x290C,
+	0x290D, 0x290E, 0x290F, 0x2910, 0x2911, 0x2912, 0x2913, 0x2914,
+	0x2915, 0x2916, 0x2917, 0x2A00, 0x2A01, 0x2A02, 0x2A03, 0x2A04,
+	0x2A05, 0x2A06, 0x2A07, 0x2A08, 0x2A09, 0x2A0A, 0x2A0C, 0x2A0D,
+	0x2A0E, 0x2A0F, 0x2A11, 0x2A12, 0x2A13, 0x2A14, 0x2A16, 0x2A17,
+	0x2A18, 0x2A19, 0x2A1C, 0x2A1D, 0x2A1E, 0x2A21, 0x2A22, 0x2A23,
+	0x2A24, 0x2A25, 0x2A26, 0x2A27, 0x2A28, 0x2A29, 0x2A2A, 0x2A2B,
+	0x2A2C, 0x2A31, 0x2A32, 0x2A33, 0x2A34, 0x2A35, 0x2A36, 0x2A37,
+	0x2A38, 0x2A39, 0x2A3F, 0x2A40, 0x2A41, 0x2A42, 0x2A43, 0x2A44,
+	0x2A45, 0x2A46, 0x2A47, 0x2A48, 0x2A49, 0x2A4A, 0x2A4B, 0x2A4C,
+	0x2A4D, 0x2A4E, 0x2A4F, 0x2A50, 0x2A51, 0x2A52, 0x2A53, 0x2A54,
+	0x2A55, 0x2A56, 0x2A58, 0x2A5A, 0x2A5B, 0x2A5C, 0x2A5D, 0x2A5E,
+	0x2A5F, 0x2A60, 0x2A63, 0x2A64, 0x2A65, 0x2A66, 0x2A67, 0x2A68,
+	0x2A69, 0x2A6A, 0x2A6B, 0x2A6C, 0x2A6D, 0x2A6E, 0x2A6F, 0x2A70,
+	0x2A71, 0x2A72, 0x2A73, 0x2A74, 0x2A75, 0x2A76, 0x2A77, 0x2A78,
+	0x2A79, 0x2A7A, 0x2A7B, 0x2A7D, 0x2A7E, 0x2A7F, 0x2A80, 0x2A81,
+	0x2A82, 0x2A83, 0x2A84, 0x2A85, 0x2A86, 0x2A87, 0x2A88, 0x2A89,
+	0x2A8A, 0x2A8B, 0x2A8C, 0x2A8D, 0x2A8E, 0x2A8F, 0x2A90, 0x2A91,
+	0x2A92, 0x2A93, 0x2A94, 0x2A95, 0x2A96, 0x2A97, 0x2A98, 0x2A99,
+	0x2A9A, 0x2A9B, 0x2A9C, 0x2A9D, 0x2A9E, 0x2A9F, 0x2AA0, 0x2AA1,
+	0x2AA2, 0x2AA3, 0x2AA4, 0x2AA5, 0x2AA6, 0x2AA7, 0x2AA8, 0x2AA9,
+	0x2AAA, 0x2AAB, 0x2AAC, 0x2AAD, 0x2AAE, 0x2AAF, 0x2AB0, 0x2AB1,
+	0x2AB2, 0x2AB3, 0x2AB4, 0x2AB5, 0x2AB6, 0x2AB7, 0x2AB8, 0x2AB9,
+	0x2ABA, 0x2ABB, 0x2ABC, 0x2ABD, 0x2ABE, 0x2ABF, 0x2AC0, 0x2AC1,
+	0x2AC2, 0x2AC3, 0x2AC4, 0x2AC5, 0x2AC6, 0x2AC7, 0x2AC8, 0x2AC9,
+	0x2ACC, 0x2ACD, 0x2ACE, 0x2ACF, 0x2AD0, 0x2AD1, 0x2AD2, 0x2AD3,
+	0x2AD4, 0x2AD5, 0x2AD6, 0x2AD7, 0x2AD8, 0x2AD9, 0x2ADA, 0x2ADB,
+	0x2ADC, 0x2ADD, 0x2ADE, 0x2AE0, 0x2AE1, 0x2AE2, 0x2AE3, 0x2AE4,
+	0x2AE5, 0x2AE6, 0x2AE7, 0x2AE8, 0x2AE9, 0x2AEA, 0x2AEB, 0x2AEC,
+	0x2AED, 0x2AEE, 0x2AEF, 0x2AF0, 0x2AF1, 0x2AF2, 0x2AF3, 0x2AF4,
+	0x2AF5, 0x2AF6, 0x2AF7, 0x2AF8, 0x2AF9, 0x2AFA, 0x2AFB, 0x2AFC,
+	0x2AFD, 0x2AFE, 0x2AFF, 0x2B00, 0x2B01, 0x2B02, 0x2B03, 0x2B04,
+	0x2B05, 0x2B06, 0x2B07, 0x2B08, 0x2B09, 0x2B0A, 0x2B0B, 0x2B0C,
+	0x2B0D, 0x2B0E, 0x2B0F, 0x2B10, 0x2B11, 0x2B12, 0x2B13, 0x2B14,
+	0x2B15, 0x2B16, 0x2B17, 0x2B18, 0x2B19, 0x2B1A, 0x2B1B, 0x2B1C,
+	0x2B1D, 0x2B1E, 0x2B1F, 0x2B20, 0x2B21, 0x2B22, 0x2B23, 0x2B24,
+	0x2B25, 0x2B26, 0x2B27, 0x2B28, 0x2B29, 0x2B2A, 0x2B2B, 0x2B2C,
+	0x2B2D, 0x2B2E, 0x2B2F, 0x2B30, 0x2B31, 0x2B32, 0x2B33, 0x2B34,
+	0x2B35, 0x2B36, 0x2B37, 0x2B38, 0x2B39, 0x2B3A, 0x2B3B, 0x2B3C,
+	0x2B3D, 0x2B3E, 0x2B3F, 0x2B40, 0x2B41, 0x2B42, 0x2B43, 0x2B44,
+	0x2B45, 0x2B46, 0x2B47, 0x2B48, 0x2B49, 0x2B4A, 0x2B4B, 0x2B4C,
+	0x2B4D, 0x2B4E, 0x2B4F, 0x2B50, 0x2B51, 0x2B77, 0x2B78, 0x2B79,
+	0x2B7A, 0x2B7B, 0x2B7C, 0x2B7D, 0x2B7E, 0x2B7F, 0x2B80, 0x2B81,
+	0x2B82, 0x2B83, 0x2B84, 0x2B85, 0x2B86, 0x2B87, 0x2B88, 0x2B89,
+	0x2B8A, 0x2B8B, 0x2B8C, 0x2B8D, 0x2B8E, 0x2B8F, 0x2B90, 0x2B91,
+	0x2B92, 0x2B93, 0x2B94, 0x2B95, 0x2B96, 0x2B97, 0x2B98, 0x2B99,
+	0x2B9A, 0x2B9B, 0x2B9C, 0x2B9D, 0x2B9E, 0x2B9F, 0x2BA0, 0x2BA1,
+	0x2BA2, 0x2BA3, 0x2BA4, 0x2BA5, 0x2BA6, 0x2BA7, 0x2BA8, 0x2BAD,
+	0x2BAE, 0x2BAF, 0x2BB0, 0x2BB1, 0x2BB2, 0x2BB3, 0x2BB4, 0x2BB5,
+	0x2BB6, 0x2BB7, 0x2BB8, 0x2BB9, 0x2BBA, 0x2BBB, 0x2BBC, 0x2BBD,
+	0x2BBE, 0x2BBF, 0x2BC0, 0x2BC1, 0x2BC2, 0x2BC3, 0x2BC4, 0x2BC5,
+	0x2BC6, 0x2BC7, 0x2BC8, 0x2BC9, 0x2BCA, 0x2BCB, 0x2BCC, 0x2BCD,
+	0x2BCE, 0x2BCF, 0x2BD0, 0x2BD1, 0x2BD2, 0x2BD3, 0x2BD4, 0x2BD5,
+	0x2BD6, 0x2BD7, 0x2BD8, 0x2BD9, 0x2BDA, 0x2BDB, 0x2BDC, 0x2BDD,
+	0x2BDE, 0x2BDF, 0x2BE0, 0x2BE1, 0x2BE2, 0x2BE3, 0x2BE4, 0x2BE5,
+	0x2BE6, 0x2BE7, 0x2BE8, 0x2BE9, 0x2BEA, 0x2BEB, 0x2BEC, 0x2BED,
+	0x2BEE, 0x2BEF, 0x2BF0, 0x2BF1, 0x2BF2, 0x2BF3, 0x2BF4, 0x2BF5,
+	0x2BF6, 0x2BF7, 0x2BF8, 0x2BF9, 0x2BFA, 0x2BFB, 0x2BFC, 0x2BFD,
+	0x2BFE, 0x2BFF, 0x2C00, 0x2C01, 0x2C02, 0x2C03, 0x2C04, 0x2C05,
+	0x2C06, 0x2C07, 0x2C08, 0x2C09, 0x2C0A, 0x2C0B, 0x2C0C, 0x2C0D,
+	0x2C0E, 0x2C0F, 0x2C10, 0x2C11, 0x2C12, 0x2C13, 0x2C14, 0x2C15,
+	0x2C16, 0x2C17, 0x2C18, 0x2C19, 0x2C1A, 0x2C1B, 0x2C1C, 0x2C1D,
+	0x2C1E, 0x2C1F, 0x2C20, 0x2C21, 0x2C22, 0x2C23, 0x2C24, 0x2C25,
+	0x2C26, 0x2C27, 0x2C28, 0x2C29, 0x2C2A, 0x2C2B, 0x2C2C, 0x2C2D,
+	0x2C2E, 0x2C2F, 0x2C30, 0x2C31, 0x2C32, 0x2C33, 0x2C34, 0x2C35,
+	0x2C36, 0x2C37, 0x2C38,
+};
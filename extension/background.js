@@ -6,11 +6,14 @@ let requestId = 0;
 let requests = {};
 
 let commandPorts = {};
+// names each port's notification subscriptions on the server, which counts them per subscriber
+let nextSubscriber = 1;
 let activePorts = 0;
 let nativePort = null;
 
 let listeners = {};
 let listenercnts = {};
+let listenerSessions = {};
 
 const COOLDOWN_MS = 30* 1000;
 let lastInfoTab = 0;
@@ -21,6 +24,13 @@ let nativeReady = null;
 
 let currentRecommendedUpdateContents = null;
 
+// sent by the server in Start: supported commands, features and limits
+let serverCapabilities = null;
+
+function serverSupports(cmd) {
+    return serverCapabilities !== null && serverCapabilities.commands.includes(cmd);
+}
+
 async function openOrFocusInfoTab() {
     if (Date.now() - lastInfoTab < COOLDOWN_MS) return;
     if ((await browser.storage.local.get('hideInstallation')).hideInstallation) return;
@@ -45,6 +55,10 @@ async function nativeRequest(cmd, params, port) {
             cmd,
             _id: requestId++,
         });
+        if (port && port.sender && port.sender.origin) {
+            // the server shares the radio fairly between origins
+            msg._origin = port.sender.origin;
+        }
         if (cmd != 'ping') {
             await nativeReady;
             if (debugPrints) {
@@ -74,13 +88,50 @@ async function nativeRequest(cmd, params, port) {
 
 const subscriptions = {};
 const devices = {};
+// last notification sequence number seen per subscription, and how many were missed
+const notificationSequences = {};
+const notificationGaps = {};
+
+// data strings received so far per fragment id. Messages larger than the native messaging limit arrive as fragments
+// numbered from 0, the last one has final set, and the concatenated data is the JSON text of the message.
+// Fragments of different messages can interleave with each other and with other messages.
+let fragmentedMessages = {};
+
+function reassembleFragment(msg) {
+    if (msg.index === 0) {
+        fragmentedMessages[msg.fragment] = [];
+    }
+    const fragments = fragmentedMessages[msg.fragment];
+    if (!fragments || fragments.length !== msg.index) {
+        console.error('Dropping native message with missing fragments', msg.fragment);
+        delete fragmentedMessages[msg.fragment];
+        return null;
+    }
+    fragments.push(msg.data);
+    if (!msg.final) {
+        return null;
+    }
+    delete fragmentedMessages[msg.fragment];
+    return JSON.parse(fragments.join(''));
+}
 
 function nativePortOnMessage(msg) {
+    if (msg._type === 'fragment') {
+        const message = reassembleFragment(msg);
+        if (message !== null) {
+            nativePortOnMessage(message);
+        }
+        return;
+    }
     nativeResolve();
     if (debugPrints) {
         console.log('Received native message:', msg);
     }
     if (msg._type === 'Start') {
+        serverCapabilities = msg.capabilities || null;
+        if (debugPrints && msg.startup) {
+            console.log('Server startup:', msg.startup);
+        }
         if (msg.apiVersion != SUPPORTED_HOST_API_VERSION) {
             nativePort.disconnect();
             for (const reqId in requests) {
@@ -121,6 +172,15 @@ function nativePortOnMessage(msg) {
         delete requests[msg._id];
     }
     if (msg._type === 'valueChangedNotification') {
+        // seq is consecutive per subscription, so a jump means notifications were lost on the way
+        if (msg.seq !== undefined) {
+            const lastSeq = notificationSequences[msg.subscriptionId];
+            if (lastSeq !== undefined && msg.seq > lastSeq + 1) {
+                notificationGaps[msg.subscriptionId] = (notificationGaps[msg.subscriptionId] || 0) + msg.seq - lastSeq - 1;
+                console.warn(`Missed ${msg.seq - lastSeq - 1} notification(s) for subscription ${msg.subscriptionId}`);
+            }
+            notificationSequences[msg.subscriptionId] = msg.seq;
+        }
         const portList = subscriptions[msg.subscriptionId];
         if (portList) {
             for (const port of portList) {
@@ -128,6 +188,42 @@ function nativePortOnMessage(msg) {
             }
         }
     }
+    if (msg._type === 'serviceChangedEvent') {
+        const gattId = msg.device;
+        const service = normalizeServiceUuid(msg.service);
+        // only the changed service's characteristics have to be rediscovered
+        if (characteristicCache[gattId]) {
+            for (const cachedService of Object.keys(characteristicCache[gattId])) {
+                try {
+                    if (normalizeServiceUuid(cachedService) === service) {
+                        delete characteristicCache[gattId][cachedService];
+                    }
+                } catch {
+                    delete characteristicCache[gattId][cachedService];
+                }
+            }
+        }
+        // the server ended the subscriptions of a changed or removed service
+        for (const subscriptionId of msg.subscriptionIds || []) {
+            for (const port of subscriptions[subscriptionId] || []) {
+                portsObjects.get(port).subscriptions.delete(subscriptionId);
+            }
+            delete subscriptions[subscriptionId];
+            delete notificationSequences[subscriptionId];
+            delete notificationGaps[subscriptionId];
+        }
+        const device = devices[gattId];
+        if (device) {
+            device.forEach(async port => {
+                port.postMessage({
+                    event: 'serviceChangedEvent',
+                    device: (await gattIdToWebId(gattId, port)),
+                    service,
+                    change: msg.change,
+                });
+            });
+        }
+    }
     if (msg._type === 'disconnectEvent') {
         const gattId = msg.device;
         const device = devices[gattId];
@@ -202,21 +298,45 @@ function windowsDescriptorUuid(uuid) {
     }
 }
 
-let scanningCounter = 0;
-async function startScanning(port) {
-    if (!scanningCounter) {
-        await nativeRequest('scan', {}, port);
+// Each caller gets its own scan session; the server keeps scanning while any session is open
+async function startScanning(port, options) {
+    const session = await nativeRequest('scan', options, port);
+    portsObjects.get(port).scanSessions.add(session);
+    return session;
+}
+
+function stopScanning(port, session) {
+    portsObjects.get(port).scanSessions.delete(session);
+    if (nativePort && !(nativePort.error)) {
+        nativeRequest('stopScan', { session: session }, port);
     }
-    portsObjects.get(port).scanCount++;
-    scanningCounter++;
 }
 
-function stopScanning(port) {
-    scanningCounter--;
-    portsObjects.get(port).scanCount--;
-    if (!scanningCounter && nativePort && !(nativePort.error)) {
-        nativeRequest('stopScan', {}, port);
+// Older servers don't report sessions, and results may arrive before we know our session id
+function isSessionScanResult(msg, session) {
+    return session === null || !msg.scanSessions || msg.scanSessions.includes(session);
+}
+
+// Coarse filter evaluated by the server so that unrelated advertisements are never sent to us;
+// matchDeviceFilter still applies the exact checks
+function serverScanFilter(filter) {
+    const result = {};
+    if (filter.services) {
+        result.services = filter.services.map(windowsServiceUuid);
+    }
+    if (filter.name) {
+        result.name = filter.name;
+    }
+    if (filter.namePrefix) {
+        result.namePrefix = filter.namePrefix;
+    }
+    if (filter.manufacturerData) {
+        result.companyIdentifiers = filter.manufacturerData.map(elem => elem.companyIdentifier);
     }
+    if (filter.serviceData) {
+        result.serviceData = filter.serviceData.map(elem => windowsServiceUuid(elem.service));
+    }
+    return result;
 }
 
 // intended for use with manufacturerData or serviceData
@@ -411,35 +531,59 @@ async function requestDevice(port, options) {
 
     let deviceNames = {};
     let deviceRssi = {};
-    function scanResultListener(msg) {
-        if (msg._type === 'scanResult') {
-            if (msg.localName) {
-                deviceNames[msg.bluetoothAddress] = msg.localName;
-            } else {
-                msg.localName = deviceNames[msg.bluetoothAddress];
-            }
-            for (let i = 0; i < msg.serviceData.length; i++) {
-                msg.serviceData[i].service = normalizeServiceUuid(msg.serviceData[i].service);
-            }
-            deviceRssi[msg.bluetoothAddress] = msg.rssi;
-            if (options.acceptAllDevices ||
-                options.filters.some(filter => matchDeviceFilter(filter, msg))) {
-                if ((options.exclusionFilters &&
-                    !options.exclusionFilters.some(filter => matchDeviceFilter(filter, msg)))
-                    || !options.exclusionFilters) {
-                    port.postMessage(msg);
-                }
+    let session = null;
+    const liveAddresses = new Set();
+    function offerDevice(msg) {
+        if (msg.localName) {
+            deviceNames[msg.bluetoothAddress] = msg.localName;
+        } else {
+            msg.localName = deviceNames[msg.bluetoothAddress];
+        }
+        for (let i = 0; i < msg.serviceData.length; i++) {
+            msg.serviceData[i].service = normalizeServiceUuid(msg.serviceData[i].service);
+        }
+        deviceRssi[msg.bluetoothAddress] = msg.rssi;
+        if (options.acceptAllDevices ||
+            options.filters.some(filter => matchDeviceFilter(filter, msg))) {
+            if ((options.exclusionFilters &&
+                !options.exclusionFilters.some(filter => matchDeviceFilter(filter, msg)))
+                || !options.exclusionFilters) {
+                port.postMessage(msg);
             }
         }
     }
+    function scanResultListener(msg) {
+        if (msg._type === 'scanResult' && isSessionScanResult(msg, session)) {
+            liveAddresses.add(msg.bluetoothAddress);
+            offerDevice(msg);
+        }
+    }
 
     nativePort.onMessage.addListener(scanResultListener);
     port.postMessage({
         _type: 'showDeviceChooser', currentRecommendedUpdateContents: currentRecommendedUpdateContents,
     });
+    if (serverSupports('recentDevices')) {
+        // Lists the devices the server saw advertising lately right away, instead of waiting for the scan to find
+        // them again. A live result for the same device supersedes the cached one.
+        nativeRequest('recentDevices', {
+            filters: options.filters ? options.filters.map(serverScanFilter) : [],
+        }, port).then(recent => {
+            for (const msg of recent) {
+                if (!liveAddresses.has(msg.bluetoothAddress)) {
+                    msg._type = 'scanResult';
+                    offerDevice(msg);
+                }
+            }
+        }).catch(() => {});
+    }
     try {
-        await startScanning(port);
+        session = await startScanning(port, {
+            active: true,
+            filters: options.filters ? options.filters.map(serverScanFilter) : [],
+        });
     } catch (error) {
+        nativePort.onMessage.removeListener(scanResultListener);
         if (error == 'The device is not ready for use.\r\n\r\nThe device is not ready for use.\r\n') {
             port.postMessage({ _type: 'deviceChooserWinError' });
         }
@@ -509,7 +653,7 @@ async function requestDevice(port, options) {
             name: deviceNames[deviceAddress],
         };
     } finally {
-        stopScanning(port);
+        stopScanning(port, session);
         nativePort.onMessage.removeListener(scanResultListener);
     }
 }
@@ -535,11 +679,13 @@ async function watchAdvertisements(port, webId) {
         return { exception: 'UnknownError' };
     }
 
-    if ('dev_'+port+gattId in listenercnts) {
-        listenercnts['dev_'+port.sender.contextId+gattId]++;
+    // per page and device; concatenating the port itself gave '[object Object]' for every page, so they shared a count
+    const listenerKey = 'dev_' + port.sender.contextId + gattId;
+    if (listenerKey in listenercnts) {
+        listenercnts[listenerKey]++;
         return;
     } else {
-        listenercnts['dev_'+port.sender.contextId+gattId] = 1;
+        listenercnts[listenerKey] = 1;
     }
 
     // TODO: throw InvalidStateError if Bluetooth off
@@ -547,9 +693,10 @@ async function watchAdvertisements(port, webId) {
     portsObjects.get(port).knownDeviceIds.add(address);
     portsObjects.get(port).knownGattIds.add(gattId);
 
+    let session = null;
     function scanResultListener(msg) {
         msg = structuredClone(msg); // todo: is this necessary?
-        if (msg._type === 'scanResult') {
+        if (msg._type === 'scanResult' && isSessionScanResult(msg, session)) {
             msg._type = 'adScanResult';
             msg.subscriptionId = 'scanRequest_'+webId;
             if (msg.bluetoothAddress === address || msg.gattId === gattId) {
@@ -569,26 +716,30 @@ async function watchAdvertisements(port, webId) {
         }
     }
 
-    listeners['dev_'+port.sender.contextId+gattId] = scanResultListener;
+    listeners[listenerKey] = scanResultListener;
     nativePort.onMessage.addListener(scanResultListener);
 
-    await startScanning(port);
+    // only advertisements are needed here, so let the server scan passively unless someone else needs scan responses
+    session = await startScanning(port, { active: false, filters: [{ address: address }] });
+    listenerSessions[listenerKey] = session;
 
     return { currentRecommendedUpdateContents: currentRecommendedUpdateContents };
 }
 
 async function stopAdvertisements(port, webId, stopAll = false) {
     let gattId = await webIdToGattId(webId, port);
-    if ('dev_'+port.sender.contextId+gattId in listeners) {
-        listenercnts['dev_'+port.sender.contextId+gattId]--;
+    const listenerKey = 'dev_' + port.sender.contextId + gattId;
+    if (listenerKey in listeners) {
+        listenercnts[listenerKey]--;
         if (stopAll) {
-            listenercnts['dev_'+port.sender.contextId+gattId] = 0;
+            listenercnts[listenerKey] = 0;
         }
-        if (listenercnts['dev_'+port.sender.contextId+gattId] == 0) {
-            nativePort.onMessage.removeListener(listeners['dev_'+port.sender.contextId+gattId]);
-            delete listeners['dev_'+port.sender.contextId+gattId];
-            delete listenercnts['dev_'+port.sender.contextId+gattId];
-            await stopScanning(port);
+        if (listenercnts[listenerKey] == 0) {
+            nativePort.onMessage.removeListener(listeners[listenerKey]);
+            delete listeners[listenerKey];
+            delete listenercnts[listenerKey];
+            stopScanning(port, listenerSessions[listenerKey]);
+            delete listenerSessions[listenerKey];
         }
     }
 }
@@ -758,6 +909,7 @@ async function startNotifications(port, webId, service, characteristic) {
         device: gattId,
         service: windowsServiceUuid(service),
         characteristic: windowsCharacteristicUuid(characteristic),
+        subscriber: portsObjects.get(port).subscriber,
     }, port);
 
     if (!subscriptions[subscriptionId]) {
@@ -778,12 +930,17 @@ async function stopNotifications(port, webId, service, characteristic) {
             device: gattId,
             service: windowsServiceUuid(service),
             characteristic: windowsCharacteristicUuid(characteristic),
+            subscriber: portsObjects.get(port).subscriber,
         }, port);
     }
 
-    subscriptions[subscriptionId].delete(port);
-    if (!subscriptions[subscriptionId].size) {
+    if (subscriptions[subscriptionId]) {
+        subscriptions[subscriptionId].delete(port);
+    }
+    if (subscriptions[subscriptionId] && !subscriptions[subscriptionId].size) {
         delete subscriptions[subscriptionId];
+        delete notificationSequences[subscriptionId];
+        delete notificationGaps[subscriptionId];
     }
 
     // remove subscriptionOrigins entry and clean up empty keys if needed
@@ -993,7 +1150,8 @@ const exportedMethods = {
 
 chrome.runtime.onConnect.addListener((port) => {
     portsObjects.set(port, {
-        scanCount: 0,
+        subscriber: String(nextSubscriber++),
+        scanSessions: new Set(),
         devices: new Set(),
         subscriptions: new Set(),
         knownDeviceIds: new Set(),
@@ -1020,15 +1178,42 @@ chrome.runtime.onConnect.addListener((port) => {
     }
 
     port.onDisconnect.addListener(() => {
+        // the server disables notifications once no other page is subscribed, unless the whole connection closes anyway
+        const closingNativePort = port.sender.url != browser.runtime.getURL('options.html') && activePorts === 1;
+        const originSubscriptions = subscriptionOrigins[port.sender.origin] || {};
+        for (const gattId of Object.keys(originSubscriptions)) {
+            for (const [service, characteristic, prt] of originSubscriptions[gattId]) {
+                if (prt === port && !closingNativePort) {
+                    nativeRequest('unsubscribe', {
+                        device: gattId,
+                        service: windowsServiceUuid(service),
+                        characteristic: windowsCharacteristicUuid(characteristic),
+                        subscriber: portsObjects.get(port).subscriber,
+                    }, port).catch(() => {});
+                }
+            }
+            originSubscriptions[gattId] = originSubscriptions[gattId].filter(([, , prt]) => prt !== port);
+            if (!originSubscriptions[gattId].length) delete originSubscriptions[gattId];
+        }
+        if (!Object.keys(originSubscriptions).length) delete subscriptionOrigins[port.sender.origin];
+
         for (let gattDevice of portsObjects.get(port).devices.values()) {
             gattDisconnect(port, gattDevice);
         }
-        while (portsObjects.get(port).scanCount > 0) {
-            stopScanning(port);
+        for (const session of Array.from(portsObjects.get(port).scanSessions)) {
+            stopScanning(port, session);
         }
         for (const value of Object.values(subscriptions)) {
             value.delete(port);
         }
+        // nobody is waiting for the page's commands in flight anymore
+        if (nativePort !== null && serverSupports('abort')) {
+            for (const reqId in commandPorts) {
+                if (commandPorts[reqId] === port) {
+                    nativePort.postMessage({ cmd: 'abort', id: Number(reqId), _id: requestId++ });
+                }
+            }
+        }
 
         // close the dedicated host process if nothing else is using it
         if (port.sender.url != browser.runtime.getURL('options.html')) {
@@ -1036,6 +1221,7 @@ chrome.runtime.onConnect.addListener((port) => {
             if (!activePorts) {
                 nativePort.disconnect();
                 nativePort = null;
+                fragmentedMessages = {};
             }
         }
 
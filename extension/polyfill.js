@@ -25,6 +25,19 @@ if (!navigator.bluetooth) {
                         });
                     return;
                 }
+                if (event.data.event === 'serviceChangedEvent') {
+                    const { device, service, change } = event.data;
+                    Array.from(connectedDevices)
+                        .filter(d => d.id === device)
+                        .forEach(matchingDevice => {
+                            matchingDevice.dispatchEvent({
+                                type: 'service' + change,
+                                target: new BluetoothRemoteGATTService(matchingDevice, service, true),
+                                bubbles: true,
+                            });
+                        });
+                    return;
+                }
                 if (event.data.subscriptionId) {
                     const subscription = activeSubscriptions[event.data.subscriptionId];
                     if (subscription) {
@@ -97,13 +110,22 @@ if (!navigator.bluetooth) {
             }
 
             dispatchEvent(event) {
-                event.target = this;
+                // service events keep the service as their target while they bubble to the device
+                if (!event.target) {
+                    event.target = this;
+                }
                 if (event.type === 'characteristicvaluechanged' && this.oncharacteristicvaluechanged) {
                     this.oncharacteristicvaluechanged.call(this, event);
                 } else if (event.type === 'gattserverdisconnected' && this.ongattserverdisconnected ) {
                     this.ongattserverdisconnected.call(this, event);
                 } else if (event.type === 'advertisementreceived' && this.onadvertisementreceived) {
                     this.onadvertisementreceived.call(this, event);
+                } else if (event.type === 'serviceadded' && this.onserviceadded) {
+                    this.onserviceadded.call(this, event);
+                } else if (event.type === 'servicechanged' && this.onservicechanged) {
+                    this.onservicechanged.call(this, event);
+                } else if (event.type === 'serviceremoved' && this.onserviceremoved) {
+                    this.onserviceremoved.call(this, event);
                 }
                 if (!(event.type in this[listeners])) {
                     return true;
@@ -0,0 +1,237 @@
+// Tests for BLEServer/BLEServer/AdvertisementData.h
+//
+// Runs the unit tests below, then feeds every payload in corpus/ (and every truncation and single byte mutation of it)
+// through the parser under AddressSanitizer. Build with -DADVERTISEMENT_DATA_FUZZER and -fsanitize=fuzzer instead to
+// get a libFuzzer target; corpus/ doubles as its seed corpus.
+
+#include "AdvertisementData.h"
+#include "check.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef ADVERTISEMENT_DATA_FUZZER
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	ParsedAdvertisement advertisement;
+	parseAdvertisementData(data, size, advertisement);
+	return 0;
+}
+
+#else
+
+#include <dirent.h>
+
+// The result points into the payload, so keep a copy alive until the next parse
+static bool parse(const std::vector<uint8_t>& payload, ParsedAdvertisement& advertisement) {
+	static std::vector<uint8_t> current;
+	current = payload;
+	return parseAdvertisementData(current.data(), current.size(), advertisement);
+}
+
+static std::string name(const ParsedAdvertisement& advertisement) {
+	return std::string(reinterpret_cast<const char*>(advertisement.localName), advertisement.localNameLength);
+}
+
+static bool uuidEquals(const AdvertisementUuid& uuid, uint32_t data1, uint16_t data2, uint16_t data3, const uint8_t (&data4)[8]) {
+	return uuid.data1 == data1 && uuid.data2 == data2 && uuid.data3 == data3 && memcmp(uuid.data4, data4, 8) == 0;
+}
+
+static bool isShortUuid(const AdvertisementUuid& uuid, uint32_t shortUuid) {
+	AdvertisementUuid expected = shortAdvertisementUuid(shortUuid);
+	return memcmp(&uuid, &expected, sizeof(uuid)) == 0;
+}
+
+static void testBasicFields() {
+	ParsedAdvertisement advertisement;
+	CHECK(parse({
+		0x02, 0x01, 0x06,             // flags
+		0x05, 0x03, 0x0d, 0x18, 0x0f, 0x18, // heart rate, battery
+		0x02, 0x0a, 0xf4,             // tx power -12
+		0x03, 0x19, 0x41, 0x03,       // appearance 0x0341
+		0x05, 0x09, 'H', 'R', 'M', '1', // complete local name
+	}, advertisement));
+	CHECK(advertisement.hasFlags && advertisement.flags == 0x06);
+	CHECK(advertisement.serviceUuids.size() == 2);
+	CHECK(isShortUuid(advertisement.serviceUuids[0], 0x180d));
+	CHECK(isShortUuid(advertisement.serviceUuids[1], 0x180f));
+	CHECK(advertisement.hasTxPower && advertisement.txPower == -12);
+	CHECK(advertisement.hasAppearance && advertisement.appearance == 0x0341);
+	CHECK(name(advertisement) == "HRM1" && advertisement.localNameComplete);
+	CHECK(advertisement.sections.size() == 5);
+	CHECK(advertisement.sections[0].type == 0x01 && advertisement.sections[0].length == 1);
+}
+
+static void testLocalNamePrecedence() {
+	ParsedAdvertisement advertisement;
+	CHECK(parse({ 0x03, 0x08, 'A', 'B', 0x05, 0x09, 'A', 'B', 'C', 'D', 0x02, 0x08, 'X' }, advertisement));
+	CHECK(name(advertisement) == "ABCD");
+
+	CHECK(parse({ 0x03, 0x08, 'A', 'B' }, advertisement));
+	CHECK(name(advertisement) == "AB" && !advertisement.localNameComplete);
+}
+
+static void testServiceUuids() {
+	ParsedAdvertisement advertisement;
+	// Nordic UART service 6e400001-b5a3-f393-e0a9-e50e24dcca9e, least significant byte first
+	CHECK(parse({
+		0x11, 0x07, 0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0x01, 0x00, 0x40, 0x6e,
+		0x05, 0x05, 0x78, 0x56, 0x34, 0x12,
+	}, advertisement));
+	CHECK(advertisement.serviceUuids.size() == 2);
+	CHECK(uuidEquals(advertisement.serviceUuids[0], 0x6e400001, 0xb5a3, 0xf393, { 0xe0, 0xa9, 0xe5, 0x0e, 0x24, 0xdc, 0xca, 0x9e }));
+	CHECK(isShortUuid(advertisement.serviceUuids[1], 0x12345678));
+}
+
+static void testServiceAndManufacturerData() {
+	ParsedAdvertisement advertisement;
+	CHECK(parse({
+		0x05, 0x16, 0x9f, 0xfe, 0xaa, 0xbb,       // service data 0xfe9f
+		0x06, 0x20, 0x04, 0x03, 0x02, 0x01, 0xcc, // service data 0x01020304
+		0x12, 0x21, 0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0x01, 0x00, 0x40, 0x6e, 0xdd,
+		0x05, 0xff, 0x4c, 0x00, 0x02, 0x15,       // Apple
+	}, advertisement));
+	CHECK(advertisement.serviceData.size() == 3);
+	CHECK(advertisement.serviceData[0].uuidLength == 2 && advertisement.serviceData[0].shortUuid == 0xfe9f);
+	CHECK(isShortUuid(advertisement.serviceData[0].uuid, 0xfe9f));
+	CHECK(advertisement.serviceData[0].length == 2 && advertisement.serviceData[0].data[0] == 0xaa && advertisement.serviceData[0].data[1] == 0xbb);
+	CHECK(advertisement.serviceData[1].uuidLength == 4 && advertisement.serviceData[1].shortUuid == 0x01020304);
+	CHECK(advertisement.serviceData[1].length == 1 && advertisement.serviceData[1].data[0] == 0xcc);
+	CHECK(advertisement.serviceData[2].uuidLength == 16);
+	CHECK(uuidEquals(advertisement.serviceData[2].uuid, 0x6e400001, 0xb5a3, 0xf393, { 0xe0, 0xa9, 0xe5, 0x0e, 0x24, 0xdc, 0xca, 0x9e }));
+	CHECK(advertisement.serviceData[2].length == 1 && advertisement.serviceData[2].data[0] == 0xdd);
+	CHECK(advertisement.manufacturerData.size() == 1);
+	CHECK(advertisement.manufacturerData[0].companyIdentifier == 0x004c);
+	CHECK(advertisement.manufacturerData[0].length == 2 && advertisement.manufacturerData[0].data[0] == 0x02);
+}
+
+static void testShortStructuresAreSkipped() {
+	ParsedAdvertisement advertisement;
+	CHECK(parse({
+		0x01, 0x01,             // flags without a value
+		0x02, 0xff, 0x4c,       // manufacturer data without a full company identifier
+		0x02, 0x16, 0x0d,       // service data without a full UUID
+		0x04, 0x03, 0x0d, 0x18, 0x0f, // trailing partial UUID
+		0x02, 0x19, 0x41,       // appearance without a full value
+	}, advertisement));
+	CHECK(!advertisement.hasFlags);
+	CHECK(advertisement.manufacturerData.empty());
+	CHECK(advertisement.serviceData.empty());
+	CHECK(advertisement.serviceUuids.size() == 1 && isShortUuid(advertisement.serviceUuids[0], 0x180d));
+	CHECK(!advertisement.hasAppearance);
+	CHECK(advertisement.sections.size() == 5);
+}
+
+static void testTruncatedAndTerminatedPayloads() {
+	ParsedAdvertisement advertisement;
+	CHECK(!parse({ 0x02, 0x01, 0x06, 0x05, 0x09, 'A' }, advertisement));
+	CHECK(advertisement.hasFlags && advertisement.localName == nullptr);
+
+	// a zero length ends the significant part, whatever follows is padding
+	CHECK(parse({ 0x02, 0x01, 0x06, 0x00, 0x05, 0x09, 'A' }, advertisement));
+	CHECK(advertisement.sections.size() == 1 && advertisement.localName == nullptr);
+
+	CHECK(parse({}, advertisement));
+	CHECK(advertisement.sections.empty());
+}
+
+static void testReuseClearsPreviousResult() {
+	ParsedAdvertisement advertisement;
+	CHECK(parse({ 0x02, 0x01, 0x06, 0x03, 0x09, 'A', 'B', 0x04, 0xff, 0x4c, 0x00, 0x01 }, advertisement));
+	CHECK(parse({ 0x03, 0x19, 0x41, 0x03 }, advertisement));
+	CHECK(!advertisement.hasFlags && advertisement.localName == nullptr && advertisement.manufacturerData.empty());
+	CHECK(advertisement.hasAppearance && advertisement.sections.size() == 1);
+}
+
+// Hex bytes separated by whitespace, # starts a comment
+static std::vector<uint8_t> readCorpusFile(const std::string& path) {
+	std::ifstream file(path);
+	std::vector<uint8_t> payload;
+	std::string line;
+	while (std::getline(file, line)) {
+		std::istringstream words(line.substr(0, line.find('#')));
+		std::string word;
+		while (words >> word) {
+			payload.push_back((uint8_t)strtoul(word.c_str(), nullptr, 16));
+		}
+	}
+	return payload;
+}
+
+// Every field must point inside the payload, whatever the input
+static void checkBounds(const std::vector<uint8_t>& payload, const ParsedAdvertisement& advertisement) {
+	const uint8_t* begin = payload.data();
+	const uint8_t* end = begin + payload.size();
+	auto inside = [&](const uint8_t* data, size_t length) {
+		return length == 0 || (data >= begin && data + length <= end);
+	};
+	CHECK(inside(advertisement.localName, advertisement.localNameLength));
+	for (auto& section : advertisement.sections) {
+		CHECK(inside(section.data, section.length));
+	}
+	for (auto& manufacturerData : advertisement.manufacturerData) {
+		CHECK(inside(manufacturerData.data, manufacturerData.length));
+	}
+	for (auto& serviceData : advertisement.serviceData) {
+		CHECK(inside(serviceData.data, serviceData.length));
+	}
+}
+
+static void fuzzCorpus(const std::string& directory) {
+	DIR* dir = opendir(directory.c_str());
+	if (dir == nullptr) {
+		fprintf(stderr, "Unable to open corpus directory %s\n", directory.c_str());
+		failures++;
+		return;
+	}
+
+	ParsedAdvertisement advertisement;
+	int files = 0;
+	while (dirent* entry = readdir(dir)) {
+		std::string fileName = entry->d_name;
+		if (fileName.size() < 4 || fileName.compare(fileName.size() - 4, 4, ".hex") != 0) {
+			continue;
+		}
+		files++;
+		auto payload = readCorpusFile(directory + "/" + fileName);
+		CHECK(!payload.empty());
+
+		for (size_t length = 0; length <= payload.size(); length++) {
+			// copy so that reading past the truncated length is caught by AddressSanitizer
+			std::vector<uint8_t> truncated(payload.begin(), payload.begin() + length);
+			parseAdvertisementData(truncated.data(), truncated.size(), advertisement);
+			checkBounds(truncated, advertisement);
+		}
+		for (size_t i = 0; i < payload.size(); i++) {
+			for (uint8_t value : { (uint8_t)0x00, (uint8_t)0x01, (uint8_t)0x7f, (uint8_t)0xff, (uint8_t)(payload[i] ^ 0x80) }) {
+				std::vector<uint8_t> mutated = payload;
+				mutated[i] = value;
+				parseAdvertisementData(mutated.data(), mutated.size(), advertisement);
+				checkBounds(mutated, advertisement);
+			}
+		}
+	}
+	closedir(dir);
+	CHECK(files > 0);
+	printf("%d corpus files\n", files);
+}
+
+int main(int argc, char** argv) {
+	testBasicFields();
+	testLocalNamePrecedence();
+	testServiceUuids();
+	testServiceAndManufacturerData();
+	testShortStructuresAreSkipped();
+	testTruncatedAndTerminatedPayloads();
+	testReuseClearsPreviousResult();
+	fuzzCorpus(argc > 1 ? argv[1] : "tests/advertisement-data/corpus");
+
+	return checkResult("advertisement data");
+}
+
+#endif
@@ -0,0 +1,96 @@
+// Tests for BLEServer/BLEServer/BoundedQueue.h
+//
+// tests/native/run.sh builds it with -fsanitize=thread to check the memory ordering as well.
+
+#include "BoundedQueue.h"
+#include "check.h"
+
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+static void testFifoAndCapacity() {
+	BoundedQueue<int> queue(4);
+	CHECK(queue.capacity() == 4);
+	for (int i = 0; i < 4; i++) {
+		CHECK(queue.tryPush(i));
+	}
+	CHECK(!queue.tryPush(4));
+	CHECK(queue.approximateSize() == 4);
+
+	int value = -1;
+	CHECK(queue.tryPop(value) && value == 0);
+	CHECK(queue.tryPush(4));
+	for (int i = 1; i <= 4; i++) {
+		CHECK(queue.tryPop(value) && value == i);
+	}
+	CHECK(!queue.tryPop(value));
+	CHECK(queue.approximateSize() == 0);
+}
+
+// Every pushed value must be popped exactly once, in order per producer
+static void testConcurrentProducersAndConsumers() {
+	const int PRODUCERS = 4;
+	const int CONSUMERS = 4;
+	const int VALUES_PER_PRODUCER = 100000;
+
+	BoundedQueue<long long> queue(256);
+	std::vector<std::vector<int>> seen(CONSUMERS, std::vector<int>(PRODUCERS * VALUES_PER_PRODUCER, 0));
+	std::vector<std::vector<long long>> lastValue(CONSUMERS, std::vector<long long>(PRODUCERS, -1));
+	std::vector<int> outOfOrder(CONSUMERS, 0);
+
+	std::vector<std::thread> threads;
+	for (int producer = 0; producer < PRODUCERS; producer++) {
+		threads.emplace_back([&queue, producer] {
+			for (long long i = 0; i < VALUES_PER_PRODUCER; i++) {
+				while (!queue.tryPush(producer * (long long)VALUES_PER_PRODUCER + i)) {
+					std::this_thread::yield();
+				}
+			}
+		});
+	}
+	std::atomic<int> popped(0);
+	for (int consumer = 0; consumer < CONSUMERS; consumer++) {
+		threads.emplace_back([&, consumer] {
+			long long value;
+			while (popped.load() < PRODUCERS * VALUES_PER_PRODUCER) {
+				if (!queue.tryPop(value)) {
+					std::this_thread::yield();
+					continue;
+				}
+				popped++;
+				seen[consumer][value]++;
+				int producer = (int)(value / VALUES_PER_PRODUCER);
+				if (value <= lastValue[consumer][producer]) {
+					outOfOrder[consumer]++;
+				}
+				lastValue[consumer][producer] = value;
+			}
+		});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	for (int value = 0; value < PRODUCERS * VALUES_PER_PRODUCER; value++) {
+		int count = 0;
+		for (int consumer = 0; consumer < CONSUMERS; consumer++) {
+			count += seen[consumer][value];
+		}
+		if (count != 1) {
+			fprintf(stderr, "value %d popped %d times\n", value, count);
+			failures++;
+			break;
+		}
+	}
+	for (int consumer = 0; consumer < CONSUMERS; consumer++) {
+		CHECK(outOfOrder[consumer] == 0);
+	}
+}
+
+int main() {
+	testFifoAndCapacity();
+	testConcurrentProducersAndConsumers();
+
+	return checkResult("bounded queue");
+}
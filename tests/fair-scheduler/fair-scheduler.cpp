@@ -0,0 +1,213 @@
+// Tests for BLEServer/BLEServer/FairScheduler.h
+
+#include "FairScheduler.h"
+#include "check.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+typedef FairScheduler<std::string, int> Scheduler;
+
+static FairSchedulerLimits unlimited() {
+	FairSchedulerLimits limits;
+	limits.maxInFlight = 1000;
+	limits.maxQueued = 1000;
+	return limits;
+}
+
+// Starts and completes everything runnable, returning the flows in the order they were served
+static std::string drain(Scheduler& scheduler, uint64_t nowUs) {
+	std::string order;
+	std::string key;
+	int item;
+	while (scheduler.next(nowUs, key, item)) {
+		order += key;
+		scheduler.complete(key);
+	}
+	return order;
+}
+
+static void testFloodDoesNotStarveOthers() {
+	Scheduler scheduler;
+	scheduler.setLimits(unlimited());
+	for (int i = 0; i < 100; i++) {
+		CHECK(scheduler.enqueue("a", i, 0));
+	}
+	CHECK(scheduler.enqueue("b", 0, 0));
+	CHECK(scheduler.enqueue("b", 1, 0));
+	// b's two commands are served within the first few, not after a's hundred
+	std::string order = drain(scheduler, 0);
+	CHECK(order.size() == 102);
+	CHECK(order.find_last_of('b') < 4);
+}
+
+static void testFifoWithinFlow() {
+	Scheduler scheduler;
+	scheduler.setLimits(unlimited());
+	for (int i = 0; i < 5; i++) {
+		scheduler.enqueue("a", i, 0);
+	}
+	std::string key;
+	int item;
+	for (int i = 0; i < 5; i++) {
+		CHECK(scheduler.next(0, key, item) && item == i);
+	}
+	CHECK(!scheduler.next(0, key, item));
+}
+
+static void testWeights() {
+	Scheduler scheduler;
+	scheduler.setLimits(unlimited());
+	for (int i = 0; i < 30; i++) {
+		scheduler.enqueue("a", i, 0, 2);
+		scheduler.enqueue("b", i, 0, 1);
+	}
+	std::string order = drain(scheduler, 0).substr(0, 30);
+	size_t servedA = 0;
+	for (char c : order) {
+		servedA += c == 'a' ? 1 : 0;
+	}
+	CHECK(servedA == 20);
+}
+
+static void testIdleFlowSavesNoCredit() {
+	Scheduler scheduler;
+	scheduler.setLimits(unlimited());
+	for (int i = 0; i < 10; i++) {
+		scheduler.enqueue("a", i, 0);
+	}
+	drain(scheduler, 0);
+	// b was idle while a ran alone, it doesn't get to run ten in a row now
+	for (int i = 0; i < 10; i++) {
+		scheduler.enqueue("a", i, 0);
+		scheduler.enqueue("b", i, 0);
+	}
+	std::string order = drain(scheduler, 0);
+	CHECK(order.substr(0, 4).find('a') != std::string::npos);
+}
+
+static void testInFlightLimit() {
+	Scheduler scheduler;
+	FairSchedulerLimits limits = unlimited();
+	limits.maxInFlight = 2;
+	scheduler.setLimits(limits);
+	for (int i = 0; i < 5; i++) {
+		scheduler.enqueue("a", i, 0);
+	}
+	scheduler.enqueue("b", 0, 0);
+	std::string key;
+	int item;
+	std::string started;
+	while (scheduler.next(0, key, item)) {
+		started += key;
+	}
+	CHECK(started == "aab" || started == "aba" || started == "baa");
+	scheduler.complete("a");
+	CHECK(scheduler.next(0, key, item) && key == "a");
+	CHECK(!scheduler.next(0, key, item));
+
+	auto usage = scheduler.usage();
+	CHECK(usage.size() == 2 && usage[0].first == "a");
+	CHECK(usage[0].second.inFlight == 2 && usage[0].second.peakInFlight == 2);
+	CHECK(usage[0].second.queued == 2 && usage[0].second.completed == 1 && usage[0].second.started == 3);
+}
+
+static void testRateCap() {
+	Scheduler scheduler;
+	FairSchedulerLimits limits = unlimited();
+	limits.ratePerSecond = 10;
+	limits.burst = 2;
+	scheduler.setLimits(limits);
+	for (int i = 0; i < 5; i++) {
+		scheduler.enqueue("a", i, 0);
+	}
+	CHECK(drain(scheduler, 0) == "aa");
+	uint64_t readyUs = 0;
+	CHECK(scheduler.nextReadyUs(0, readyUs) && readyUs > 99000 && readyUs < 101000);
+	CHECK(drain(scheduler, 50000) == "");
+	CHECK(drain(scheduler, readyUs) == "a");
+	// two tokens at most, however long the flow waited
+	CHECK(drain(scheduler, 10000000) == "aa");
+	CHECK(!scheduler.nextReadyUs(10000000, readyUs));
+
+	auto usage = scheduler.usage();
+	CHECK(usage[0].second.throttled == 2);
+	CHECK(usage[0].second.maxQueueWaitUs == 10000000);
+}
+
+static void testQueueLimitAndRemoval() {
+	Scheduler scheduler;
+	FairSchedulerLimits limits = unlimited();
+	limits.maxQueued = 3;
+	scheduler.setLimits(limits);
+	for (int i = 0; i < 3; i++) {
+		CHECK(scheduler.enqueue("a", i, 0));
+	}
+	CHECK(!scheduler.enqueue("a", 3, 0));
+	CHECK(scheduler.enqueue("b", 0, 0));
+
+	auto removed = scheduler.removeQueued([](const std::string& key, int item) {
+		return key == "a" && item == 1;
+	});
+	CHECK(removed.size() == 1 && removed[0] == 1);
+	removed = scheduler.removeFlows([](const std::string& key) {
+		return key == "a";
+	});
+	CHECK(removed.size() == 2 && removed[0] == 0 && removed[1] == 2);
+
+	auto usage = scheduler.usage();
+	CHECK(usage.size() == 1 && usage[0].first == "b");
+	CHECK(drain(scheduler, 0) == "b");
+	// completing an item of a removed flow is ignored
+	scheduler.complete("a");
+}
+
+static void testCountersSurviveIdleFlows() {
+	Scheduler scheduler;
+	scheduler.setLimits(unlimited());
+	scheduler.enqueue("a", 0, 0);
+	scheduler.enqueue("b", 0, 0);
+	CHECK(drain(scheduler, 0) == "ab");
+	std::string key;
+	int item;
+	CHECK(!scheduler.next(0, key, item));
+	scheduler.enqueue("a", 1, 0);
+	CHECK(drain(scheduler, 0) == "a");
+
+	auto usage = scheduler.usage();
+	CHECK(usage.size() == 2 && usage[0].first == "a" && usage[1].first == "b");
+	CHECK(usage[0].second.submitted == 2 && usage[0].second.completed == 2 && usage[0].second.inFlight == 0);
+	CHECK(usage[1].second.submitted == 1 && usage[1].second.completed == 1);
+
+	// going idle doesn't refill a rate capped flow's bucket
+	FairSchedulerLimits limits = unlimited();
+	limits.ratePerSecond = 10;
+	limits.burst = 2;
+	scheduler.setLimits(limits);
+	scheduler.enqueue("c", 0, 0);
+	scheduler.enqueue("c", 1, 0);
+	CHECK(drain(scheduler, 0) == "cc");
+	CHECK(!scheduler.next(50000, key, item));
+	scheduler.enqueue("c", 2, 50000);
+	CHECK(drain(scheduler, 50000) == "");
+	CHECK(drain(scheduler, 101000) == "c");
+
+	scheduler.removeFlows([](const std::string& key) {
+		return key == "a";
+	});
+	CHECK(scheduler.usage().size() == 2);
+}
+
+int main() {
+	testFloodDoesNotStarveOthers();
+	testFifoWithinFlow();
+	testWeights();
+	testIdleFlowSavesNoCredit();
+	testInFlightLimit();
+	testRateCap();
+	testQueueLimitAndRemoval();
+	testCountersSurviveIdleFlows();
+
+	return checkResult("fair scheduler");
+}
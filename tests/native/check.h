@@ -0,0 +1,28 @@
+// Harness shared by the tests of the BLEServer headers that don't depend on Windows. tests/native/run.sh builds and
+// runs each of them:
+//
+//   npm run test:native
+
+#pragma once
+
+#include <cstdio>
+
+static int failures = 0;
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); \
+			failures++; \
+		} \
+	} while (0)
+
+// The exit code of the test program
+static int checkResult(const char* suite) {
+	if (failures > 0) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("All %s tests passed\n", suite);
+	return 0;
+}
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Builds each native test with the sanitizer that fits it and runs it, stopping at the first failure.
+set -e
+cd "$(dirname "$0")/../.."
+
+build() {
+	name=$1
+	shift
+	g++ -std=c++14 -Wall -Wextra -g -IBLEServer/BLEServer -Itests/native "$@" -o "tests/$name/$name" "tests/$name/$name.cpp"
+}
+
+build advertisement-data -fsanitize=address,undefined
+tests/advertisement-data/advertisement-data tests/advertisement-data/corpus
+
+build bounded-queue -O1 -fsanitize=thread -pthread
+tests/bounded-queue/bounded-queue
+
+build tracing -O1 -fsanitize=thread -pthread
+tests/tracing/tracing
+
+build fair-scheduler -fsanitize=address,undefined
+tests/fair-scheduler/fair-scheduler
@@ -9,7 +9,7 @@ describe('requestDevice', () => {
         const background = new BackgroundDriver();
         const bluetooth = new PolyfillDriver(background).bluetooth;
         bluetooth.requestDevice({ filters: [] });
-        expect(background.nativePort.postMessage).toHaveBeenCalledWith({ cmd: 'scan', _id: 1 });
+        expect(background.nativePort.postMessage).toHaveBeenCalledWith({ cmd: 'scan', active: true, filters: [], _id: 1 });
     });
 
     it('should return devices matching the given filters', async () => {
@@ -0,0 +1,113 @@
+// Tests for BLEServer/BLEServer/Tracing.h
+//
+// tests/native/run.sh builds it with -fsanitize=thread to check the slot locking as well.
+
+#include "Tracing.h"
+#include "check.h"
+
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+static TraceSpan makeSpan(const char* name, uint64_t start, int64_t commandId, const char* device) {
+	TraceSpan span;
+	copyTraceString(span.name, name);
+	copyTraceString(span.device, device);
+	span.startUs = start;
+	span.durationUs = 5;
+	span.threadId = 7;
+	span.clientId = 1;
+	span.commandId = commandId;
+	return span;
+}
+
+static void testRetainsNewestInOrder() {
+	TraceRing ring(4);
+	CHECK(ring.snapshot().empty());
+	for (uint64_t i = 0; i < 3; i++) {
+		ring.record(makeSpan("span", i, -1, ""));
+	}
+	auto spans = ring.snapshot();
+	CHECK(spans.size() == 3);
+	CHECK(spans[0].startUs == 0 && spans[2].startUs == 2);
+
+	for (uint64_t i = 3; i < 10; i++) {
+		ring.record(makeSpan("span", i, -1, ""));
+	}
+	spans = ring.snapshot();
+	CHECK(spans.size() == 4);
+	for (size_t i = 0; i < spans.size(); i++) {
+		CHECK(spans[i].startUs == 6 + i);
+	}
+	CHECK(ring.recorded() == 10);
+}
+
+static void testCopyTruncates() {
+	char small[6];
+	copyTraceString(small, "abcdefgh");
+	CHECK(strcmp(small, "abcde") == 0);
+	copyTraceString(small, "abc");
+	CHECK(strcmp(small, "abc") == 0);
+	// "abc" followed by the 3 byte UTF-8 encoding of U+20AC, which doesn't fit
+	copyTraceString(small, "abc\xe2\x82\xac");
+	CHECK(strcmp(small, "abc") == 0);
+}
+
+static void testChromeTraceJson() {
+	std::vector<TraceSpan> spans;
+	spans.push_back(makeSpan("gatt.read", 100, 12, "BluetoothLE#\"dev\\1\""));
+	spans.push_back(makeSpan("frame.read", 200, -1, ""));
+	std::string json = chromeTraceJson(spans, 42);
+	CHECK(json ==
+		"{\"displayTimeUnit\":\"ms\",\"traceEvents\":["
+		"{\"name\":\"gatt.read\",\"ph\":\"b\",\"ts\":100,\"pid\":42,\"tid\":7,\"cat\":\"command\",\"id\":\"1/12\","
+		"\"args\":{\"id\":12,\"client\":1,\"device\":\"BluetoothLE#\\\"dev\\\\1\\\"\"}},"
+		"{\"name\":\"gatt.read\",\"ph\":\"e\",\"ts\":105,\"pid\":42,\"tid\":7,\"cat\":\"command\",\"id\":\"1/12\","
+		"\"args\":{\"id\":12,\"client\":1,\"device\":\"BluetoothLE#\\\"dev\\\\1\\\"\"}},"
+		"{\"name\":\"frame.read\",\"ph\":\"X\",\"ts\":200,\"dur\":5,\"pid\":42,\"tid\":7,\"args\":{}}"
+		"]}");
+
+	spans.clear();
+	spans.push_back(makeSpan("parse", 0, -1, "AA:BB"));
+	CHECK(chromeTraceJson(spans, 1).find("\"args\":{\"device\":\"AA:BB\"}") != std::string::npos);
+
+	spans.clear();
+	spans.push_back(makeSpan("ctl\x01", 0, -1, ""));
+	CHECK(chromeTraceJson(spans, 1).find("\"ctl\\u0001\"") != std::string::npos);
+}
+
+static void testConcurrentRecording() {
+	const int threads = 4;
+	const int spansPerThread = 20000;
+	TraceRing ring(256);
+	std::vector<std::thread> writers;
+	for (int t = 0; t < threads; t++) {
+		writers.push_back(std::thread([&ring, t] {
+			for (int i = 0; i < spansPerThread; i++) {
+				ring.record(makeSpan("concurrent", (uint64_t)i, t, "device"));
+			}
+		}));
+	}
+	// snapshots while the writers run must only ever see whole spans
+	for (int i = 0; i < 50; i++) {
+		for (auto& span : ring.snapshot()) {
+			CHECK(strcmp(span.name, "concurrent") == 0 && strcmp(span.device, "device") == 0);
+			CHECK(span.commandId >= 0 && span.commandId < threads);
+		}
+	}
+	for (auto& writer : writers) {
+		writer.join();
+	}
+	CHECK(ring.recorded() == (uint64_t)threads * spansPerThread);
+	CHECK(ring.snapshot().size() == 256);
+}
+
+int main() {
+	testRetainsNewestInOrder();
+	testCopyTruncates();
+	testChromeTraceJson();
+	testConcurrentRecording();
+
+	return checkResult("tracing");
+}
@@ -8,6 +8,9 @@ infiles = ['service_uuids', 'characteristic_uuids', 'descriptors']
 outfiles = ['gatt-services', 'gatt-characteristics', 'gatt-descriptors']
 varnames = ['SERVICES', 'CHARACTERISTICS', 'DESCRIPTORS']
 
+# short UUIDs of every standard item, used by BLEServer to intern their string forms
+shortuuids = set()
+
 for i in range(3):
     items = yaml.load(open('Bluetooth_SIG_UUIDs/assigned_numbers/uuids/'+infiles[i]+'.yaml', encoding='utf8'), Loader=yaml.Loader)
 
@@ -27,6 +30,7 @@ for i in range(3):
             desid = "'"+desid+"'"
 
         itemsout[desid] = hex(item['uuid']).upper().replace('X', 'x')
+        shortuuids.add(item['uuid'])
 
     # generate the final output file
     # beginning of the file
@@ -35,9 +39,20 @@ for i in range(3):
     # manually add some items to the end of characteristics list for compatibility with Chrome
     additionalcharacteristics = ''
     if varnames[i] == 'CHARACTERISTICS':
+        shortuuids.update([0x2AA6, 0x2AB1, 0x2A58, 0x2A56, 0x2A95, 0x2AA0, 0x2AA1])
         additionalcharacteristics = ",\n    // the following were renamed in or removed from the spec but Chrome still ships them\n    'gap.central_address_resolution_support': 0x2AA6,\n    'local_east_coordinate.xml': 0x2AB1,\n    analog: 0x2A58,\n    digital: 0x2A56,\n    two_zone_heart_rate_limit: 0x2A95,\n    magnetic_flux_density_2D: 0x2AA0,\n    magnetic_flux_density_3D: 0x2AA1"
 
     # convert the JSON format to a JS file format
     result = result+dumps(dict(sorted(itemsout.items()))).replace('"', '').replace(',', ",\n   ").replace('{', '{\n    ').replace('}', additionalcharacteristics+',\n}').replace('\\', '')+';\n'
 
-    open('extension/'+outfiles[i]+'.js', 'w').write(result)
\ No newline at end of file
+    open('extension/'+outfiles[i]+'.js', 'w').write(result)
+
+# generate the sorted short UUID table for BLEServer
+result = '// Do not manually edit this file. Contents generated by ../../update_uuids.py from https://bitbucket.org/bluetooth-SIG/public/src/main/assigned_numbers/uuids/\n'
+result += '// Sorted short UUIDs of the standard GATT services, characteristics and descriptors.\n\n#pragma once\n\nconst unsigned short STANDARD_GATT_SHORT_UUIDS[] = {\n'
+shortuuids = sorted(shortuuids)
+for i in range(0, len(shortuuids), 8):
+    result += '\t' + ', '.join('0x%04X' % uuid for uuid in shortuuids[i:i+8]) + ',\n'
+result += '};\n'
+
+open('BLEServer/BLEServer/gatt-uuids.h', 'w').write(result)
\ No newline at end of file